@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include "atlas.h"
+#include "copng.h"
+#include "json.h"
+
+namespace {
+  constexpr size_t rgbaBytes = 4;
+
+  // Every sprite has to share the atlas format, so whatever comes in is
+  // expanded (or stripped) to 8 bit RGBA the way libpng's png_set_expand,
+  // png_set_strip_16 and png_set_gray_to_rgb would. Raw rows hold one
+  // sample per byte below 8 bits and big endian pairs at 16
+  void rowToRgba(const RawImage& image, png_uint_32 y, png_bytep out) {
+    const Tiles::PixelFormat& format = image.format;
+    const png_byte* in = image.pixels.data() + (size_t)y * image.width * format.pixelBytes;
+    unsigned depth = format.bitDepth;
+    unsigned maxValue = (1u << depth) - 1;
+    auto sample = [&](size_t pixel, unsigned channel) -> unsigned {
+      const png_byte* at = in + pixel * format.pixelBytes;
+      return depth == 16 ? at[channel * 2] << 8 | at[channel * 2 + 1] : at[channel];
+    };
+    auto to8 = [&](unsigned value) -> png_byte {
+      return depth == 16 ? value >> 8 : depth == 8 ? value : value * 255 / maxValue;
+    };
+
+    for (png_uint_32 x = 0; x < image.width; ++x, out += rgbaBytes) {
+      switch (format.colorType) {
+        case PNG_COLOR_TYPE_PALETTE: {
+          unsigned index = sample(x, 0);
+          png_color color = index < format.palette.size() ? format.palette[index] : png_color{};
+          out[0] = color.red;
+          out[1] = color.green;
+          out[2] = color.blue;
+          out[3] = index < format.transAlpha.size() ? format.transAlpha[index] : 255;
+          break;
+        }
+        case PNG_COLOR_TYPE_GRAY: {
+          unsigned gray = sample(x, 0);
+          out[0] = out[1] = out[2] = to8(gray);
+          out[3] = format.hasTrans && gray == format.transColor.gray ? 0 : 255;
+          break;
+        }
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+          out[0] = out[1] = out[2] = to8(sample(x, 0));
+          out[3] = to8(sample(x, 1));
+          break;
+        case PNG_COLOR_TYPE_RGB: {
+          unsigned red = sample(x, 0), green = sample(x, 1), blue = sample(x, 2);
+          out[0] = to8(red);
+          out[1] = to8(green);
+          out[2] = to8(blue);
+          out[3] = format.hasTrans && red == format.transColor.red &&
+              green == format.transColor.green && blue == format.transColor.blue ? 0 : 255;
+          break;
+        }
+        case PNG_COLOR_TYPE_RGB_ALPHA:
+          for (unsigned c = 0; c < rgbaBytes; ++c) {
+            out[c] = to8(sample(x, c));
+          }
+          break;
+        default:
+          throw std::runtime_error("Can't convert image to RGBA");
+      }
+    }
+  }
+};
+
+AtlasWriter::AtlasWriter(std::string _prefix, png_uint_32 _width, png_uint_32 _height)
+    : prefix(std::move(_prefix)), width(_width), height(_height) {
+  if (width == 0 || height == 0) {
+    throw std::runtime_error("Atlas size must be greater than 0");
+  }
+}
+
+AtlasWriter::~AtlasWriter() {
+  if (png_write_ptr) {
+    png_destroy_write_struct(&png_write_ptr, &info_write_ptr);
+  }
+  if (outFilePtr) {
+    fclose(outFilePtr);
+  }
+}
+
+void AtlasWriter::add(size_t index, const std::string& name, std::shared_ptr<const RawImage> image) {
+  if (image->width > width || image->height > height) {
+    throw std::runtime_error("Image is larger than the atlas");
+  }
+  std::lock_guard lock(mutex);
+  if (index < nextIndex) {
+    return; // skipped already
+  }
+  waiting.emplace(index, Sprite{.name = name, .width = image->width, .height = image->height,
+      .image = std::move(image)});
+  placeReady();
+}
+
+void AtlasWriter::skip(size_t index) {
+  std::lock_guard lock(mutex);
+  if (index < nextIndex) {
+    return;
+  }
+  waiting.emplace(index, Sprite{});
+  placeReady();
+}
+
+void AtlasWriter::placeReady() {
+  while (!waiting.empty() && waiting.begin()->first == nextIndex) {
+    Sprite sprite = std::move(waiting.begin()->second);
+    waiting.erase(waiting.begin());
+    ++nextIndex;
+    if (sprite.image) {
+      place(sprite);
+      sprites.push_back(std::move(sprite));
+    }
+  }
+}
+
+void AtlasWriter::place(Sprite& sprite) {
+  if (!outFilePtr) {
+    openAtlas();
+  }
+  if (bandX + sprite.width > width) {
+    flushBand();
+  }
+  if (rowsWritten + std::max(bandHeight, sprite.height) > height) {
+    // The open shelf can't grow enough, try a new one below it, and
+    // failing that a new atlas
+    flushBand();
+    if (rowsWritten + sprite.height > height) {
+      closeAtlas();
+      openAtlas();
+    }
+  }
+
+  size_t stride = (size_t)width * rgbaBytes;
+  if (sprite.height > bandHeight) {
+    bandHeight = sprite.height;
+    band.resize(bandHeight * stride, 0);
+  }
+  for (png_uint_32 y = 0; y < sprite.height; ++y) {
+    rowToRgba(*sprite.image, y, band.data() + y * stride + bandX * rgbaBytes);
+  }
+  sprite.atlas = atlasCount - 1;
+  sprite.x = bandX;
+  sprite.y = rowsWritten;
+  // Done with its pixels
+  sprite.image = nullptr;
+  bandX += sprite.width;
+}
+
+void AtlasWriter::openAtlas() {
+  std::string outFile = prefix + "-" + std::to_string(atlasCount) + ".png";
+  outFilePtr = fopen(outFile.c_str(), "wb");
+  if (outFilePtr == nullptr) {
+    throw std::runtime_error("Can't open " + outFile + " to write");
+  }
+  png_write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, (png_voidp)nullptr,
+      png_err, NULL);
+  if (!png_write_ptr) {
+    throw std::runtime_error("Error creating ping write info ptr");
+  }
+  info_write_ptr = png_create_info_struct(png_write_ptr);
+  if (!info_write_ptr) {
+    throw std::runtime_error("Error creating ping write info ptr");
+  }
+  png_init_io(png_write_ptr, outFilePtr);
+  png_set_IHDR(png_write_ptr, info_write_ptr, width, height, 8, PNG_COLOR_TYPE_RGBA,
+      PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_write_ptr, info_write_ptr);
+  rowsWritten = 0;
+  ++atlasCount;
+}
+
+void AtlasWriter::flushBand() {
+  size_t stride = (size_t)width * rgbaBytes;
+  for (png_uint_32 y = 0; y < bandHeight; ++y) {
+    png_write_row(png_write_ptr, band.data() + y * stride);
+  }
+  rowsWritten += bandHeight;
+  // Cleared rather than freed, the next band is likely about as tall
+  band.clear();
+  bandHeight = 0;
+  bandX = 0;
+}
+
+void AtlasWriter::closeAtlas() {
+  flushBand();
+  // Fixed size pages, the height went into the header before any sprite
+  // was known, so the rest is left transparent
+  std::vector<png_byte> empty((size_t)width * rgbaBytes, 0);
+  for (; rowsWritten < height; ++rowsWritten) {
+    png_write_row(png_write_ptr, empty.data());
+  }
+  png_write_end(png_write_ptr, info_write_ptr);
+  png_destroy_write_struct(&png_write_ptr, &info_write_ptr);
+  int result = fclose(outFilePtr);
+  outFilePtr = nullptr;
+  if (result != 0) {
+    throw std::runtime_error("There was an error writing the atlas");
+  }
+}
+
+void AtlasWriter::finish() {
+  std::lock_guard lock(mutex);
+  // Anything still waiting is behind an image that never came, i.e. a job
+  // that was never run
+  for (auto& [index, sprite] : waiting) {
+    if (sprite.image) {
+      place(sprite);
+      sprites.push_back(std::move(sprite));
+    }
+  }
+  waiting.clear();
+  if (outFilePtr) {
+    closeAtlas();
+  }
+
+  std::string mapFile = prefix + ".json";
+  std::ofstream out(mapFile, std::ios::trunc);
+  out << "{\"atlases\":[";
+  for (unsigned i = 0; i < atlasCount; ++i) {
+    std::string atlasFile = prefix + "-" + std::to_string(i) + ".png";
+    out << (i > 0 ? "," : "") << "{\"file\":"
+        << Json::quote(std::filesystem::path(atlasFile).filename().string())
+        << ",\"width\":" << width << ",\"height\":" << height << "}";
+  }
+  out << "],\n\"sprites\":{";
+  for (size_t i = 0; i < sprites.size(); ++i) {
+    const Sprite& sprite = sprites[i];
+    out << (i > 0 ? ",\n" : "\n") << Json::quote(sprite.name) << ":{\"atlas\":" << sprite.atlas
+        << ",\"x\":" << sprite.x << ",\"y\":" << sprite.y << ",\"width\":" << sprite.width
+        << ",\"height\":" << sprite.height << "}";
+  }
+  out << "\n}}\n";
+  if (!out.flush()) {
+    throw std::runtime_error("Can't write atlas map " + mapFile);
+  }
+}
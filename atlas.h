@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "png.h"
+
+struct RawImage;
+
+// Packs many small images into a few large RGBA atlas pngs plus a JSON map
+// of where each one went, so they can be served as one file. Every image
+// comes with its place in a fixed order, so the same inputs always give the
+// same atlas, and is packed as soon as all the ones before it are in. Only
+// images that finish ahead of an earlier one wait in memory, in their own
+// formats. They are placed on shelves: a shelf is a band of rows as tall as
+// the tallest image on it, and once the next image doesn't fit across, the
+// band is written out and a new one starts below it, so only the open band
+// of the sheet is ever in memory
+class AtlasWriter {
+ public:
+  // Writes <prefix>-0.png, <prefix>-1.png, ... of width x height each, and
+  // <prefix>.json
+  AtlasWriter(std::string prefix, png_uint_32 width, png_uint_32 height);
+  ~AtlasWriter();
+
+  // Takes the image at index in the order, the raw rows of an output in
+  // any format. May be called concurrently, in any order
+  void add(size_t index, const std::string& name, std::shared_ptr<const RawImage> image);
+  // Leaves index out of the order, for an image that won't come. Does
+  // nothing if it already came
+  void skip(size_t index);
+
+  // Places whatever is still waiting, in order, writes the atlases and the
+  // map
+  void finish();
+
+ private:
+  struct Sprite {
+    std::string name;
+    unsigned atlas = 0;
+    png_uint_32 x = 0;
+    png_uint_32 y = 0;
+    png_uint_32 width = 0;
+    png_uint_32 height = 0;
+    // Until it is placed
+    std::shared_ptr<const RawImage> image;
+  };
+
+  // Caller holds mutex for all of these
+  void placeReady();
+  void place(Sprite& sprite);
+  void openAtlas();
+  void flushBand();
+  void closeAtlas();
+
+  std::string prefix;
+  png_uint_32 width;
+  png_uint_32 height;
+  std::mutex mutex;
+
+  // The atlas being written, and where its open band starts
+  unsigned atlasCount = 0;
+  FILE* outFilePtr = nullptr;
+  png_structp png_write_ptr = nullptr;
+  png_infop info_write_ptr = nullptr;
+  png_uint_32 rowsWritten = 0;
+  // The open shelf, bandHeight rows of width RGBA pixels
+  std::vector<png_byte> band;
+  png_uint_32 bandHeight = 0;
+  png_uint_32 bandX = 0;
+
+  // Placed so far, in order
+  std::vector<Sprite> sprites;
+  // Finished ahead of nextIndex, a skipped index has no image
+  std::map<size_t, Sprite> waiting;
+  size_t nextIndex = 0;
+};
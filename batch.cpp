@@ -0,0 +1,763 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "atlas.h"
+#include "batch.h"
+#include "buildstate.h"
+#include "cache.h"
+#include "copng.h"
+#include "executor.h"
+#include "json.h"
+#include "prefetch.h"
+
+namespace Batch {
+  namespace {
+    // How much of each input is read into a pooled buffer ahead of its job
+    constexpr size_t prefetchBytes = 64 * 1024;
+
+    // Layout of the records getdents64 fills in, glibc doesn't export it
+    struct linux_dirent64 {
+      ino64_t d_ino;
+      off64_t d_off;
+      unsigned short d_reclen;
+      unsigned char d_type;
+      char d_name[];
+    };
+
+    bool isPngName(const char* name) {
+      size_t length = strlen(name);
+      return length > 4 && strcasecmp(name + length - 4, ".png") == 0;
+    }
+
+    bool isGlobPattern(const std::string& source) {
+      return source.find_first_of("*?[") != std::string::npos;
+    }
+
+    std::string joinPath(const std::string& dir, const std::string& name) {
+      if (dir.empty()) {
+        return name;
+      }
+      if (dir.back() == '/') {
+        return dir + name;
+      }
+      return dir + "/" + name;
+    }
+
+    // Directories still to be read, shared by all walker threads
+    struct WalkState {
+      struct Dir {
+        std::string path;
+        std::string relPath;
+      };
+
+      std::mutex mutex;
+      std::condition_variable changed;
+      std::vector<Dir> pending;
+      // Directories being read right now, they may still add more
+      unsigned active = 0;
+      // Subdirectories that couldn't be read and were left out
+      unsigned skipped = 0;
+      std::exception_ptr error;
+    };
+
+    struct Fd {
+      int fd = -1;
+      ~Fd() {
+        if (fd >= 0) {
+          close(fd);
+        }
+      }
+    };
+
+    // Lists one directory, queueing its subdirectories for the walkers. Only
+    // the root failing is an error, an unreadable subdirectory is reported
+    // and left out so the rest of the tree is still walked
+    void readDirectory(WalkState& state, const WalkState::Dir& dir,
+        const std::function<void(const std::string&, const std::string&)>& found) {
+      auto fail = [&](const char* what, int savedErrno) {
+        std::string message = std::string("Can't ") + what + " directory " + dir.path + ": " + strerror(savedErrno);
+        if (dir.relPath.empty()) {
+          throw std::runtime_error(message);
+        }
+        std::cerr << message << std::endl;
+        std::lock_guard lock(state.mutex);
+        ++state.skipped;
+      };
+
+      Fd dirFd{open(dir.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+      if (dirFd.fd < 0) {
+        fail("open", errno);
+        return;
+      }
+
+      alignas(linux_dirent64) char buffer[64 * 1024];
+      std::vector<WalkState::Dir> subDirs;
+      while (true) {
+        long numRead = syscall(SYS_getdents64, dirFd.fd, buffer, sizeof(buffer));
+        if (numRead < 0) {
+          // Whatever was already found stays queued, only the rest is lost
+          fail("read", errno);
+          break;
+        }
+        if (numRead == 0) {
+          break;
+        }
+        for (long offset = 0; offset < numRead;) {
+          auto* entry = (linux_dirent64*)(buffer + offset);
+          offset += entry->d_reclen;
+          const char* name = entry->d_name;
+          if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+          }
+
+          unsigned char type = entry->d_type;
+          if (type == DT_UNKNOWN) {
+            // Some filesystems don't fill in d_type, ask for just the type
+            struct statx stx;
+            if (statx(dirFd.fd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) != 0) {
+              continue;
+            }
+            type = S_ISDIR(stx.stx_mode) ? DT_DIR : S_ISREG(stx.stx_mode) ? DT_REG : DT_UNKNOWN;
+          }
+
+          if (type == DT_DIR) {
+            subDirs.push_back({joinPath(dir.path, name), joinPath(dir.relPath, name)});
+          } else if (type == DT_REG && isPngName(name)) {
+            found(joinPath(dir.path, name), joinPath(dir.relPath, name));
+          }
+        }
+      }
+
+      if (!subDirs.empty()) {
+        std::lock_guard lock(state.mutex);
+        for (auto& subDir : subDirs) {
+          state.pending.push_back(std::move(subDir));
+        }
+        state.changed.notify_all();
+      }
+    }
+
+    // Appends one JSON line per finished job, shared by the worker threads
+    class ResultWriter {
+     public:
+      explicit ResultWriter(const std::string& resultsFile) {
+        if (!resultsFile.empty()) {
+          out.open(resultsFile, std::ios::trunc);
+          if (!out) {
+            throw std::runtime_error("Can't open results file " + resultsFile);
+          }
+        }
+      }
+
+      void record(const JobSpec& job, std::exception_ptr exception, double millis) {
+        std::string error;
+        if (exception) {
+          try {
+            std::rethrow_exception(exception);
+          } catch (const std::exception& e) {
+            error = e.what();
+          } catch (...) {
+            error = "unknown error";
+          }
+        }
+
+        std::ostringstream line;
+        line << "{\"in\":" << Json::quote(job.inFile) << ",\"outputs\":[";
+        for (size_t i = 0; i < job.outputs.size(); ++i) {
+          line << (i > 0 ? "," : "") << "{\"out\":" << Json::quote(job.outputs[i].outFile)
+               << ",\"rate\":" << job.outputs[i].sampleRate << "}";
+        }
+        line << "],\"status\":" << (exception ? "\"error\"" : "\"ok\"");
+        if (exception) {
+          line << ",\"error\":" << Json::quote(error);
+        }
+        line << ",\"ms\":" << millis << "}\n";
+
+        std::lock_guard lock(mutex);
+        if (exception) {
+          ++failed;
+          std::cerr << job.inFile << ": " << error << std::endl;
+        } else {
+          ++succeeded;
+        }
+        if (out.is_open()) {
+          out << line.str();
+        }
+      }
+
+      size_t succeeded = 0;
+      size_t failed = 0;
+
+     private:
+      std::mutex mutex;
+      std::ofstream out;
+    };
+
+    // A job with nothing left to do, i.e. its outputs came out of the cache
+    ReturnObj finishedJob() {
+      co_return;
+    }
+
+    void usage() {
+      std::cout << "Usage: batch [options] source..." << std::endl
+                << "  source is a directory (walked for *.png), a glob pattern, or a" << std::endl
+                << "  manifest file with `in out rate` lines or JSON" << std::endl
+                << "  --out DIR       output directory for directory and glob sources" << std::endl
+                << "  --rate N[,N...] sample rate(s) when a job doesn't give one (default 2)," << std::endl
+                << "                  several rates are all shrunk from one decode" << std::endl
+                << "  --jobs N        worker threads (default: one per core)" << std::endl
+                << "  --prefetch N    read up to N inputs ahead, 0 to disable (default 8)" << std::endl
+                << "  --results FILE  write one JSON result line per job" << std::endl
+                << "  --state FILE    only shrink new or changed inputs, remembering them" << std::endl
+                << "                  in FILE, and remove outputs whose input is gone" << std::endl
+                << "  --cache DIR     reuse outputs of inputs that were shrunk before" << std::endl
+                << "  --cache-size N  cache size cap in MB (default 1024)" << std::endl
+                << "  --atlas PREFIX  pack the outputs into PREFIX-0.png, PREFIX-1.png, ..." << std::endl
+                << "                  with a PREFIX.json map instead of writing each one" << std::endl
+                << "  --atlas-size WxH size of each atlas (default 2048x2048)" << std::endl
+                << "  --verbose       keep the per-image progress output" << std::endl;
+    }
+  };
+
+  bool parseRates(const std::string& text, std::vector<unsigned>& rates) {
+    rates.clear();
+    std::istringstream rateStream(text);
+    std::string rateText;
+    while (std::getline(rateStream, rateText, ',')) {
+      int rate = atoi(rateText.c_str());
+      if (rate <= 0) {
+        return false;
+      }
+      rates.push_back((unsigned)rate);
+    }
+    return !rates.empty();
+  }
+
+  bool walkDirectory(const std::string& root, unsigned numThreads,
+      const std::function<void(const std::string& path, const std::string& relPath)>& found) {
+    WalkState state;
+    state.pending.push_back({root, ""});
+
+    auto walker = [&] {
+      std::unique_lock lock(state.mutex);
+      while (true) {
+        state.changed.wait(lock, [&] {
+          return !state.pending.empty() || state.active == 0 || state.error;
+        });
+        if (state.error || state.pending.empty()) {
+          return; // nothing queued and nobody left who could queue more
+        }
+        WalkState::Dir dir = std::move(state.pending.back());
+        state.pending.pop_back();
+        ++state.active;
+        lock.unlock();
+
+        std::exception_ptr error;
+        try {
+          readDirectory(state, dir, found);
+        } catch (...) {
+          error = std::current_exception();
+        }
+
+        lock.lock();
+        --state.active;
+        if (error && !state.error) {
+          state.error = error;
+        }
+        state.changed.notify_all();
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < numThreads; ++i) {
+      threads.emplace_back(walker);
+    }
+    walker();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    if (state.error) {
+      std::rethrow_exception(state.error);
+    }
+    return state.skipped == 0;
+  }
+
+  std::vector<JobSpec> readManifest(const std::string& manifestFile, unsigned defaultRate) {
+    std::ifstream in(manifestFile);
+    if (!in) {
+      throw std::runtime_error("Can't open manifest " + manifestFile);
+    }
+    std::stringstream contents;
+    contents << in.rdbuf();
+    std::string text = contents.str();
+
+    std::vector<JobSpec> jobs;
+    size_t first = text.find_first_not_of(" \t\r\n");
+    if (first != std::string::npos && (text[first] == '[' || text[first] == '{')) {
+      auto readOutput = [&](const Json::Value& value) {
+        const Json::Value* outFile = value.find("out");
+        const Json::Value* rate = value.find("rate");
+        if (!outFile || outFile->type != Json::Value::Type::String) {
+          throw std::runtime_error("Manifest entries need an \"out\" string");
+        }
+        OutputSpec output{outFile->string, defaultRate};
+        if (rate) {
+          if (rate->type != Json::Value::Type::Number || rate->number < 1) {
+            throw std::runtime_error("Manifest rate must be a number greater than 0");
+          }
+          output.sampleRate = (unsigned)rate->number;
+        }
+        return output;
+      };
+      auto addJob = [&](const Json::Value& value) {
+        const Json::Value* inFile = value.find("in");
+        if (!inFile || inFile->type != Json::Value::Type::String) {
+          throw std::runtime_error("Manifest entries need an \"in\" string");
+        }
+        JobSpec job{inFile->string};
+        // Either a single out/rate, or several shrunk from one decode
+        const Json::Value* outputs = value.find("outputs");
+        if (outputs && outputs->type == Json::Value::Type::Array) {
+          for (const Json::Value& output : outputs->array) {
+            job.outputs.push_back(readOutput(output));
+          }
+        } else {
+          job.outputs.push_back(readOutput(value));
+        }
+        if (job.outputs.empty()) {
+          throw std::runtime_error("Manifest entry for " + job.inFile + " has no outputs");
+        }
+        jobs.push_back(std::move(job));
+      };
+      for (const Json::Value& value : Json::parseAll(text)) {
+        if (value.type == Json::Value::Type::Array) {
+          for (const Json::Value& entry : value.array) {
+            addJob(entry);
+          }
+        } else {
+          addJob(value);
+        }
+      }
+      return jobs;
+    }
+
+    std::istringstream lines(text);
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(lines, line)) {
+      ++lineNumber;
+      std::istringstream fields(line);
+      JobSpec job;
+      if (!(fields >> job.inFile) || job.inFile[0] == '#') {
+        continue; // blank or comment
+      }
+      // `in out [rate]`, optionally followed by more `out rate` pairs
+      std::string outFile;
+      while (fields >> outFile) {
+        int rate = 0;
+        if (!(fields >> rate)) {
+          // Only the last output may leave its rate out
+          rate = fields.eof() ? defaultRate : 0;
+        }
+        if (rate <= 0) {
+          throw std::runtime_error(manifestFile + ":" + std::to_string(lineNumber) +
+              ": expected `in out [rate] [out rate]...`");
+        }
+        job.outputs.push_back({outFile, (unsigned)rate});
+      }
+      if (job.outputs.empty()) {
+        throw std::runtime_error(manifestFile + ":" + std::to_string(lineNumber) +
+            ": expected `in out [rate] [out rate]...`");
+      }
+      jobs.push_back(std::move(job));
+    }
+    return jobs;
+  }
+
+  int batchMain(int argc, char* argv[]) {
+    std::string outDir;
+    std::string resultsFile;
+    std::string cacheDir;
+    std::string stateFile;
+    std::string atlasPrefix;
+    png_uint_32 atlasWidth = 2048;
+    png_uint_32 atlasHeight = 2048;
+    uint64_t cacheMegabytes = 1024;
+    std::vector<unsigned> defaultRates{2};
+    unsigned numThreads = std::thread::hardware_concurrency();
+    unsigned prefetchDepth = 8;
+    bool verbose = false;
+    std::vector<std::string> sources;
+
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      bool hasValue = i + 1 < argc;
+      if (arg == "--out" && hasValue) {
+        outDir = argv[++i];
+      } else if (arg == "--rate" && hasValue) {
+        // A comma separated list gives several outputs per input
+        if (!parseRates(argv[++i], defaultRates)) {
+          std::cout << "Sample rate must be greater than 0" << std::endl;
+          return -1;
+        }
+      } else if (arg == "--jobs" && hasValue) {
+        numThreads = (unsigned)std::max(1, atoi(argv[++i]));
+      } else if (arg == "--prefetch" && hasValue) {
+        prefetchDepth = (unsigned)std::max(0, atoi(argv[++i]));
+      } else if (arg == "--results" && hasValue) {
+        resultsFile = argv[++i];
+      } else if (arg == "--cache" && hasValue) {
+        cacheDir = argv[++i];
+      } else if (arg == "--atlas" && hasValue) {
+        atlasPrefix = argv[++i];
+      } else if (arg == "--atlas-size" && hasValue) {
+        if (sscanf(argv[++i], "%ux%u", &atlasWidth, &atlasHeight) != 2 ||
+            atlasWidth == 0 || atlasHeight == 0) {
+          std::cout << "Atlas size must be WIDTHxHEIGHT" << std::endl;
+          return -1;
+        }
+      } else if (arg == "--state" && hasValue) {
+        stateFile = argv[++i];
+      } else if (arg == "--cache-size" && hasValue) {
+        cacheMegabytes = strtoull(argv[++i], nullptr, 10);
+      } else if (arg == "--verbose") {
+        verbose = true;
+      } else if (arg.starts_with("--")) {
+        usage();
+        return -1;
+      } else {
+        sources.push_back(arg);
+      }
+    }
+    if (sources.empty()) {
+      usage();
+      return -1;
+    }
+    verboseOutput = verbose;
+
+    ResultWriter results(resultsFile);
+    std::optional<OutputCache> cache;
+    if (!cacheDir.empty()) {
+      cache.emplace(cacheDir, cacheMegabytes * 1024 * 1024);
+    }
+    std::optional<BuildState> buildState;
+    if (!stateFile.empty()) {
+      buildState.emplace(stateFile);
+    }
+    std::optional<AtlasWriter> atlas;
+    if (!atlasPrefix.empty()) {
+      if (cache || buildState) {
+        // Both of those work on output files, which an atlas doesn't leave
+        std::cout << "--atlas can't be combined with --cache or --state" << std::endl;
+        return -1;
+      }
+      atlas.emplace(atlasPrefix, atlasWidth, atlasHeight);
+    }
+    // Keep the executor queue short so read ahead inputs don't sit around
+    // for long, that bounds how many pooled buffers can be out at once
+    size_t maxQueued = numThreads;
+    BufferPool prefetchPool(prefetchBytes, prefetchDepth > 0 ? prefetchDepth + maxQueued + numThreads : 0);
+    Executor executor(numThreads, maxQueued);
+    std::optional<Prefetcher> prefetcher;
+    if (prefetchDepth > 0) {
+      prefetcher.emplace(prefetchPool, prefetchDepth);
+    }
+    auto start = std::chrono::steady_clock::now();
+
+    // With several rates each one gets its own tree, i.e. out/2x/a.png
+    auto outputsFor = [&](const std::string& relPath) {
+      std::vector<OutputSpec> outputs;
+      for (unsigned rate : defaultRates) {
+        std::string dir = defaultRates.size() == 1 ? outDir :
+            joinPath(outDir, std::to_string(rate) + "x");
+        outputs.push_back({joinPath(dir, relPath), rate});
+      }
+      return outputs;
+    };
+
+    // The input as it was found, and its hash filled in while it is read.
+    // Keys the outputs in the cache and the build state
+    struct JobState {
+      OutputCache::FileStamp fileStamp;
+      Hash::Hasher hasher;
+      // Set instead when the hash was known before the decode, from the
+      // cache's record of the path or from hashing the file first
+      std::optional<uint64_t> inputHash;
+    };
+
+    // firstSprite is where the job's outputs go in the atlas order
+    auto runJob = [&](JobSpec job, std::shared_ptr<PrefetchedInput> input,
+        std::exception_ptr prefetchError, std::shared_ptr<JobState> jobState, size_t firstSprite) {
+      // Shared between the two callbacks so queueing time isn't counted
+      auto started = std::make_shared<std::chrono::steady_clock::time_point>();
+      if (atlas) {
+        // Outputs only live in memory on their way into the atlas, as raw
+        // rows rather than encoded pngs, named in the map by their would be
+        // path
+        for (OutputSpec& output : job.outputs) {
+          output.raw = std::make_shared<RawImage>();
+        }
+      }
+      executor.submit({
+        .start = [job, input, prefetchError, started, jobState, &cache] {
+          *started = std::chrono::steady_clock::now();
+          if (prefetchError) {
+            std::rethrow_exception(prefetchError);
+          }
+          if (cache && jobState && !jobState->inputHash) {
+            // A path the cache doesn't know may still hold content it has,
+            // reading the file once more is far cheaper than decoding it
+            uint64_t inputHash;
+            if (Hash::ofFile(job.inFile, inputHash)) {
+              jobState->inputHash = inputHash;
+              if (cache->fetch(inputHash, job.outputs)) {
+                return finishedJob();
+              }
+            }
+          }
+          for (const OutputSpec& output : job.outputs) {
+            if (output.memory || output.raw) {
+              continue;
+            }
+            std::filesystem::path parent = std::filesystem::path(output.outFile).parent_path();
+            if (!parent.empty()) {
+              std::filesystem::create_directories(parent);
+            }
+          }
+          ShrinkSpec spec{job.outputs};
+          if (jobState && !jobState->inputHash) {
+            spec.inputHash = &jobState->hasher;
+          }
+          if (input) {
+            return coPng(std::move(*input), std::move(spec));
+          }
+          return coPng(job.inFile.c_str(), std::move(spec));
+        },
+        .done = [&results, &prefetcher, &cache, &buildState, &atlas, job, started, jobState,
+            firstSprite](std::exception_ptr exception) {
+          if (!exception && atlas) {
+            try {
+              for (size_t i = 0; i < job.outputs.size(); ++i) {
+                atlas->add(firstSprite + i, job.outputs[i].outFile, job.outputs[i].raw);
+              }
+            } catch (...) {
+              exception = std::current_exception();
+            }
+          }
+          if (exception && atlas) {
+            // The sprites after these mustn't wait for them
+            for (size_t i = 0; i < job.outputs.size(); ++i) {
+              atlas->skip(firstSprite + i);
+            }
+          }
+          if (prefetcher) {
+            prefetcher->jobFinished();
+          }
+          std::chrono::duration<double, std::milli> elapsed =
+              std::chrono::steady_clock::now() - *started;
+          if (exception) {
+            // Don't leave truncated pngs behind for the failed job
+            for (const OutputSpec& output : job.outputs) {
+              if (!output.memory && !output.raw) {
+                std::error_code ignored;
+                std::filesystem::remove(output.outFile, ignored);
+              }
+            }
+            if (buildState) {
+              buildState->markFailed(job.inFile);
+            }
+          } else if (jobState) {
+            // Storing a cache hit again only records its path
+            uint64_t inputHash = jobState->inputHash ? *jobState->inputHash : jobState->hasher.digest();
+            if (buildState) {
+              buildState->record(job.inFile, jobState->fileStamp.size, jobState->fileStamp.mtimeNs,
+                  inputHash, job.outputs);
+            }
+            if (cache) {
+              try {
+                cache->store(job.inFile, jobState->fileStamp, inputHash, job.outputs);
+              } catch (const std::exception& e) {
+                // The outputs are fine, only caching them failed
+                std::cerr << job.inFile << ": can't cache outputs: " << e.what() << std::endl;
+              }
+            }
+          }
+          results.record(job, exception, elapsed.count());
+        },
+      });
+    };
+
+    auto submit = [&](JobSpec job, size_t firstSprite) {
+      std::shared_ptr<JobState> jobState;
+      if (cache || buildState) {
+        // An input seen before and unchanged since is skipped, or a cache
+        // hit, without being read at all. Anything else is hashed: first
+        // thing in its job with a cache, to look its content up there, and
+        // otherwise while it is shrunk
+        auto started = std::chrono::steady_clock::now();
+        try {
+          jobState = std::make_shared<JobState>();
+          jobState->fileStamp = OutputCache::stamp(job.inFile);
+          if (buildState && buildState->upToDate(job.inFile, jobState->fileStamp.size,
+                jobState->fileStamp.mtimeNs, job.outputs)) {
+            return;
+          }
+          std::optional<uint64_t> inputHash;
+          if (cache) {
+            inputHash = cache->knownHash(job.inFile, jobState->fileStamp);
+          }
+          if (inputHash && cache->fetch(*inputHash, job.outputs)) {
+            if (buildState) {
+              buildState->record(job.inFile, jobState->fileStamp.size,
+                  jobState->fileStamp.mtimeNs, *inputHash, job.outputs);
+            }
+            std::chrono::duration<double, std::milli> elapsed =
+                std::chrono::steady_clock::now() - started;
+            results.record(job, nullptr, elapsed.count());
+            return;
+          }
+          // A known hash that missed doesn't need working out again
+          jobState->inputHash = inputHash;
+        } catch (const std::exception&) {
+          // Leave reporting the unreadable input to the job itself
+          jobState = nullptr;
+        }
+      }
+
+      if (!prefetcher) {
+        runJob(std::move(job), nullptr, nullptr, std::move(jobState), firstSprite);
+        return;
+      }
+      std::string path = job.inFile;
+      prefetcher->add(std::move(path), [&runJob, job, jobState, firstSprite](
+            std::shared_ptr<PrefetchedInput> input, std::exception_ptr error) {
+        runJob(job, std::move(input), error, jobState, firstSprite);
+      });
+    };
+
+    // An atlas is packed in order of output name, so its jobs are gathered
+    // and sorted first. Run in that order they finish close to it, and only
+    // the few that overtake an earlier one wait in memory to be placed
+    std::mutex atlasJobsMutex;
+    std::vector<JobSpec> atlasJobs;
+    auto found = [&](JobSpec job) {
+      if (!atlas) {
+        submit(std::move(job), 0);
+        return;
+      }
+      std::lock_guard lock(atlasJobsMutex);
+      atlasJobs.push_back(std::move(job));
+    };
+
+    int status = 0;
+    try {
+      for (const std::string& source : sources) {
+        struct stat st;
+        bool exists = stat(source.c_str(), &st) == 0;
+        if (exists && S_ISDIR(st.st_mode)) {
+          if (outDir.empty() && !atlas) {
+            throw std::runtime_error("--out is required for directory sources");
+          }
+          bool complete = walkDirectory(source, numThreads, [&](const std::string& path, const std::string& relPath) {
+            found({path, outputsFor(relPath)});
+          });
+          if (!complete) {
+            // Keeps the outputs of whatever was in the unread directories
+            status = -1;
+          }
+        } else if (!exists && isGlobPattern(source)) {
+          if (outDir.empty() && !atlas) {
+            throw std::runtime_error("--out is required for glob sources");
+          }
+          glob_t matches;
+          if (glob(source.c_str(), 0, nullptr, &matches) == 0) {
+            for (size_t i = 0; i < matches.gl_pathc; ++i) {
+              std::string path = matches.gl_pathv[i];
+              found({path, outputsFor(std::filesystem::path(path).filename())});
+            }
+          }
+          globfree(&matches);
+        } else {
+          for (JobSpec& job : readManifest(source, defaultRates[0])) {
+            found(std::move(job));
+          }
+        }
+      }
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      status = -1;
+    }
+    // Whatever was gathered before a source failed still goes in the atlas
+    std::stable_sort(atlasJobs.begin(), atlasJobs.end(), [](const JobSpec& a, const JobSpec& b) {
+      return a.outputs[0].outFile < b.outputs[0].outFile;
+    });
+    size_t nextSprite = 0;
+    for (JobSpec& job : atlasJobs) {
+      size_t firstSprite = nextSprite;
+      nextSprite += job.outputs.size();
+      submit(std::move(job), firstSprite);
+    }
+
+    // Let anything already queued finish before reporting
+    if (prefetcher) {
+      prefetcher->wait();
+    }
+    executor.wait();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Shrunk " << results.succeeded << " images, " << results.failed
+              << " failed, in " << elapsed.count() << "s" << std::endl;
+    if (atlas) {
+      try {
+        atlas->finish();
+      } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        status = -1;
+      }
+    }
+    if (buildState) {
+      // Only trust what wasn't seen when every source could be listed
+      size_t removed = status == 0 ? buildState->removeOrphans() : 0;
+      std::cout << "Skipped " << buildState->skipped << " unchanged, removed "
+                << removed << " orphaned outputs" << std::endl;
+      try {
+        buildState->save();
+      } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        status = -1;
+      }
+    }
+    if (cache) {
+      std::cout << "Cache: " << cache->hits << " hits, " << cache->misses << " misses, "
+                << cache->evictions << " evicted" << std::endl;
+      try {
+        cache->save();
+      } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        status = -1;
+      }
+    }
+    if (results.failed > 0) {
+      status = -1;
+    }
+    return status;
+  }
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "copng.h"
+
+// Batch mode: shrink many images in one process instead of forking one
+// pngshrink per image
+namespace Batch {
+  // One image to shrink, into one or more outputs
+  struct JobSpec {
+    std::string inFile;
+    std::vector<OutputSpec> outputs;
+  };
+
+  // Parses a comma separated list of sample rates, false unless every one
+  // of them is a positive number
+  bool parseRates(const std::string& text, std::vector<unsigned>& rates);
+
+  // Walks a directory tree on several threads, calling found with each png
+  // file and its path relative to root. found may be called concurrently.
+  // Throws if root can't be read; a subdirectory that can't is reported and
+  // skipped, and the result is false if any were
+  bool walkDirectory(const std::string& root, unsigned numThreads,
+      const std::function<void(const std::string& path, const std::string& relPath)>& found);
+
+  // Reads `in out rate [out rate]...` lines or JSON (an array of {"in",
+  // "out", "rate"} or {"in", "outputs": [{"out", "rate"}...]} objects, or one
+  // such object per line). A rate may be left out, in which case
+  // defaultRate is used
+  std::vector<JobSpec> readManifest(const std::string& manifestFile, unsigned defaultRate);
+
+  // Entry point for `pngshrink batch ...`, argv[0] is "batch"
+  int batchMain(int argc, char* argv[]);
+};
@@ -0,0 +1,165 @@
+// Compares two benchmark result files (see benchstats.h), a baseline and a
+// candidate, benchmark by benchmark. Every sample is lower-is-better, so a
+// positive change is a slowdown (or more memory).
+//
+//   bench/compare [--threshold PCT] [--alpha P] [--confidence C] [--only TEXT] baseline.json candidate.json
+//
+// A change only counts when it is both significant (Mann-Whitney p below
+// --alpha) and bigger than --threshold over the whole bootstrap confidence
+// interval, so noise between runs isn't reported as a regression. Exits
+// with 1 when any benchmark got worse by that measure, 2 when the files
+// can't be read
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "benchstats.h"
+
+namespace {
+  struct Options {
+    // Percent
+    double threshold = 5;
+    double alpha = 0.05;
+    double confidence = 0.95;
+    std::string only;
+  };
+
+  std::vector<BenchStats::Benchmark> load(const std::string& path, BenchStats::Context& context) {
+    std::ifstream in(path);
+    if (!in) {
+      throw std::runtime_error("Can't read " + path);
+    }
+    std::stringstream text;
+    text << in.rdbuf();
+    try {
+      return BenchStats::readJson(text.str(), &context);
+    } catch (const std::exception& e) {
+      throw std::runtime_error(path + ": " + e.what());
+    }
+  }
+
+  std::string contextValue(const BenchStats::Context& context, const std::string& key) {
+    for (const auto& [name, value] : context) {
+      if (name == key) {
+        return value;
+      }
+    }
+    return "";
+  }
+
+  int usage() {
+    std::cout << "Usage: compare [options] baseline.json candidate.json" << std::endl
+              << "  --threshold PCT  smallest change worth failing on (default 5)" << std::endl
+              << "  --alpha P        significance level (default 0.05)" << std::endl
+              << "  --confidence C   confidence of the intervals (default 0.95)" << std::endl
+              << "  --only TEXT      compare the benchmarks with TEXT in their name" << std::endl;
+    return 2;
+  }
+};
+
+int main(int argc, char* argv[]) {
+  Options options;
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--threshold" && hasValue) {
+      options.threshold = atof(argv[++i]);
+    } else if (arg == "--alpha" && hasValue) {
+      options.alpha = atof(argv[++i]);
+    } else if (arg == "--confidence" && hasValue) {
+      options.confidence = atof(argv[++i]);
+      if (!(options.confidence > 0 && options.confidence < 1)) {
+        return usage();
+      }
+    } else if (arg == "--only" && hasValue) {
+      options.only = argv[++i];
+    } else if (arg.starts_with("--")) {
+      return usage();
+    } else {
+      files.push_back(arg);
+    }
+  }
+  if (files.size() != 2) {
+    return usage();
+  }
+
+  BenchStats::Context baselineContext, candidateContext;
+  std::vector<BenchStats::Benchmark> baseline, candidate;
+  try {
+    baseline = load(files[0], baselineContext);
+    candidate = load(files[1], candidateContext);
+  } catch (const std::exception& e) {
+    std::cout << e.what() << std::endl;
+    return 2;
+  }
+  // Numbers from different machines or libraries say little about the code
+  for (const char* key : {"cpu", "compiler", "libpng", "zlib"}) {
+    std::string before = contextValue(baselineContext, key);
+    std::string after = contextValue(candidateContext, key);
+    if (before != after) {
+      std::cout << "Note: " << key << " differs, " << before << " vs " << after << std::endl;
+    }
+  }
+
+  std::map<std::string, const BenchStats::Benchmark*> baselineByName;
+  for (const BenchStats::Benchmark& benchmark : baseline) {
+    baselineByName[benchmark.name] = &benchmark;
+  }
+
+  double threshold = options.threshold / 100;
+  unsigned worse = 0, better = 0, compared = 0;
+  printf("%-44s %12s %12s %8s %19s %8s\n", "benchmark", "baseline", "candidate", "change",
+      "interval", "p");
+  for (const BenchStats::Benchmark& after : candidate) {
+    if (!options.only.empty() && after.name.find(options.only) == std::string::npos) {
+      continue;
+    }
+    auto found = baselineByName.find(after.name);
+    if (found == baselineByName.end()) {
+      printf("%-44s %12s %12.4g  (new)\n", after.name.c_str(), "-", BenchStats::median(after.samples));
+      continue;
+    }
+    const BenchStats::Benchmark& before = *found->second;
+    baselineByName.erase(found);
+
+    double beforeMedian = BenchStats::median(before.samples);
+    double afterMedian = BenchStats::median(after.samples);
+    double change = beforeMedian > 0 ? afterMedian / beforeMedian - 1 : 0;
+    BenchStats::Interval interval =
+        BenchStats::bootstrapChange(before.samples, after.samples, options.confidence);
+    double p = BenchStats::mannWhitneyP(before.samples, after.samples);
+    bool significant = p < options.alpha;
+    const char* verdict = "";
+    if (significant && interval.low > threshold) {
+      verdict = "WORSE";
+      ++worse;
+    } else if (significant && interval.high < -threshold) {
+      verdict = "better";
+      ++better;
+    } else if (std::abs(change) > threshold) {
+      // Big enough but not clearly outside the noise, more runs would tell
+      verdict = "unsure";
+    }
+    ++compared;
+    printf("%-44s %12.4g %12.4g %+7.1f%% [%+7.1f%%, %+7.1f%%] %8.3f %s\n", after.name.c_str(),
+        beforeMedian, afterMedian, change * 100, interval.low * 100, interval.high * 100, p,
+        verdict);
+  }
+  for (const auto& [name, benchmark] : baselineByName) {
+    if (options.only.empty() || name.find(options.only) != std::string::npos) {
+      printf("%-44s %12.4g %12s  (gone)\n", name.c_str(), BenchStats::median(benchmark->samples), "-");
+    }
+  }
+
+  printf("\n%u compared, %u worse and %u better by more than %.1f%% (p < %.3g)\n", compared,
+      worse, better, options.threshold, options.alpha);
+  return worse > 0 ? 1 : 0;
+}
@@ -0,0 +1,472 @@
+// Writes a synthetic png corpus for benchmarks, the same bytes for the same
+// seed on every run. It covers every color type at every bit depth it
+// allows (1 to 16), with and without Adam7 interlacing, photo-like and flat
+// content, a ladder of sizes, and image data cut into many small IDAT chunks
+// or kept in one.
+//
+//   bench/gencorpus [--seed N] [--sizes tiny,small,medium,large] DIR
+//   bench/gencorpus [--seed N] --image WxH COLOR DEPTH [--adam7] [--content photo|flat]
+//       [--idat BYTES] [--level N] FILE
+//
+// Rows are generated and encoded one at a time (pixels are a function of
+// their position and the seed), and a single IDAT is written as it is
+// compressed, so a 100000x100000 image takes no more memory than a 16x16
+// one, only longer
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <png.h>
+#include <zlib.h>
+
+namespace {
+  enum class Content { Photo, Flat };
+
+  struct ImageSpec {
+    png_uint_32 width = 0;
+    png_uint_32 height = 0;
+    int colorType = PNG_COLOR_TYPE_RGB;
+    int bitDepth = 8;
+    bool adam7 = false;
+    Content content = Content::Photo;
+    // Bytes per IDAT chunk, 0 for a single one (up to maxChunkBytes)
+    size_t idatBytes = 0;
+    int level = -1;
+  };
+
+  // The most a png chunk can hold, past this an image's data is split anyway
+  constexpr uint64_t maxChunkBytes = 0x7FFFFFFF;
+
+  struct ColorType {
+    const char* name;
+    int colorType;
+    unsigned channels;
+    std::vector<int> bitDepths;
+  };
+
+  const ColorType colorTypes[] = {
+    {"gray", PNG_COLOR_TYPE_GRAY, 1, {1, 2, 4, 8, 16}},
+    {"palette", PNG_COLOR_TYPE_PALETTE, 1, {1, 2, 4, 8}},
+    {"graya", PNG_COLOR_TYPE_GRAY_ALPHA, 2, {8, 16}},
+    {"rgb", PNG_COLOR_TYPE_RGB, 3, {8, 16}},
+    {"rgba", PNG_COLOR_TYPE_RGB_ALPHA, 4, {8, 16}},
+  };
+
+  const ColorType& colorTypeOf(int colorType) {
+    for (const ColorType& type : colorTypes) {
+      if (type.colorType == colorType) {
+        return type;
+      }
+    }
+    throw std::runtime_error("Unknown color type " + std::to_string(colorType));
+  }
+
+  // splitmix64 finalizer, a well mixed hash of a few integers
+  uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+  }
+
+  uint64_t hash(uint64_t seed, uint64_t a, uint64_t b, uint64_t c) {
+    return mix(mix(mix(seed ^ a) ^ b) ^ c);
+  }
+
+  // Generates the samples of any row of an image on its own, 16 bit values
+  // that are scaled down to the bit depth
+  class Painter {
+   public:
+    Painter(const ImageSpec& _spec, uint64_t _seed)
+        : spec(_spec), seed(_seed), channels(colorTypeOf(_spec.colorType).channels) {}
+
+    unsigned sample(png_uint_32 x, png_uint_32 y, unsigned c) const {
+      if (spec.content == Content::Flat) {
+        // Large blocks of a few levels, like screenshots or icons
+        return (unsigned)(hash(seed, x / 48, y / 48, c) % 4) * 0x5555;
+      }
+      // Value noise on a 32 pixel lattice, smoothly interpolated, with a
+      // little per pixel grain on top, which filters and compresses about
+      // like photos do
+      constexpr unsigned cell = 32;
+      png_uint_32 cx = x / cell, cy = y / cell;
+      double fx = (double)(x % cell) / cell, fy = (double)(y % cell) / cell;
+      fx = fx * fx * (3 - 2 * fx);
+      fy = fy * fy * (3 - 2 * fy);
+      auto corner = [&](png_uint_32 dx, png_uint_32 dy) {
+        return (double)(hash(seed, cx + dx, cy + dy, c) & 0xFFFF);
+      };
+      double top = corner(0, 0) + (corner(1, 0) - corner(0, 0)) * fx;
+      double bottom = corner(0, 1) + (corner(1, 1) - corner(0, 1)) * fx;
+      double value = top + (bottom - top) * fy + (double)(hash(seed, x, y, c + 16) & 0x7FF) - 0x400;
+      return (unsigned)std::clamp(value, 0.0, 65535.0);
+    }
+
+    // One byte per sample below 8 bits (png_set_packing packs them), big
+    // endian pairs at 16
+    void fillRow(png_uint_32 y, std::vector<png_byte>& row) const {
+      png_bytep out = row.data();
+      for (png_uint_32 x = 0; x < spec.width; ++x) {
+        for (unsigned c = 0; c < channels; ++c) {
+          unsigned value = sample(x, y, c);
+          if (spec.bitDepth == 16) {
+            *out++ = (png_byte)(value >> 8);
+            *out++ = (png_byte)value;
+          } else {
+            *out++ = (png_byte)(value >> (16 - spec.bitDepth));
+          }
+        }
+      }
+    }
+
+   private:
+    const ImageSpec& spec;
+    uint64_t seed;
+    unsigned channels;
+  };
+
+  // Passes libpng's output through to a file, joining the IDAT chunks it
+  // writes into one as they go by. The joined chunk's length is only known
+  // once it ends, so it is written as 0 and patched afterwards, which needs
+  // a seekable file
+  class IdatJoiner {
+   public:
+    explicit IdatJoiner(FILE* _file) : file(_file) {}
+
+    static void write(png_structp png_ptr, png_bytep data, png_size_t length) {
+      ((IdatJoiner*)png_get_io_ptr(png_ptr))->feed(data, length);
+    }
+    static void flush(png_structp png_ptr) {}
+
+    // Whether a write or seek failed, libpng isn't told
+    bool failed = false;
+
+   private:
+    void feed(const png_byte* data, size_t length) {
+      while (length > 0) {
+        size_t used;
+        if (signatureLeft > 0) {
+          used = std::min(length, signatureLeft);
+          put(data, used);
+          signatureLeft -= used;
+        } else if (headerBytes < sizeof(header)) {
+          used = std::min(length, sizeof(header) - headerBytes);
+          memcpy(header + headerBytes, data, used);
+          headerBytes += used;
+          if (headerBytes == sizeof(header)) {
+            startChunk();
+          }
+        } else if (dataLeft > 0) {
+          used = std::min<uint64_t>(length, dataLeft);
+          if (inIdat) {
+            crc = crc32(crc, data, used);
+            joinedBytes += used;
+          }
+          put(data, used);
+          dataLeft -= used;
+        } else {
+          // The chunk's CRC, an IDAT's is replaced by the joined one's
+          used = std::min(length, 4 - crcBytes);
+          if (!inIdat) {
+            put(data, used);
+          }
+          crcBytes += used;
+          if (crcBytes == 4) {
+            headerBytes = 0;
+            crcBytes = 0;
+          }
+        }
+        data += used;
+        length -= used;
+      }
+    }
+
+    void startChunk() {
+      dataLeft = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 |
+          (uint32_t)header[2] << 8 | header[3];
+      inIdat = memcmp(header + 4, "IDAT", 4) == 0;
+      if (!inIdat || (joining && joinedBytes + dataLeft > maxChunkBytes)) {
+        endJoined();
+      }
+      if (!inIdat) {
+        put(header, sizeof(header));
+      } else if (!joining) {
+        joining = true;
+        joinedStart = ftello(file);
+        joinedBytes = 0;
+        crc = crc32(0, header + 4, 4);
+        png_byte start[8] = {0, 0, 0, 0, 'I', 'D', 'A', 'T'};
+        put(start, sizeof(start));
+      }
+    }
+
+    void endJoined() {
+      if (!joining) {
+        return;
+      }
+      joining = false;
+      png_byte crcValue[4];
+      png_save_uint_32(crcValue, crc);
+      put(crcValue, sizeof(crcValue));
+      png_byte lengthBytes[4];
+      png_save_uint_32(lengthBytes, joinedBytes);
+      off_t end = ftello(file);
+      failed = failed || fseeko(file, joinedStart, SEEK_SET) != 0;
+      put(lengthBytes, sizeof(lengthBytes));
+      failed = failed || fseeko(file, end, SEEK_SET) != 0;
+    }
+
+    void put(const png_byte* data, size_t length) {
+      failed = failed || fwrite(data, 1, length, file) != length;
+    }
+
+    FILE* file;
+    size_t signatureLeft = 8;
+    png_byte header[8];
+    size_t headerBytes = 0;
+    uint64_t dataLeft = 0;
+    size_t crcBytes = 0;
+    bool inIdat = false;
+    // Within the joined IDAT
+    bool joining = false;
+    off_t joinedStart = 0;
+    uint64_t joinedBytes = 0;
+    uLong crc = 0;
+  };
+
+  [[noreturn]] void pngError(png_structp png_ptr, png_const_charp message) {
+    throw std::runtime_error(std::string("libpng: ") + message);
+  }
+
+  void writeImage(const ImageSpec& spec, uint64_t seed, const std::string& path) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+      throw std::runtime_error("Can't write " + path);
+    }
+    IdatJoiner joiner(file);
+    if (spec.idatBytes == 0 && fseeko(file, 0, SEEK_CUR) != 0) {
+      fclose(file);
+      throw std::runtime_error("A single IDAT needs a seekable file, use --idat for " + path);
+    }
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, pngError, nullptr);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    try {
+      if (spec.idatBytes == 0) {
+        png_set_write_fn(png_ptr, &joiner, IdatJoiner::write, IdatJoiner::flush);
+      } else {
+        png_init_io(png_ptr, file);
+        png_set_compression_buffer_size(png_ptr, spec.idatBytes);
+      }
+      png_set_IHDR(png_ptr, info_ptr, spec.width, spec.height, spec.bitDepth, spec.colorType,
+          spec.adam7 ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+          PNG_FILTER_TYPE_DEFAULT);
+      if (spec.colorType == PNG_COLOR_TYPE_PALETTE) {
+        // Every index is used, the first few are partly transparent
+        std::vector<png_color> palette(1 << spec.bitDepth);
+        std::vector<png_byte> alpha(std::min<size_t>(palette.size(), 4));
+        for (size_t i = 0; i < palette.size(); ++i) {
+          uint64_t color = hash(seed, i, 0, 99);
+          palette[i] = {(png_byte)color, (png_byte)(color >> 8), (png_byte)(color >> 16)};
+        }
+        for (size_t i = 0; i < alpha.size(); ++i) {
+          alpha[i] = (png_byte)(i * 64);
+        }
+        png_set_PLTE(png_ptr, info_ptr, palette.data(), palette.size());
+        png_set_tRNS(png_ptr, info_ptr, alpha.data(), alpha.size(), nullptr);
+      }
+      if (spec.level >= 0) {
+        png_set_compression_level(png_ptr, spec.level);
+      }
+      unsigned channels = colorTypeOf(spec.colorType).channels;
+      size_t rowBytes = (size_t)spec.width * channels * (spec.bitDepth == 16 ? 2 : 1);
+      png_write_info(png_ptr, info_ptr);
+      png_set_packing(png_ptr);
+
+      // With interlacing libpng takes every full row once per pass and
+      // picks out that pass's pixels
+      Painter painter(spec, seed);
+      std::vector<png_byte> row(rowBytes);
+      int passes = png_set_interlace_handling(png_ptr);
+      for (int pass = 0; pass < passes; ++pass) {
+        for (png_uint_32 y = 0; y < spec.height; ++y) {
+          painter.fillRow(y, row);
+          png_write_row(png_ptr, row.data());
+        }
+      }
+      png_write_end(png_ptr, info_ptr);
+    } catch (...) {
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      fclose(file);
+      remove(path.c_str());
+      throw;
+    }
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    if (fclose(file) != 0 || joiner.failed) {
+      throw std::runtime_error("Can't write " + path);
+    }
+  }
+
+  std::string imageName(const ImageSpec& spec) {
+    std::string name = std::string(colorTypeOf(spec.colorType).name) +
+        std::to_string(spec.bitDepth) + (spec.adam7 ? "-adam7" : "") +
+        (spec.content == Content::Photo ? "-photo-" : "-flat-") +
+        std::to_string(spec.width) + "x" + std::to_string(spec.height);
+    if (spec.idatBytes > 0) {
+      name += "-idat" + std::to_string(spec.idatBytes);
+    }
+    return name + ".png";
+  }
+
+  struct SizeClass {
+    const char* name;
+    png_uint_32 width;
+    png_uint_32 height;
+  };
+
+  // Matching bench mode's size classes
+  const SizeClass sizeClasses[] = {
+    {"tiny", 16, 16},
+    {"small", 256, 256},
+    {"medium", 2048, 1536},
+    {"large", 8192, 6144},
+  };
+
+  std::vector<ImageSpec> corpusSpecs(const std::vector<std::string>& sizes) {
+    std::vector<ImageSpec> specs;
+    // Every format, interlacing and content at a small size
+    for (const ColorType& type : colorTypes) {
+      for (int bitDepth : type.bitDepths) {
+        for (bool adam7 : {false, true}) {
+          for (Content content : {Content::Photo, Content::Flat}) {
+            specs.push_back({.width = 256, .height = 256, .colorType = type.colorType,
+                .bitDepth = bitDepth, .adam7 = adam7, .content = content});
+          }
+        }
+      }
+    }
+    // Then the size ladder in the most common format, with the chunking
+    // of the image data varied at each size
+    for (const SizeClass& size : sizeClasses) {
+      if (std::find(sizes.begin(), sizes.end(), size.name) == sizes.end()) {
+        continue;
+      }
+      for (Content content : {Content::Photo, Content::Flat}) {
+        for (size_t idatBytes : {(size_t)0, (size_t)1024}) {
+          ImageSpec spec{.width = size.width, .height = size.height,
+              .colorType = PNG_COLOR_TYPE_RGB, .bitDepth = 8, .content = content,
+              .idatBytes = idatBytes};
+          if (std::find_if(specs.begin(), specs.end(), [&](const ImageSpec& other) {
+                return imageName(other) == imageName(spec);
+              }) == specs.end()) {
+            specs.push_back(spec);
+          }
+        }
+      }
+    }
+    return specs;
+  }
+
+  std::vector<std::string> split(const std::string& text) {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (start <= text.size()) {
+      size_t comma = std::min(text.find(',', start), text.size());
+      parts.push_back(text.substr(start, comma - start));
+      start = comma + 1;
+    }
+    return parts;
+  }
+
+  int usage() {
+    std::cout << "Usage: gencorpus [--seed N] [--sizes tiny,small,medium,large] DIR" << std::endl
+              << "       gencorpus [--seed N] --image WxH COLOR DEPTH [--adam7]" << std::endl
+              << "           [--content photo|flat] [--idat BYTES] [--level N] FILE" << std::endl
+              << "  COLOR is gray, palette, graya, rgb or rgba" << std::endl
+              << "  --sizes   size ladder to add to the every-format images (default" << std::endl
+              << "            tiny,small,medium)" << std::endl
+              << "  --idat    bytes per IDAT chunk (default: one chunk, which needs" << std::endl
+              << "            a seekable FILE)" << std::endl;
+    return 1;
+  }
+};
+
+int main(int argc, char* argv[]) {
+  uint64_t seed = 1;
+  std::vector<std::string> sizes{"tiny", "small", "medium"};
+  bool single = false;
+  ImageSpec spec;
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--seed" && hasValue) {
+      seed = strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--sizes" && hasValue) {
+      sizes = split(argv[++i]);
+    } else if (arg == "--image" && hasValue) {
+      single = true;
+      if (sscanf(argv[++i], "%ux%u", &spec.width, &spec.height) != 2 || !spec.width || !spec.height) {
+        return usage();
+      }
+    } else if (arg == "--adam7") {
+      spec.adam7 = true;
+    } else if (arg == "--content" && hasValue) {
+      std::string content = argv[++i];
+      if (content != "photo" && content != "flat") {
+        return usage();
+      }
+      spec.content = content == "photo" ? Content::Photo : Content::Flat;
+    } else if (arg == "--idat" && hasValue) {
+      spec.idatBytes = (size_t)std::max(0ll, atoll(argv[++i]));
+    } else if (arg == "--level" && hasValue) {
+      spec.level = std::clamp(atoi(argv[++i]), 0, 9);
+    } else if (arg.starts_with("--")) {
+      return usage();
+    } else {
+      positional.push_back(arg);
+    }
+  }
+
+  try {
+    if (single) {
+      if (positional.size() != 3) {
+        return usage();
+      }
+      const ColorType* type = nullptr;
+      for (const ColorType& candidate : colorTypes) {
+        if (positional[0] == candidate.name) {
+          type = &candidate;
+        }
+      }
+      spec.bitDepth = atoi(positional[1].c_str());
+      if (!type || std::find(type->bitDepths.begin(), type->bitDepths.end(), spec.bitDepth) ==
+          type->bitDepths.end()) {
+        std::cout << positional[0] << " " << positional[1] << " isn't a png format" << std::endl;
+        return 1;
+      }
+      spec.colorType = type->colorType;
+      writeImage(spec, seed, positional[2]);
+      return 0;
+    }
+
+    if (positional.size() != 1) {
+      return usage();
+    }
+    std::filesystem::create_directories(positional[0]);
+    std::vector<ImageSpec> specs = corpusSpecs(sizes);
+    for (const ImageSpec& corpusSpec : specs) {
+      writeImage(corpusSpec, seed, (std::filesystem::path(positional[0]) / imageName(corpusSpec)).string());
+    }
+    std::cout << "Wrote " << specs.size() << " images to " << positional[0] << std::endl;
+  } catch (const std::exception& e) {
+    std::cout << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
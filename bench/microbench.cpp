@@ -0,0 +1,450 @@
+// Microbenchmarks for the work done per row of a shrink: the row kernels
+// (sampling for every pixel size and sample rate, and the pyramid's 2x box
+// filter) and the libpng/zlib stages on either side of them, unfiltering
+// when reading, filter selection and deflate when writing.
+//
+//   bench/microbench [--json FILE] [--reps N] [--min-time MS] [--cold-mb N] [--only TEXT]
+//
+// Every benchmark runs warm, on the same data each iteration so it stays in
+// cache, and cold, walking through --cold-mb of copies (more than a last
+// level cache holds) so each iteration starts from memory. Samples are ns
+// per pixel, one per repetition; GB/s counts the bytes the stage reads and
+// writes. `make bench` builds this with optimizations and saves the results
+// as JSON (see benchstats.h)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <png.h>
+#include <zlib.h>
+
+#include "benchstats.h"
+#include "kernels.h"
+
+namespace {
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    std::string jsonFile;
+    unsigned reps = 11;
+    std::chrono::nanoseconds minTime = std::chrono::milliseconds(10);
+    size_t coldBytes = 256 * 1024 * 1024;
+    std::string only;
+  };
+
+  struct Format {
+    const char* name;
+    int colorType;
+    int bitDepth;
+    size_t channels;
+
+    size_t pixelBytes() const { return channels * bitDepth / 8; }
+  };
+
+  // Every channel count at both depths. Sampling picks its kernel by pixel
+  // size alone, so some of these share one
+  const Format allFormats[] = {
+    {"gray8", PNG_COLOR_TYPE_GRAY, 8, 1},
+    {"graya8", PNG_COLOR_TYPE_GRAY_ALPHA, 8, 2},
+    {"rgb8", PNG_COLOR_TYPE_RGB, 8, 3},
+    {"rgba8", PNG_COLOR_TYPE_RGB_ALPHA, 8, 4},
+    {"gray16", PNG_COLOR_TYPE_GRAY, 16, 1},
+    {"graya16", PNG_COLOR_TYPE_GRAY_ALPHA, 16, 2},
+    {"rgb16", PNG_COLOR_TYPE_RGB, 16, 3},
+    {"rgba16", PNG_COLOR_TYPE_RGB_ALPHA, 16, 4},
+  };
+
+  // libpng's filter code differs by bytes per pixel: 1, 3, 4 and 8
+  const Format imageFormats[] = {allFormats[0], allFormats[2], allFormats[3], allFormats[7]};
+
+  const unsigned sampleRates[] = {1, 2, 3, 4, 8, 16};
+
+  struct Filter {
+    const char* name;
+    int flags;
+  };
+
+  const Filter filters[] = {
+    {"none", PNG_FILTER_NONE},
+    {"sub", PNG_FILTER_SUB},
+    {"up", PNG_FILTER_UP},
+    {"avg", PNG_FILTER_AVG},
+    {"paeth", PNG_FILTER_PAETH},
+  };
+
+  // Row kernels get rows this wide, images are this size on each side
+  constexpr size_t rowPixels = 8192;
+  constexpr png_uint_32 imageSize = 512;
+
+  // xorshift64*, the same numbers on every machine
+  class Random {
+   public:
+    explicit Random(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+
+    uint64_t next() {
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      return state * 0x2545F4914F6CDD1Dull;
+    }
+
+   private:
+    uint64_t state;
+  };
+
+  // Smooth gradients with a little noise, which filter and compress about
+  // like photos do, or large flat areas like screenshots and icons
+  std::vector<png_byte> makeImage(const Format& format, png_uint_32 width, png_uint_32 height,
+      bool photo, uint64_t seed) {
+    Random random(seed);
+    std::vector<png_byte> pixels;
+    pixels.reserve((size_t)width * height * format.pixelBytes());
+    for (png_uint_32 y = 0; y < height; ++y) {
+      for (png_uint_32 x = 0; x < width; ++x) {
+        for (size_t c = 0; c < format.channels; ++c) {
+          unsigned value = photo ? (x * 3 + y * 2 + c * 40) % 256 * 256 + random.next() % 2048
+              : ((x / 64 + y / 64 + c) % 4) * 60 * 256;
+          value = std::min(value, 65535u);
+          if (format.bitDepth == 16) {
+            pixels.push_back((png_byte)(value >> 8));
+            pixels.push_back((png_byte)value);
+          } else {
+            pixels.push_back((png_byte)(value >> 8));
+          }
+        }
+      }
+    }
+    return pixels;
+  }
+
+  // Copies of data back to back, one copy when warm, enough to overflow the
+  // caches when cold
+  struct Copies {
+    Copies(std::span<const png_byte> data, bool cold, const Options& options)
+        : size(data.size()), count(cold ? std::max<size_t>(2, options.coldBytes / size) : 1) {
+      bytes.resize(size * count);
+      for (size_t i = 0; i < count; ++i) {
+        memcpy(bytes.data() + i * size, data.data(), size);
+      }
+    }
+
+    png_bytep at(size_t iteration) { return bytes.data() + iteration % count * size; }
+
+    size_t size;
+    size_t count;
+    std::vector<png_byte> bytes;
+  };
+
+  [[noreturn]] void pngError(png_structp png_ptr, png_const_charp message) {
+    throw std::runtime_error(std::string("libpng: ") + message);
+  }
+
+  void appendData(png_structp png_ptr, png_bytep data, size_t length) {
+    auto* out = (std::vector<png_byte>*)png_get_io_ptr(png_ptr);
+    out->insert(out->end(), data, data + length);
+  }
+
+  void noFlush(png_structp png_ptr) {}
+
+  // Encodes pixels into out, with zlib at level 0 (stored) unless told
+  // otherwise so the time left is libpng's own
+  void encode(const Format& format, png_uint_32 width, png_uint_32 height, png_const_bytep pixels,
+      int filterFlags, std::vector<png_byte>& out, int level = 0) {
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, pngError, nullptr);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    try {
+      png_set_write_fn(png_ptr, &out, appendData, noFlush);
+      png_set_IHDR(png_ptr, info_ptr, width, height, format.bitDepth, format.colorType,
+          PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+      png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filterFlags);
+      png_set_compression_level(png_ptr, level);
+      png_write_info(png_ptr, info_ptr);
+      size_t rowBytes = width * format.pixelBytes();
+      for (png_uint_32 y = 0; y < height; ++y) {
+        png_write_row(png_ptr, pixels + y * rowBytes);
+      }
+      png_write_end(png_ptr, info_ptr);
+    } catch (...) {
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      throw;
+    }
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+  }
+
+  void startImage(png_structp png_ptr, png_infop info_ptr) {
+    png_start_read_image(png_ptr);
+  }
+
+  void takeRow(png_structp png_ptr, png_bytep row, png_uint_32 row_num, int pass) {}
+
+  // Progressive decode, the way coPng reads
+  void decode(png_const_bytep png, size_t size) {
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, pngError, nullptr);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    try {
+      png_set_progressive_read_fn(png_ptr, nullptr, startImage, takeRow, nullptr);
+      png_process_data(png_ptr, info_ptr, (png_bytep)png, size);
+    } catch (...) {
+      png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+      throw;
+    }
+    png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+  }
+
+  class Runner {
+   public:
+    explicit Runner(const Options& _options) : options(_options) {}
+
+    bool wanted(const std::string& name) const {
+      return options.only.empty() || name.find(options.only) != std::string::npos;
+    }
+
+    // body(i) runs iteration i. Iterations keep counting up across
+    // repetitions, so cold benchmarks keep moving to data not touched lately
+    void run(const std::string& name, uint64_t pixels, uint64_t bytes,
+        const std::function<void(size_t)>& body) {
+      size_t next = 0;
+      auto time = [&](size_t iterations) {
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+          body(next++);
+        }
+        return Clock::now() - start;
+      };
+
+      // Enough iterations per repetition that timer resolution and call
+      // overhead don't matter
+      time(1);
+      size_t iterations = 1;
+      for (auto elapsed = time(1); elapsed < options.minTime; elapsed = time(iterations)) {
+        iterations = elapsed.count() > 0 ?
+            std::min(iterations * 8, (size_t)(iterations * 1.2 * options.minTime / elapsed) + 1) :
+            iterations * 8;
+      }
+
+      BenchStats::Benchmark benchmark{name, "ns/pixel"};
+      for (unsigned rep = 0; rep < options.reps; ++rep) {
+        std::chrono::nanoseconds elapsed = time(iterations);
+        benchmark.samples.push_back((double)elapsed.count() / (iterations * pixels));
+      }
+      double nsPerPixel = BenchStats::median(benchmark.samples);
+      double gbPerSecond = bytes / (nsPerPixel * pixels);
+      benchmark.metrics = {{"gb_per_s", gbPerSecond}, {"mpixels_per_s", 1000 / nsPerPixel}};
+      printf("%-40s %10.4f ns/pixel %8.2f GB/s  [%.4f .. %.4f]\n", name.c_str(), nsPerPixel,
+          gbPerSecond, *std::min_element(benchmark.samples.begin(), benchmark.samples.end()),
+          *std::max_element(benchmark.samples.begin(), benchmark.samples.end()));
+      fflush(stdout);
+      results.push_back(std::move(benchmark));
+    }
+
+    const Options& options;
+    std::vector<BenchStats::Benchmark> results;
+  };
+
+  const char* cacheName(bool cold) { return cold ? "cold" : "warm"; }
+
+  // What row_callback does for every output: keep each sampleRate'th pixel
+  // of every sampleRate'th row
+  void benchSample(Runner& runner) {
+    for (const Format& format : allFormats) {
+      size_t pixelBytes = format.pixelBytes();
+      Kernels::RowKernel kernel = Kernels::sampleKernel(pixelBytes);
+      std::vector<png_byte> row = makeImage(format, rowPixels, 1, true, 1);
+      for (unsigned rate : sampleRates) {
+        size_t outWidth = rowPixels / rate;
+        for (bool cold : {false, true}) {
+          std::string name = std::string("sample/") + format.name + "/rate" +
+              std::to_string(rate) + "/" + cacheName(cold);
+          if (!runner.wanted(name)) {
+            continue;
+          }
+          Copies in(row, cold, runner.options);
+          std::vector<png_byte> outRow(outWidth * pixelBytes);
+          Copies out(outRow, cold, runner.options);
+          runner.run(name, outWidth, 2 * outRow.size(), [&](size_t i) {
+            kernel(in.at(i), out.at(i), outWidth, rate);
+          });
+        }
+      }
+    }
+  }
+
+  // Pyramid and tiles levels, each pair of rows averaged into one
+  void benchBox(Runner& runner) {
+    for (const Format& format : allFormats) {
+      size_t pixelBytes = format.pixelBytes();
+      Kernels::BoxKernel kernel = Kernels::boxKernel(format.channels, format.bitDepth, false);
+      std::vector<png_byte> rows = makeImage(format, rowPixels, 2, true, 2);
+      size_t rowBytes = rowPixels * pixelBytes;
+      size_t outWidth = rowPixels / 2;
+      for (bool cold : {false, true}) {
+        std::string name = std::string("box/") + format.name + "/" + cacheName(cold);
+        if (!runner.wanted(name)) {
+          continue;
+        }
+        Copies in(rows, cold, runner.options);
+        std::vector<png_byte> outRow(outWidth * pixelBytes);
+        Copies out(outRow, cold, runner.options);
+        runner.run(name, outWidth, rows.size() + outRow.size(), [&](size_t i) {
+          png_bytep top = in.at(i);
+          kernel(top, top + rowBytes, out.at(i), outWidth, 1);
+        });
+      }
+    }
+  }
+
+  // Decoding images stored with one filter type and no compression, so
+  // inflating is a copy and "none" is the baseline the others add to
+  void benchUnfilter(Runner& runner) {
+    for (const Format& format : imageFormats) {
+      std::vector<png_byte> pixels = makeImage(format, imageSize, imageSize, true, 3);
+      for (const Filter& filter : filters) {
+        std::vector<png_byte> png;
+        encode(format, imageSize, imageSize, pixels.data(), filter.flags, png);
+        for (bool cold : {false, true}) {
+          std::string name = std::string("unfilter/") + filter.name + "/" + format.name + "/" +
+              cacheName(cold);
+          if (!runner.wanted(name)) {
+            continue;
+          }
+          Copies in(png, cold, runner.options);
+          runner.run(name, (uint64_t)imageSize * imageSize, png.size() + pixels.size(),
+              [&](size_t i) { decode(in.at(i), in.size); });
+        }
+      }
+    }
+  }
+
+  // Encoding with each filter forced and with libpng choosing per row
+  // ("all", what outputs get by default), again without compression
+  void benchFilter(Runner& runner) {
+    std::vector<Filter> sets(std::begin(filters), std::end(filters));
+    sets.push_back({"all", PNG_ALL_FILTERS});
+    for (const Format& format : imageFormats) {
+      std::vector<png_byte> pixels = makeImage(format, imageSize, imageSize, true, 4);
+      for (const Filter& filter : sets) {
+        for (bool cold : {false, true}) {
+          std::string name = std::string("filter/") + filter.name + "/" + format.name + "/" +
+              cacheName(cold);
+          if (!runner.wanted(name)) {
+            continue;
+          }
+          Copies in(pixels, cold, runner.options);
+          std::vector<png_byte> png;
+          png.reserve(pixels.size() * 2);
+          runner.run(name, (uint64_t)imageSize * imageSize, 2 * pixels.size(), [&](size_t i) {
+            png.clear();
+            encode(format, imageSize, imageSize, in.at(i), filter.flags, png);
+          });
+        }
+      }
+    }
+  }
+
+  // zlib on up filtered rows, with the strategy libpng uses for image data
+  void benchDeflate(Runner& runner) {
+    for (const Format& format : {allFormats[2], allFormats[3]}) {
+      size_t rowBytes = imageSize * format.pixelBytes();
+      for (bool photo : {true, false}) {
+        std::vector<png_byte> pixels = makeImage(format, imageSize, imageSize, photo, 5);
+        std::vector<png_byte> filtered;
+        for (png_uint_32 y = 0; y < imageSize; ++y) {
+          filtered.push_back(PNG_FILTER_VALUE_UP);
+          for (size_t x = 0; x < rowBytes; ++x) {
+            png_byte above = y > 0 ? pixels[(y - 1) * rowBytes + x] : 0;
+            filtered.push_back(pixels[y * rowBytes + x] - above);
+          }
+        }
+        for (int level : {1, 6, 9}) {
+          for (bool cold : {false, true}) {
+            std::string name = "deflate/level" + std::to_string(level) + "/" +
+                (photo ? "photo/" : "flat/") + format.name + "/" + cacheName(cold);
+            if (!runner.wanted(name)) {
+              continue;
+            }
+            Copies in(filtered, cold, runner.options);
+            z_stream stream{};
+            if (deflateInit2(&stream, level, Z_DEFLATED, 15, 8, Z_FILTERED) != Z_OK) {
+              throw std::runtime_error("deflateInit2 failed");
+            }
+            std::vector<png_byte> out(deflateBound(&stream, filtered.size()));
+            runner.run(name, (uint64_t)imageSize * imageSize, filtered.size(), [&](size_t i) {
+              deflateReset(&stream);
+              stream.next_in = in.at(i);
+              stream.avail_in = filtered.size();
+              stream.next_out = out.data();
+              stream.avail_out = out.size();
+              if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+                throw std::runtime_error("deflate didn't finish");
+              }
+            });
+            deflateEnd(&stream);
+          }
+        }
+      }
+    }
+  }
+
+  int usage() {
+    std::cout << "Usage: microbench [options]" << std::endl
+              << "  --json FILE     also write the results as JSON" << std::endl
+              << "  --reps N        repetitions per benchmark (default 11)" << std::endl
+              << "  --min-time MS   shortest repetition (default 10)" << std::endl
+              << "  --cold-mb N     data to walk through when cold (default 256)" << std::endl
+              << "  --only TEXT     run the benchmarks with TEXT in their name" << std::endl;
+    return 1;
+  }
+};
+
+int main(int argc, char* argv[]) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--json" && hasValue) {
+      options.jsonFile = argv[++i];
+    } else if (arg == "--reps" && hasValue) {
+      options.reps = std::max(1, atoi(argv[++i]));
+    } else if (arg == "--min-time" && hasValue) {
+      options.minTime = std::chrono::milliseconds(std::max(1, atoi(argv[++i])));
+    } else if (arg == "--cold-mb" && hasValue) {
+      options.coldBytes = (size_t)std::max(1, atoi(argv[++i])) * 1024 * 1024;
+    } else if (arg == "--only" && hasValue) {
+      options.only = argv[++i];
+    } else {
+      return usage();
+    }
+  }
+
+  Runner runner(options);
+  try {
+    benchSample(runner);
+    benchBox(runner);
+    benchUnfilter(runner);
+    benchFilter(runner);
+    benchDeflate(runner);
+  } catch (const std::exception& e) {
+    std::cout << "Benchmark failed: " << e.what() << std::endl;
+    return 1;
+  }
+
+  if (!options.jsonFile.empty()) {
+    std::ofstream out(options.jsonFile, std::ios::trunc);
+    BenchStats::writeJson(out, "microbench", BenchStats::hostContext(), runner.results);
+    if (!out) {
+      std::cout << "Can't write " << options.jsonFile << std::endl;
+      return 1;
+    }
+    std::cout << "Wrote " << runner.results.size() << " results to " << options.jsonFile << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+#include <png.h>
+#include <zlib.h>
+
+#include "benchstats.h"
+#include "json.h"
+
+namespace BenchStats {
+  double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+      return 0;
+    }
+    std::sort(values.begin(), values.end());
+    double rank = std::clamp(p, 0.0, 1.0) * (values.size() - 1);
+    size_t below = (size_t)rank;
+    size_t above = std::min(below + 1, values.size() - 1);
+    return values[below] + (values[above] - values[below]) * (rank - below);
+  }
+
+  double mannWhitneyP(const std::vector<double>& a, const std::vector<double>& b) {
+    size_t n1 = a.size(), n2 = b.size(), n = n1 + n2;
+    if (n1 < 2 || n2 < 2) {
+      return 1;
+    }
+    std::vector<std::pair<double, bool>> all;
+    for (double value : a) {
+      all.push_back({value, true});
+    }
+    for (double value : b) {
+      all.push_back({value, false});
+    }
+    std::sort(all.begin(), all.end());
+
+    // Tied values share the average of their ranks
+    double rankSumA = 0;
+    double tieTerm = 0;
+    for (size_t i = 0; i < n;) {
+      size_t j = i;
+      while (j < n && all[j].first == all[i].first) {
+        ++j;
+      }
+      double rank = (i + 1 + j) / 2.0;
+      for (size_t k = i; k < j; ++k) {
+        rankSumA += all[k].second ? rank : 0;
+      }
+      double ties = j - i;
+      tieTerm += ties * ties * ties - ties;
+      i = j;
+    }
+    double u = rankSumA - n1 * (n1 + 1) / 2.0;
+    double mean = n1 * n2 / 2.0;
+    double variance = n1 * n2 / 12.0 * ((n + 1) - tieTerm / (n * (n - 1.0)));
+    if (variance <= 0) {
+      return 1;
+    }
+    // With continuity correction
+    double z = std::max(0.0, std::abs(u - mean) - 0.5) / std::sqrt(variance);
+    return std::erfc(z / std::sqrt(2.0));
+  }
+
+  Interval bootstrapChange(const std::vector<double>& baseline,
+      const std::vector<double>& candidate, double confidence, unsigned resamples) {
+    if (baseline.empty() || candidate.empty()) {
+      return {};
+    }
+    std::mt19937_64 random(42);
+    auto resampledMedian = [&](const std::vector<double>& samples, std::vector<double>& scratch) {
+      std::uniform_int_distribution<size_t> pick(0, samples.size() - 1);
+      for (double& value : scratch) {
+        value = samples[pick(random)];
+      }
+      std::nth_element(scratch.begin(), scratch.begin() + scratch.size() / 2, scratch.end());
+      return scratch[scratch.size() / 2];
+    };
+    std::vector<double> baselineScratch(baseline.size()), candidateScratch(candidate.size());
+    std::vector<double> changes;
+    changes.reserve(resamples);
+    for (unsigned i = 0; i < resamples; ++i) {
+      double before = resampledMedian(baseline, baselineScratch);
+      double after = resampledMedian(candidate, candidateScratch);
+      if (before > 0) {
+        changes.push_back(after / before - 1);
+      }
+    }
+    double tail = (1 - confidence) / 2;
+    return {percentile(changes, tail), percentile(changes, 1 - tail)};
+  }
+
+  Context hostContext() {
+    std::string cpu = "unknown";
+    std::ifstream cpuInfo("/proc/cpuinfo");
+    for (std::string line; std::getline(cpuInfo, line);) {
+      if (line.starts_with("model name")) {
+        size_t colon = line.find(':');
+        cpu = line.substr(line.find_first_not_of(' ', colon + 1));
+        break;
+      }
+    }
+    char date[32];
+    time_t now = time(nullptr);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    return {
+      {"date", date},
+      {"cpu", cpu},
+      {"threads", std::to_string(std::thread::hardware_concurrency())},
+      {"compiler", __VERSION__},
+      {"libpng", PNG_LIBPNG_VER_STRING},
+      {"zlib", ZLIB_VERSION},
+    };
+  }
+
+  namespace {
+    // Enough digits to tell runs apart, JSON has no NaN or infinity
+    std::string number(double value) {
+      if (!std::isfinite(value)) {
+        return "null";
+      }
+      char text[32];
+      snprintf(text, sizeof(text), "%.6g", value);
+      return text;
+    }
+  };
+
+  void writeJson(std::ostream& out, const std::string& tool, const Context& context,
+      const std::vector<Benchmark>& benchmarks) {
+    out << "{\"tool\":" << Json::quote(tool) << ",\"context\":{";
+    for (size_t i = 0; i < context.size(); ++i) {
+      out << (i > 0 ? "," : "") << Json::quote(context[i].first) << ":"
+          << Json::quote(context[i].second);
+    }
+    out << "},\"benchmarks\":[";
+    for (size_t i = 0; i < benchmarks.size(); ++i) {
+      const Benchmark& benchmark = benchmarks[i];
+      out << (i > 0 ? "," : "") << "\n{\"name\":" << Json::quote(benchmark.name)
+          << ",\"unit\":" << Json::quote(benchmark.unit)
+          << ",\"median\":" << number(median(benchmark.samples));
+      for (const auto& [name, value] : benchmark.metrics) {
+        out << "," << Json::quote(name) << ":" << number(value);
+      }
+      out << ",\"samples\":[";
+      for (size_t j = 0; j < benchmark.samples.size(); ++j) {
+        out << (j > 0 ? "," : "") << number(benchmark.samples[j]);
+      }
+      out << "]}";
+    }
+    out << "\n]}\n";
+  }
+
+  std::vector<Benchmark> readJson(const std::string& text, Context* context) {
+    Json::Value document = Json::parse(text);
+    const Json::Value* benchmarks = document.find("benchmarks");
+    if (!benchmarks || benchmarks->type != Json::Value::Type::Array) {
+      throw std::runtime_error("No benchmarks array");
+    }
+    if (const Json::Value* found = document.find("context"); context && found) {
+      for (const auto& [name, value] : found->object) {
+        context->push_back({name, value.string});
+      }
+    }
+    std::vector<Benchmark> results;
+    for (const Json::Value& entry : benchmarks->array) {
+      const Json::Value* name = entry.find("name");
+      const Json::Value* samples = entry.find("samples");
+      if (!name || name->type != Json::Value::Type::String || !samples ||
+          samples->type != Json::Value::Type::Array) {
+        throw std::runtime_error("Benchmark without a name or samples");
+      }
+      Benchmark benchmark{name->string};
+      if (const Json::Value* unit = entry.find("unit")) {
+        benchmark.unit = unit->string;
+      }
+      for (const Json::Value& sample : samples->array) {
+        if (sample.type == Json::Value::Type::Number) {
+          benchmark.samples.push_back(sample.number);
+        }
+      }
+      for (const auto& [key, value] : entry.object) {
+        if (value.type == Json::Value::Type::Number && key != "median") {
+          benchmark.metrics.push_back({key, value.number});
+        }
+      }
+      results.push_back(std::move(benchmark));
+    }
+    return results;
+  }
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Result files shared by the benchmark tools (bench/microbench and friends).
+// Every benchmark keeps each repetition's measurement rather than just an
+// average, so two runs can be compared with their noise taken into account
+namespace BenchStats {
+  struct Benchmark {
+    std::string name;
+    // What the samples measure, lower is better, i.e. "ns/pixel"
+    std::string unit;
+    std::vector<double> samples;
+    // Derived figures for people reading the results, i.e. {"gb_per_s", 2.5}.
+    // Each is the value at the median sample
+    std::vector<std::pair<std::string, double>> metrics;
+  };
+
+  // Where the results came from: compiler, libpng version, CPU, ...
+  using Context = std::vector<std::pair<std::string, std::string>>;
+
+  // p from 0 to 1, interpolating between the closest ranks
+  double percentile(std::vector<double> values, double p);
+  inline double median(const std::vector<double>& values) { return percentile(values, 0.5); }
+
+  // Two sided p-value of the Mann-Whitney U test (normal approximation with
+  // a tie correction): how likely samples as different as a and b are if
+  // both come from the same distribution. 1 when either has under 2 samples
+  double mannWhitneyP(const std::vector<double>& a, const std::vector<double>& b);
+
+  struct Interval {
+    double low = 0;
+    double high = 0;
+  };
+
+  // Bootstrap confidence interval for median(candidate) / median(baseline) - 1,
+  // i.e. [0.02, 0.08] for 2% to 8% more. Resampling is seeded, the same
+  // samples always give the same interval
+  Interval bootstrapChange(const std::vector<double>& baseline,
+      const std::vector<double>& candidate, double confidence, unsigned resamples = 10000);
+
+  // The build and machine the running binary is measuring
+  Context hostContext();
+
+  // {"tool": ..., "context": {...}, "benchmarks": [{"name": ..., "unit": ...,
+  // "median": ..., "samples": [...], <metrics>...}, ...]}
+  void writeJson(std::ostream& out, const std::string& tool, const Context& context,
+      const std::vector<Benchmark>& benchmarks);
+
+  // Reads what writeJson wrote, throws std::runtime_error on anything else
+  std::vector<Benchmark> readJson(const std::string& text, Context* context = nullptr);
+};
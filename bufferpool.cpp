@@ -0,0 +1,48 @@
+#include "bufferpool.h"
+
+BufferPool::BufferPool(size_t _bufferSize, size_t count)
+    : bufferSize(_bufferSize), buffers(count, std::vector<std::byte>(_bufferSize)) {
+  for (auto& buffer : buffers) {
+    available.push_back(&buffer);
+  }
+}
+
+BufferPool::Lease BufferPool::acquire() {
+  std::unique_lock lock(mutex);
+  returned.wait(lock, [this] { return !available.empty(); });
+  Lease lease;
+  lease.pool = this;
+  lease.storage = available.back();
+  available.pop_back();
+  return lease;
+}
+
+void BufferPool::giveBack(std::vector<std::byte>* buffer) {
+  {
+    std::lock_guard lock(mutex);
+    available.push_back(buffer);
+  }
+  returned.notify_one();
+}
+
+BufferPool::Lease& BufferPool::Lease::operator=(Lease&& other) noexcept {
+  if (this != &other) {
+    release();
+    pool = other.pool;
+    storage = other.storage;
+    size = other.size;
+    other.pool = nullptr;
+    other.storage = nullptr;
+    other.size = 0;
+  }
+  return *this;
+}
+
+void BufferPool::Lease::release() {
+  if (pool && storage) {
+    pool->giveBack(storage);
+  }
+  pool = nullptr;
+  storage = nullptr;
+  size = 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <span>
+#include <vector>
+
+// Fixed set of equally sized buffers that are handed out and given back,
+// so reading ahead doesn't allocate per file and has a hard memory cap
+class BufferPool {
+ public:
+  // A buffer on loan from the pool, returned when the lease is destroyed
+  class Lease {
+   public:
+    Lease() = default;
+    Lease(Lease&& other) noexcept { *this = std::move(other); }
+    Lease& operator=(Lease&& other) noexcept;
+    ~Lease() { release(); }
+
+    // The whole buffer, and the part of it that holds data
+    std::span<std::byte> buffer() { return {storage->data(), storage->size()}; }
+    std::span<std::byte> data() { return {storage->data(), size}; }
+    explicit operator bool() const { return storage != nullptr; }
+
+    void release();
+
+    size_t size = 0;
+
+   private:
+    friend class BufferPool;
+    BufferPool* pool = nullptr;
+    std::vector<std::byte>* storage = nullptr;
+  };
+
+  BufferPool(size_t bufferSize, size_t count);
+
+  // Blocks while every buffer is on loan
+  Lease acquire();
+
+  const size_t bufferSize;
+
+ private:
+  void giveBack(std::vector<std::byte>* buffer);
+
+  std::vector<std::vector<std::byte>> buffers;
+  std::vector<std::vector<std::byte>*> available;
+  std::mutex mutex;
+  std::condition_variable returned;
+};
@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#include "buildstate.h"
+#include "hash.h"
+
+namespace {
+  const char* stateHeader = "pngshrink-state 1";
+
+  // Tabs and newlines separate the fields and lines of the state file
+  bool storable(const std::string& path) {
+    return path.find_first_of("\t\n") == std::string::npos;
+  }
+};
+
+BuildState::BuildState(const std::string& _stateFile) : stateFile(_stateFile) {
+  std::ifstream in(stateFile);
+  std::string line;
+  if (!in || !std::getline(in, line) || line != stateHeader) {
+    return;
+  }
+
+  // in, size, mtime, hash (- when stale), then an out and rate per output
+  while (std::getline(in, line)) {
+    std::vector<std::string> fields;
+    std::istringstream fieldStream(line);
+    std::string field;
+    while (std::getline(fieldStream, field, '\t')) {
+      fields.push_back(field);
+    }
+    if (fields.size() < 4 || fields.size() % 2 != 0) {
+      continue;
+    }
+    Input input;
+    input.size = strtoull(fields[1].c_str(), nullptr, 10);
+    input.mtimeNs = strtoll(fields[2].c_str(), nullptr, 10);
+    if (fields[3] == "-") {
+      input.stale = true;
+    } else if (!Hash::parseHex(fields[3], input.inputHash)) {
+      continue;
+    }
+    for (size_t i = 4; i + 1 < fields.size(); i += 2) {
+      input.outputs.push_back({fields[i], (unsigned)strtoul(fields[i + 1].c_str(), nullptr, 10)});
+    }
+    inputs[fields[0]] = std::move(input);
+  }
+}
+
+bool BuildState::sameOutputs(const std::vector<OutputSpec>& a, const std::vector<OutputSpec>& b) {
+  return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+      [](const OutputSpec& x, const OutputSpec& y) {
+        return x.outFile == y.outFile && x.sampleRate == y.sampleRate;
+      });
+}
+
+bool BuildState::upToDate(const std::string& inFile, uint64_t size, int64_t mtimeNs,
+    const std::vector<OutputSpec>& outputs) {
+  uint64_t inputHash;
+  bool sameMtime;
+  {
+    std::lock_guard lock(mutex);
+    auto input = inputs.find(inFile);
+    if (input == inputs.end()) {
+      return false;
+    }
+    input->second.seen = true;
+    if (input->second.stale || input->second.size != size ||
+        !sameOutputs(input->second.outputs, outputs)) {
+      return false;
+    }
+    sameMtime = input->second.mtimeNs == mtimeNs;
+    inputHash = input->second.inputHash;
+  }
+
+  // Outputs deleted since the last run have to be made again
+  for (const OutputSpec& output : outputs) {
+    struct stat st;
+    if (stat(output.outFile.c_str(), &st) != 0) {
+      return false;
+    }
+  }
+  if (sameMtime) {
+    ++skipped;
+    return true;
+  }
+
+  // Only the mtime moved, reading the file is still far cheaper than
+  // shrinking it again
+  uint64_t fileHash;
+  if (!Hash::ofFile(inFile, fileHash) || fileHash != inputHash) {
+    return false;
+  }
+  std::lock_guard lock(mutex);
+  auto input = inputs.find(inFile);
+  if (input == inputs.end()) {
+    return false;
+  }
+  input->second.mtimeNs = mtimeNs;
+  ++skipped;
+  return true;
+}
+
+void BuildState::record(const std::string& inFile, uint64_t size, int64_t mtimeNs,
+    uint64_t inputHash, const std::vector<OutputSpec>& outputs) {
+  std::vector<std::string> stale;
+  {
+    std::lock_guard lock(mutex);
+    Input& input = inputs[inFile];
+    for (const OutputSpec& old : input.outputs) {
+      bool kept = std::any_of(outputs.begin(), outputs.end(), [&](const OutputSpec& output) {
+        return output.outFile == old.outFile;
+      });
+      if (!kept) {
+        stale.push_back(old.outFile);
+      }
+    }
+    input = {size, mtimeNs, inputHash, outputs, true};
+  }
+  for (const std::string& outFile : stale) {
+    std::error_code ignored;
+    std::filesystem::remove(outFile, ignored);
+  }
+}
+
+void BuildState::markFailed(const std::string& inFile) {
+  std::lock_guard lock(mutex);
+  auto input = inputs.find(inFile);
+  if (input != inputs.end()) {
+    input->second.stale = true;
+  }
+}
+
+size_t BuildState::removeOrphans() {
+  std::lock_guard lock(mutex);
+  size_t removed = 0;
+  for (auto input = inputs.begin(); input != inputs.end();) {
+    if (input->second.seen) {
+      ++input;
+      continue;
+    }
+    for (const OutputSpec& output : input->second.outputs) {
+      std::error_code ignored;
+      if (std::filesystem::remove(output.outFile, ignored)) {
+        ++removed;
+      }
+    }
+    input = inputs.erase(input);
+  }
+  return removed;
+}
+
+void BuildState::save() {
+  std::lock_guard lock(mutex);
+  std::string temp = stateFile + ".tmp";
+  {
+    std::ofstream out(temp, std::ios::trunc);
+    out << stateHeader << "\n";
+    for (const auto& [inFile, input] : inputs) {
+      bool ok = storable(inFile) && std::all_of(input.outputs.begin(), input.outputs.end(),
+          [](const OutputSpec& output) { return storable(output.outFile); });
+      if (!ok) {
+        continue;
+      }
+      out << inFile << "\t" << input.size << "\t" << input.mtimeNs << "\t"
+          << (input.stale ? "-" : Hash::hex(input.inputHash));
+      for (const OutputSpec& output : input.outputs) {
+        out << "\t" << output.outFile << "\t" << output.sampleRate;
+      }
+      out << "\n";
+    }
+    if (!out.flush()) {
+      throw std::runtime_error("Can't write state file " + temp);
+    }
+  }
+  std::filesystem::rename(temp, stateFile);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "copng.h"
+
+// What an incremental batch run remembers about each input: its size,
+// mtime and content hash when it was last shrunk, and the outputs it was
+// shrunk into. Lets a re-run skip inputs that haven't changed and clean up
+// outputs whose input is gone
+class BuildState {
+ public:
+  // Starts empty when stateFile doesn't exist yet
+  explicit BuildState(const std::string& stateFile);
+
+  // Whether the input was already shrunk into exactly these outputs, which
+  // all still exist (a stat each), and hasn't changed since. A changed mtime
+  // with the same size falls back to comparing content hashes, so a touched
+  // or copied over file isn't redone. Either way the input counts as seen,
+  // see removeOrphans
+  bool upToDate(const std::string& inFile, uint64_t size, int64_t mtimeNs,
+      const std::vector<OutputSpec>& outputs);
+
+  // Records a successful shrink, removing outputs the input had before
+  // that it doesn't have any more
+  void record(const std::string& inFile, uint64_t size, int64_t mtimeNs, uint64_t inputHash,
+      const std::vector<OutputSpec>& outputs);
+
+  // Marks a failed input stale so the next run tries it again. Its earlier
+  // outputs stay recorded, for record or removeOrphans to clean up
+  void markFailed(const std::string& inFile);
+
+  // Deletes the outputs of every input that wasn't seen in this run and
+  // drops them from the state. Returns how many outputs were removed
+  size_t removeOrphans();
+
+  // Writes the state (atomically, through a rename)
+  void save();
+
+  std::atomic<size_t> skipped = 0;
+
+ private:
+  struct Input {
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+    uint64_t inputHash = 0;
+    std::vector<OutputSpec> outputs;
+    bool seen = false;
+    // Failed when last tried, never up to date
+    bool stale = false;
+  };
+
+  static bool sameOutputs(const std::vector<OutputSpec>& a, const std::vector<OutputSpec>& b);
+
+  std::string stateFile;
+  std::mutex mutex;
+  std::unordered_map<std::string, Input> inputs;
+};
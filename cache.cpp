@@ -0,0 +1,287 @@
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "hash.h"
+
+namespace {
+  // Bump whenever the same input and sample rate would produce different
+  // output bytes, so entries from older builds stop matching
+  constexpr unsigned formatVersion = 1;
+  const char* indexHeader = "pngshrink-cache 1";
+
+  // Closes the fd when going out of scope
+  struct Fd {
+    int fd = -1;
+    ~Fd() {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  };
+
+  // Shares the source's blocks when the filesystem can (btrfs, xfs, ...),
+  // otherwise copies in the kernel
+  void copyFile(const std::string& from, const std::string& to) {
+    Fd in{open(from.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (in.fd < 0) {
+      throw std::runtime_error("Can't open " + from + " to read");
+    }
+    Fd out{open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+    if (out.fd < 0) {
+      throw std::runtime_error("Can't open " + to + " to write");
+    }
+    if (ioctl(out.fd, FICLONE, in.fd) == 0) {
+      return;
+    }
+
+    while (true) {
+      ssize_t numCopied = copy_file_range(in.fd, nullptr, out.fd, nullptr, 1 << 30, 0);
+      if (numCopied == 0) {
+        return;
+      } else if (numCopied < 0) {
+        break;
+      }
+    }
+    // copy_file_range isn't supported everywhere (older kernels, some
+    // filesystem pairs), fall back to plain reads and writes from the start
+    if (lseek(in.fd, 0, SEEK_SET) < 0 || ftruncate(out.fd, 0) != 0 ||
+        lseek(out.fd, 0, SEEK_SET) < 0) {
+      throw std::runtime_error("There was an error copying " + from);
+    }
+    char buffer[64 * 1024];
+    ssize_t numRead;
+    while ((numRead = read(in.fd, buffer, sizeof(buffer))) > 0) {
+      if (write(out.fd, buffer, numRead) != numRead) {
+        throw std::runtime_error("There was an error copying " + from);
+      }
+    }
+    if (numRead < 0) {
+      throw std::runtime_error("There was an error copying " + from);
+    }
+  }
+};
+
+OutputCache::OutputCache(const std::string& _cacheDir, uint64_t _maxBytes)
+    : cacheDir(_cacheDir), maxBytes(_maxBytes) {
+  std::filesystem::create_directories(std::filesystem::path(cacheDir) / "objects");
+  load();
+}
+
+OutputCache::~OutputCache() {
+  try {
+    save();
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+  }
+}
+
+OutputCache::FileStamp OutputCache::stamp(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    throw std::runtime_error("Can't open file to read");
+  }
+  return {
+    .device = (uint64_t)st.st_dev,
+    .inode = (uint64_t)st.st_ino,
+    .size = (uint64_t)st.st_size,
+    .mtimeNs = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec,
+  };
+}
+
+uint64_t OutputCache::outputKey(uint64_t inputHash, const OutputSpec& output) {
+  Hash::Hasher hasher(inputHash);
+  // Every setting that changes the bytes, where they go doesn't
+  hasher.update(&output.sampleRate, sizeof(output.sampleRate));
+  hasher.update(&output.compressionLevel, sizeof(output.compressionLevel));
+  hasher.update(&output.filters, sizeof(output.filters));
+  hasher.update(&output.flushRows, sizeof(output.flushRows));
+  bool raw = (bool)output.raw;
+  hasher.update(&raw, sizeof(raw));
+  hasher.update(&formatVersion, sizeof(formatVersion));
+  // The encoder's output can change between libpng (and zlib) versions
+  hasher.update(PNG_LIBPNG_VER_STRING, strlen(PNG_LIBPNG_VER_STRING));
+  return hasher.digest();
+}
+
+std::string OutputCache::objectPath(uint64_t key) const {
+  std::string name = Hash::hex(key);
+  return cacheDir + "/objects/" + name.substr(0, 2) + "/" + name + ".png";
+}
+
+std::optional<uint64_t> OutputCache::knownHash(const std::string& path,
+    const FileStamp& fileStamp) {
+  std::lock_guard lock(mutex);
+  auto known = knownFiles.find(path);
+  if (known == knownFiles.end() || !(known->second.fileStamp == fileStamp)) {
+    return std::nullopt;
+  }
+  return known->second.inputHash;
+}
+
+bool OutputCache::fetch(uint64_t inputHash, const std::vector<OutputSpec>& outputs) {
+  std::vector<uint64_t> keys;
+  {
+    std::lock_guard lock(mutex);
+    for (const OutputSpec& output : outputs) {
+      uint64_t key = outputKey(inputHash, output);
+      auto entry = entries.find(key);
+      if (entry == entries.end()) {
+        ++misses;
+        return false;
+      }
+      touch(entry->second);
+      keys.push_back(key);
+    }
+  }
+
+  // Copy without holding the lock. An object evicted meanwhile is gone from
+  // the directory but a copy already started keeps reading it
+  try {
+    for (size_t i = 0; i < outputs.size(); ++i) {
+      std::filesystem::path parent = std::filesystem::path(outputs[i].outFile).parent_path();
+      if (!parent.empty()) {
+        std::filesystem::create_directories(parent);
+      }
+      copyFile(objectPath(keys[i]), outputs[i].outFile);
+    }
+  } catch (const std::exception&) {
+    ++misses;
+    return false;
+  }
+  ++hits;
+  return true;
+}
+
+void OutputCache::store(const std::string& path, const FileStamp& fileStamp, uint64_t inputHash,
+    const std::vector<OutputSpec>& outputs) {
+  for (const OutputSpec& output : outputs) {
+    uint64_t key = outputKey(inputHash, output);
+    {
+      std::lock_guard lock(mutex);
+      auto entry = entries.find(key);
+      if (entry != entries.end()) {
+        // Same content under another name, nothing to copy
+        touch(entry->second);
+        continue;
+      }
+    }
+
+    // Copy next to the object and rename, so a half written object can
+    // never be fetched
+    std::string object = objectPath(key);
+    std::filesystem::create_directories(std::filesystem::path(object).parent_path());
+    std::string temp = object + ".tmp" + std::to_string(gettid());
+    copyFile(output.outFile, temp);
+    uint64_t size = std::filesystem::file_size(temp);
+    std::filesystem::rename(temp, object);
+
+    std::lock_guard lock(mutex);
+    auto [entry, added] = entries.try_emplace(key);
+    if (added) {
+      lru.push_front(key);
+      entry->second.use = lru.begin();
+      entry->second.size = size;
+      totalBytes += size;
+    } else {
+      touch(entry->second);
+    }
+  }
+
+  std::lock_guard lock(mutex);
+  knownFiles[path] = {fileStamp, inputHash};
+  dirty = true;
+  evict();
+}
+
+void OutputCache::touch(Entry& entry) {
+  lru.splice(lru.begin(), lru, entry.use);
+  dirty = true;
+}
+
+void OutputCache::evict() {
+  while (totalBytes > maxBytes && !lru.empty()) {
+    uint64_t key = lru.back();
+    lru.pop_back();
+    auto entry = entries.find(key);
+    totalBytes -= entry->second.size;
+    entries.erase(entry);
+    std::error_code ignored;
+    std::filesystem::remove(objectPath(key), ignored);
+    ++evictions;
+  }
+}
+
+void OutputCache::load() {
+  std::ifstream index(cacheDir + "/index");
+  std::string line;
+  if (!index || !std::getline(index, line) || line != indexHeader) {
+    // Missing, or from an incompatible version, start empty
+    return;
+  }
+
+  // Objects are listed least recently used first
+  while (std::getline(index, line)) {
+    std::istringstream fields(line);
+    std::string type, hashText;
+    uint64_t hash;
+    fields >> type >> hashText;
+    if (!Hash::parseHex(hashText, hash)) {
+      continue;
+    }
+    if (type == "o") {
+      uint64_t size;
+      if (!(fields >> size) || entries.count(hash)) {
+        continue;
+      }
+      lru.push_front(hash);
+      entries[hash] = {size, lru.begin()};
+      totalBytes += size;
+    } else if (type == "f") {
+      KnownFile known{.inputHash = hash};
+      std::string path;
+      FileStamp& fileStamp = known.fileStamp;
+      if (fields >> fileStamp.device >> fileStamp.inode >> fileStamp.size >> fileStamp.mtimeNs &&
+          fields.get() == ' ' && std::getline(fields, path) && !path.empty()) {
+        knownFiles[path] = known;
+      }
+    }
+  }
+  // The cap may have shrunk since the last run
+  evict();
+}
+
+void OutputCache::save() {
+  std::lock_guard lock(mutex);
+  if (!dirty) {
+    return;
+  }
+  std::string indexFile = cacheDir + "/index";
+  std::string temp = indexFile + ".tmp";
+  {
+    std::ofstream index(temp, std::ios::trunc);
+    index << indexHeader << "\n";
+    for (auto key = lru.rbegin(); key != lru.rend(); ++key) {
+      index << "o " << Hash::hex(*key) << " " << entries[*key].size << "\n";
+    }
+    for (const auto& [path, known] : knownFiles) {
+      const FileStamp& fileStamp = known.fileStamp;
+      index << "f " << Hash::hex(known.inputHash) << " " << fileStamp.device << " "
+            << fileStamp.inode << " " << fileStamp.size << " " << fileStamp.mtimeNs << " "
+            << path << "\n";
+    }
+    if (!index.flush()) {
+      throw std::runtime_error("Can't write cache index " + temp);
+    }
+  }
+  std::filesystem::rename(temp, indexFile);
+  dirty = false;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "copng.h"
+
+// Content addressed store of shrunk outputs, so an input that was shrunk
+// before (under any name) is copied out of the cache instead of decoded
+// again. Entries are keyed by the hash of the input bytes plus everything
+// else that decides the output bytes, and evicted least recently used first
+// once the cache grows past its size cap. The index survives restarts
+class OutputCache {
+ public:
+  // What identifies a file on disk without reading it, see knownHash
+  struct FileStamp {
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+    bool operator==(const FileStamp&) const = default;
+  };
+
+  OutputCache(const std::string& cacheDir, uint64_t maxBytes);
+  // Saves the index, see save
+  ~OutputCache();
+
+  // Throws if the file can't be stat'ed
+  static FileStamp stamp(const std::string& path);
+
+  // Hash of a file recorded by an earlier store, as long as the file hasn't
+  // changed since. Lets a hit skip reading the input at all
+  std::optional<uint64_t> knownHash(const std::string& path, const FileStamp& fileStamp);
+
+  // Reflinks (or copies) every output out of the cache and counts a hit.
+  // Returns false, counting a miss, unless all of them were cached
+  bool fetch(uint64_t inputHash, const std::vector<OutputSpec>& outputs);
+
+  // Adds freshly written outputs of an input with the given hash (computed
+  // while it was read, see ShrinkSpec::inputHash) and remembers the hash
+  // for the file, then evicts down to the size cap
+  void store(const std::string& path, const FileStamp& fileStamp, uint64_t inputHash,
+      const std::vector<OutputSpec>& outputs);
+
+  // Writes the index (atomically, through a rename)
+  void save();
+
+  std::atomic<uint64_t> hits = 0;
+  std::atomic<uint64_t> misses = 0;
+  std::atomic<uint64_t> evictions = 0;
+
+ private:
+  struct Entry {
+    uint64_t size = 0;
+    // Position in lru
+    std::list<uint64_t>::iterator use;
+  };
+
+  struct KnownFile {
+    FileStamp fileStamp;
+    uint64_t inputHash = 0;
+  };
+
+  // Key of one output of an input, covering every OutputSpec setting that
+  // changes its bytes
+  static uint64_t outputKey(uint64_t inputHash, const OutputSpec& output);
+  std::string objectPath(uint64_t key) const;
+  void load();
+  // Caller holds mutex
+  void touch(Entry& entry);
+  void evict();
+
+  std::string cacheDir;
+  uint64_t maxBytes;
+  uint64_t totalBytes = 0;
+  std::mutex mutex;
+  std::unordered_map<uint64_t, Entry> entries;
+  // Most recently used first
+  std::list<uint64_t> lru;
+  std::unordered_map<std::string, KnownFile> knownFiles;
+  bool dirty = false;
+};
@@ -1,13 +1,13 @@
-#include <coroutine>
-#include <exception>
-#include <ios>
-#include <iostream>
-#include <fstream>
-#include <string>
-#include <span>
-#include <assert.h>
+#include <cstring>
 
-#include "png.h"
+#include "copng.h"
+#include "batch.h"
+#include "corpusbench.h"
+#include "localserver.h"
+#include "pool.h"
+#include "sequence.h"
+#include "server.h"
+#include "tarstream.h"
 
 // Low memory PNG shrinker, a contrived simple example for learning coroutines,
 // inspired by a recent project with image processing in embedded programming
@@ -18,97 +18,180 @@
 // which can be Part 2
 
 // libpng boilerplate
-void png_err() {
-  throw std::runtime_error("There was a libpng issue");
+// With no jmp_buf set libpng would abort the whole process, throw instead
+// so a bad image only fails its own job
+void png_err(png_structp png_ptr, png_const_charp message) {
+  throw std::runtime_error(std::string("There was a libpng issue: ") + message);
 }
 #define PNG_ABORT(png_err)
 // end libpng boilerplate
 
-// Coroutine task object, can be heap allocated
-struct ReturnObj {
-  // Used for return types and exceptions
-  struct promise_type {
-    ~promise_type() {
-      std::cout << "promise_type is destroyed" << std::endl;
-    }
-    ReturnObj get_return_object() {
-      return {
-        .handle = std::coroutine_handle<promise_type>::from_promise(*this)
-      };
-    }
-    // means to NOT call the coroutine on initialization
-    // suspend_never would cause the coroutine to be called
-    std::suspend_always initial_suspend() noexcept { return {}; }
-    std::suspend_always final_suspend() noexcept { return {}; }
-    void unhandled_exception() {
-      std::terminate();
-    }
-    void return_void() {}
-  };
+namespace PngReadWrite {
+  namespace {
+    // Write callbacks for outputs kept in memory
+    void appendData(png_structp png_ptr, png_bytep data, png_size_t length) {
+      auto* out = (std::vector<png_byte>*)png_get_io_ptr(png_ptr);
+      out->insert(out->end(), data, data + length);
+    }
 
-  std::coroutine_handle<promise_type> handle;
-};
+    void flushData(png_structp png_ptr) {}
 
+    void sinkData(png_structp png_ptr, png_bytep data, png_size_t length) {
+      auto* sink = (OutputSink*)png_get_io_ptr(png_ptr);
+      (*sink)({data, length});
+    }
+  };
 
-// Awaiter job: needs to read some data, suspend if more needed 
-template <size_t bufSize>
-class Reader {
- public:
-  Reader (std::ifstream && _imageStream) : imageStream(std::move(_imageStream)) {}
+  Branch::Branch(const OutputSpec& output)
+      : sampleRate(output.sampleRate), compressionLevel(output.compressionLevel),
+        filters(output.filters), flushRows(output.flushRows) {
+    if (output.raw) {
+      // Rows are only collected, nothing to encode
+      raw = output.raw;
+      return;
+    }
+    png_write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+        (png_voidp)nullptr, png_err, NULL);
+    if (!png_write_ptr) {
+      throw std::runtime_error("Error creating ping write info ptr");
+    }
+    if (output.sink) {
+      sink = output.sink;
+      png_set_write_fn(png_write_ptr, sink.get(), sinkData, flushData);
+      return;
+    }
+    if (output.memory) {
+      memory = output.memory;
+      png_set_write_fn(png_write_ptr, memory.get(), appendData, flushData);
+      return;
+    }
+    outFilePtr = fopen(output.outFile.c_str(), "wb");
+    if (outFilePtr == nullptr) {
+      png_destroy_write_struct(&png_write_ptr, (png_infop*)nullptr);
+      throw std::runtime_error("Can't open file to write");
+    }
+    png_init_io(png_write_ptr, outFilePtr);
+  }
 
-  std::ifstream imageStream;
-  std::array<std::byte, bufSize> imageBuffer;
-  size_t totalRead = 0;
-  
-  bool await_ready() {
-     // will never be true, but worth noting if the stream is full, no need to suspend
-     return totalRead == bufSize; 
+  Branch::Branch(Branch&& other) noexcept
+      : sampleRate(other.sampleRate), compressionLevel(other.compressionLevel),
+        filters(other.filters), flushRows(other.flushRows), rowsSinceFlush(other.rowsSinceFlush),
+        png_write_ptr(other.png_write_ptr),
+        outFilePtr(other.outFilePtr), memory(std::move(other.memory)),
+        raw(std::move(other.raw)), sink(std::move(other.sink)), outWidth(other.outWidth),
+        outHeight(other.outHeight), kernel(other.kernel), row(std::move(other.row)) {
+    other.png_write_ptr = nullptr;
+    other.outFilePtr = nullptr;
   }
 
-  bool await_suspend(std::coroutine_handle<> h) {
-    size_t numRead = imageStream.readsome((char*)&imageBuffer.at(totalRead),
-        imageBuffer.max_size() - totalRead);
-    if (numRead == 0) {
-        std::cout << "Reached end of file" << std::endl;
-        return false; // we are done
-    } else if (imageStream.fail()) {
-        throw std::runtime_error("There was an error reading the file");
+  Branch::~Branch() {
+    if (png_write_ptr) {
+      png_destroy_write_struct(&png_write_ptr, (png_infop*)nullptr);
+    }
+    if (outFilePtr) {
+      fclose(outFilePtr);
     }
-    
-    totalRead += numRead;
-    assert(totalRead <= bufSize);
-    if (totalRead == bufSize) {
-        return false; // no need to suspend, we are done
-    } else {
-        return true; // need to suspend and try again later
-    } 
   }
 
-  // the return value here is the return value of co_await
-  std::span<std::byte> await_resume() { return {imageBuffer.begin(), totalRead};  }
-
-  void clear() {
-    totalRead = 0;
+  void Branch::writeRow(png_const_bytep row) {
+    {
+      TRACE_SPAN("png_write_row");
+      png_write_row(png_write_ptr, row);
+    }
+    if (flushRows > 0 && ++rowsSinceFlush >= flushRows) {
+      TRACE_SPAN("png_write_flush");
+      rowsSinceFlush = 0;
+      png_write_flush(png_write_ptr);
+    }
   }
-};
 
+  // Writes the header of an output, taking everything but the dimensions
+  // and interlacing from the input. Rows are written one at a time, so
+  // outputs are never interlaced
+  void writeHeader(png_structp png_ptr, png_infop png_info, Branch& branch) {
+    png_uint_32 width, height;
+    int bit_depth, color_type, interlace_type;
+    int compression_type, filter_type;
+    png_get_IHDR(png_ptr, png_info, &width, &height, &bit_depth,
+          &color_type, &interlace_type, &compression_type, &filter_type);
+
+    png_infop info_write_ptr = png_create_info_struct(branch.png_write_ptr);
+    if (!info_write_ptr) {
+      // The branch still owns the write struct and cleans it up
+      throw std::runtime_error("Error creating ping write info ptr");
+    }
 
-namespace PngReadWrite {
-  // User-provided struct to be accessed during png processing
-  struct userInfo {
-    // Check if we are done processing image
-    bool isDone = false;
-    // Write handle, used for progressive writes
-    png_structp png_write_ptr;
-    // Parameters for image manipulation
-    size_t rowWidth = 0;
-    size_t channels = 1;
-    unsigned sampleRate = 1;
-  };
+    png_set_IHDR(branch.png_write_ptr, info_write_ptr, branch.outWidth,
+        branch.outHeight, bit_depth, color_type, PNG_INTERLACE_NONE,
+        compression_type, filter_type);
+    if (branch.compressionLevel >= 0) {
+      png_set_compression_level(branch.png_write_ptr, branch.compressionLevel);
+    }
+    if (branch.filters >= 0) {
+      png_set_filter(branch.png_write_ptr, PNG_FILTER_TYPE_BASE, branch.filters);
+    }
+
+    // Shrinking keeps palette indexes as they are, so the palette (and its
+    // transparency) carries over unchanged
+    png_colorp palette;
+    int num_palette;
+    if (png_get_PLTE(png_ptr, png_info, &palette, &num_palette) == PNG_INFO_PLTE) {
+      png_set_PLTE(branch.png_write_ptr, info_write_ptr, palette, num_palette);
+    }
+    png_bytep trans_alpha;
+    int num_trans;
+    png_color_16p trans_color;
+    if (png_get_tRNS(png_ptr, png_info, &trans_alpha, &num_trans, &trans_color) == PNG_INFO_tRNS) {
+      png_set_tRNS(branch.png_write_ptr, info_write_ptr, trans_alpha, num_trans, trans_color);
+    }
+    png_write_info(branch.png_write_ptr, info_write_ptr);
+    png_set_packing(branch.png_write_ptr);
+    png_write_flush(branch.png_write_ptr);
+
+    // We don't need this anymore, destroy it now to reclaim memory
+    png_destroy_info_struct(branch.png_write_ptr, &info_write_ptr);
+  }
+
+  // The input's pixel format, which outputs encoded on their own (tiles,
+  // raw outputs) are written in
+  Tiles::PixelFormat pixelFormat(png_structp png_ptr, png_infop png_info, size_t pixelBytes) {
+    Tiles::PixelFormat format;
+    format.bitDepth = png_get_bit_depth(png_ptr, png_info);
+    format.colorType = png_get_color_type(png_ptr, png_info);
+    format.pixelBytes = pixelBytes;
+    png_colorp palette;
+    int num_palette;
+    if (png_get_PLTE(png_ptr, png_info, &palette, &num_palette) == PNG_INFO_PLTE) {
+      format.palette.assign(palette, palette + num_palette);
+    }
+    png_bytep trans_alpha;
+    int num_trans;
+    png_color_16p trans_color;
+    if (png_get_tRNS(png_ptr, png_info, &trans_alpha, &num_trans, &trans_color) == PNG_INFO_tRNS) {
+      format.hasTrans = true;
+      if (trans_alpha) {
+        format.transAlpha.assign(trans_alpha, trans_alpha + num_trans);
+      }
+      if (trans_color) {
+        format.transColor = *trans_color;
+      }
+    }
+    return format;
+  }
 
   void info_callback(png_structp png_ptr, png_infop png_info) {
-    std::cout << "Received png info" << std::endl;
+    TRACE_SPAN("info_callback");
+    if (verboseOutput) {
+      std::cout << "Received png info" << std::endl;
+    }
     
+    // Rows arrive one pixel per byte for bit depths under 8, the writers
+    // pack them back below. This keeps every pixel a whole number of bytes
+    png_set_packing(png_ptr);
+    // Has to come after the header is read, before that libpng doesn't
+    // know the image is interlaced and hands out each pass as whole rows
+    png_set_interlace_handling(png_ptr);
+
     // PSA: This MUST be called, even though no transformations are happening
     png_start_read_image(png_ptr);
     
@@ -120,120 +203,332 @@ namespace PngReadWrite {
     int compression_type, filter_type;
     png_get_IHDR(png_ptr, png_info, &width, &height, &bit_depth,
           &color_type, &interlace_type, &compression_type, &filter_type);
-    std::cout << "Image width " << width << " height " << height << std::endl;
-    
-    png_infop info_write_ptr = png_create_info_struct(info->png_write_ptr);
-    if (!info_write_ptr) {
-      png_destroy_write_struct(&info->png_write_ptr, (png_infop*)nullptr);
-      throw std::runtime_error("Error creating ping write info ptr");
+    if (verboseOutput) {
+      std::cout << "Image width " << width << " height " << height << std::endl;
     }
 
-    // Check that the sample rate remotely makes sense
-    if (width < info->sampleRate || height < info->sampleRate) {
-      throw std::runtime_error("Sample rate outside dimensions of image");
-    } 
-
-    // Set up output image header using the shrunk dimensions
-    png_set_IHDR(info->png_write_ptr, info_write_ptr, width / info->sampleRate,
-        height / info->sampleRate, bit_depth, color_type, interlace_type,
-        compression_type, filter_type);
-    png_write_info(info->png_write_ptr, info_write_ptr);
-    png_write_flush(info->png_write_ptr);
+    if (info->imagePixels) {
+      info->imagePixels->store((uint64_t)width * height, std::memory_order_relaxed);
+    }
 
-    // We don't need this anymore, destroy it now to reclaim memory
-    png_destroy_write_struct(nullptr, &info_write_ptr);
- 
     // Get row width and channels for row sampling in later callbacks 
+    info->width = width;
+    info->height = height;
     info->rowWidth = png_get_rowbytes(png_ptr, png_info);
     info->channels = png_get_channels(png_ptr, png_info);
-    std::cout << "Row width = " << info->rowWidth << " Num channels = "
-        << info->channels << std::endl;
+    info->pixelBytes = info->channels * (bit_depth == 16 ? 2 : 1);
+    if (verboseOutput) {
+      std::cout << "Row width = " << info->rowWidth << " Num channels = "
+          << info->channels << std::endl;
+    }
+    if (interlace_type != PNG_INTERLACE_NONE) {
+      // Every pass but the last leaves gaps in the rows, so the passes are
+      // combined into the whole image (one pixel per byte, like the rows)
+      info->interlaced.resize((size_t)height * width * info->pixelBytes);
+    }
+
+    if (info->rowHash) {
+      // Rows alone don't tell the images apart, the header has to match too
+      Tiles::PixelFormat format = pixelFormat(png_ptr, png_info, info->pixelBytes);
+      png_uint_32 header[] = {width, height, (png_uint_32)bit_depth, (png_uint_32)color_type,
+          (png_uint_32)interlace_type};
+      info->rowHash->update(header, sizeof(header));
+      info->rowHash->update(format.palette.data(), format.palette.size() * sizeof(png_color));
+      info->rowHash->update(format.transAlpha.data(), format.transAlpha.size());
+      info->rowHash->update(&format.transColor, sizeof(format.transColor));
+    }
+
+    for (Branch& branch : info->branches) {
+      // Check that the sample rate remotely makes sense
+      if (width < branch.sampleRate || height < branch.sampleRate) {
+        throw std::runtime_error("Sample rate outside dimensions of image");
+      } 
+
+      // Set up output image header using the shrunk dimensions
+      branch.outWidth = width / branch.sampleRate;
+      branch.outHeight = height / branch.sampleRate;
+      if (branch.raw) {
+        branch.raw->format = pixelFormat(png_ptr, png_info, info->pixelBytes);
+        branch.raw->width = branch.outWidth;
+        branch.raw->height = branch.outHeight;
+        branch.raw->pixels.reserve((size_t)branch.outWidth * branch.outHeight * info->pixelBytes);
+      } else {
+        writeHeader(png_ptr, png_info, branch);
+      }
+      branch.kernel = Kernels::sampleKernel(info->pixelBytes);
+      branch.row.resize(branch.outWidth * info->pixelBytes);
+    }
+
+    if (!info->pyramidPrefix.empty() || info->tiles) {
+      if (width < info->baseRate || height < info->baseRate) {
+        throw std::runtime_error("Sample rate outside dimensions of image");
+      }
+      png_uint_32 levelWidth = width / info->baseRate;
+      png_uint_32 levelHeight = height / info->baseRate;
+      info->baseHeight = levelHeight;
+      if (info->baseRate > 1) {
+        info->baseKernel = Kernels::sampleKernel(info->pixelBytes);
+        info->baseRow.resize(levelWidth * info->pixelBytes);
+      }
+      info->boxKernel = Kernels::boxKernel(info->channels, bit_depth,
+          color_type == PNG_COLOR_TYPE_PALETTE);
+
+      // Halve (rounding up, like Deep Zoom does, so edge pixels are kept)
+      // until 1x1
+      std::vector<std::pair<png_uint_32, png_uint_32>> levelSizes{{levelWidth, levelHeight}};
+      for (unsigned level = 1; levelWidth > 1 || levelHeight > 1; ++level) {
+        PyramidLevel pyramidLevel;
+        pyramidLevel.inWidth = levelWidth;
+        pyramidLevel.inHeight = levelHeight;
+        levelWidth = (levelWidth + 1) / 2;
+        levelHeight = (levelHeight + 1) / 2;
+        pyramidLevel.outWidth = levelWidth;
+        pyramidLevel.outHeight = levelHeight;
+        pyramidLevel.row.resize(levelWidth * info->pixelBytes);
+        pyramidLevel.pendingRow.resize(pyramidLevel.inWidth * info->pixelBytes);
+        levelSizes.push_back({levelWidth, levelHeight});
+
+        if (!info->pyramidPrefix.empty()) {
+          std::string outFile = info->pyramidPrefix + "-" + std::to_string(level) + ".png";
+          Branch& branch = pyramidLevel.branch.emplace(
+              OutputSpec{outFile, info->baseRate << std::min(level, 31u)});
+          branch.outWidth = levelWidth;
+          branch.outHeight = levelHeight;
+          writeHeader(png_ptr, png_info, branch);
+        }
+        info->pyramid.push_back(std::move(pyramidLevel));
+      }
+
+      if (info->tiles) {
+        info->tiler = std::make_unique<Tiles::Tiler>(*info->tiles,
+            pixelFormat(png_ptr, png_info, info->pixelBytes), std::move(levelSizes));
+      }
+    }
+  }
+
+  // Feeds one row into a mip chain level. Every second row completes a 2x2
+  // block row, which is written out and passed down to the next level.
+  // lastRow is set when flushing the last row of an odd height, which then
+  // averages with itself
+  void pyramidRow(struct userInfo *info, size_t level, png_const_bytep row, bool lastRow = false) {
+    PyramidLevel& pyramidLevel = info->pyramid[level];
+    png_const_bytep top = row;
+    if (pyramidLevel.inHeight > 1 && !lastRow) {
+      if (!pyramidLevel.havePending) {
+        memcpy(pyramidLevel.pendingRow.data(), row, pyramidLevel.pendingRow.size());
+        pyramidLevel.havePending = true;
+        return;
+      }
+      top = pyramidLevel.pendingRow.data();
+      pyramidLevel.havePending = false;
+    }
+
+    // Pairs of columns, then the odd last one on its own
+    png_uint_32 pairs = pyramidLevel.inWidth / 2;
+    info->boxKernel(top, row, pyramidLevel.row.data(), pairs, 1);
+    if (pyramidLevel.inWidth % 2 != 0) {
+      size_t offset = (pyramidLevel.inWidth - 1) * info->pixelBytes;
+      info->boxKernel(top + offset, row + offset,
+          pyramidLevel.row.data() + pairs * info->pixelBytes, 1, 0);
+    }
+
+    if (pyramidLevel.branch) {
+      pyramidLevel.branch->writeRow(pyramidLevel.row.data());
+    }
+    if (info->tiler) {
+      info->tiler->addRow(level + 1, pyramidLevel.row.data());
+    }
+    if (level + 1 < info->pyramid.size()) {
+      pyramidRow(info, level + 1, pyramidLevel.row.data());
+    }
+  }
+
+  // Feeds a row of the base image (the input at baseRate) into the chain
+  void baseRow(struct userInfo *info, png_const_bytep row) {
+    if (info->tiler) {
+      info->tiler->addRow(0, row);
+    }
+    if (!info->pyramid.empty()) {
+      pyramidRow(info, 0, row);
+    }
+  }
+
+  // Shrinks one complete row of the input into every output
+  void finishedRow(struct userInfo *info, png_const_bytep new_row, png_uint_32 row_num) {
+    if (info->rowHash) {
+      info->rowHash->update(new_row, info->width * info->pixelBytes);
+    }
+
+    // Do the image manipulation here - shrink the image using each output's
+    // sample rate. Every output reads the same decoded row, so shrink into
+    // the output's own row rather than in place
+    for (Branch& branch : info->branches) {
+      if (row_num % branch.sampleRate != 0 || row_num / branch.sampleRate >= branch.outHeight) {
+        continue;
+      }
+      branch.kernel(new_row, branch.row.data(), branch.outWidth, branch.sampleRate);
+      if (branch.raw) {
+        branch.raw->pixels.insert(branch.raw->pixels.end(), branch.row.begin(), branch.row.end());
+        continue;
+      }
+      branch.writeRow(branch.row.data());
+    }
+
+    if (info->baseRate == 1) {
+      if (!info->pyramid.empty() || info->tiler) {
+        baseRow(info, new_row);
+      }
+    } else if (info->baseKernel && row_num % info->baseRate == 0 &&
+        row_num / info->baseRate < info->baseHeight) {
+      info->baseKernel(new_row, info->baseRow.data(), info->baseRow.size() / info->pixelBytes,
+          info->baseRate);
+      baseRow(info, info->baseRow.data());
+    }
   }
 
   void row_callback(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass) {
+    TRACE_SPAN("row_callback");
     // Write out the row
     struct userInfo *info = (struct userInfo*)png_get_progressive_ptr(png_ptr);
     assert(info->rowWidth > 0);
+    if (info->cancel) {
+      // Rows are where the time goes, a single chunk can inflate to many
+      info->cancel->check();
+    }
+    if (info->interlaced.empty()) {
+      if (info->guard) {
+        info->guard->rowDecoded(pass);
+      }
+      finishedRow(info, new_row, row_num);
+      return;
+    }
 
-    // Do the image manipulation here - shrink the image using the provided sample
-    // rate. Note this doesn't use any fancy algorithms like nearest neighbors,
-    // averaging, etc. as its not needed atm, but we could be smarter here 
-    if (row_num % info->sampleRate == 0) {
-      // Avoid a copy by writing to the same row struct as we shrink the image
-      int writePos = 0;
-      // Copy in chunks equal to the number of color channels (actual full pixel size)
-      for (int i = 0; i < info->rowWidth; i += info->sampleRate*info->channels) {
-        // Bounds checking
-        if (i + info->channels < info->rowWidth){
-          for (int y = 0; y < info->channels; ++y) {
-            new_row[writePos+y] = new_row[i+y];
-          }
-        }
-        writePos += info->channels;
+    // Interlaced rows come once per pass, without data when the pass left
+    // that row as it was. The last pass goes through the rows in order and
+    // completes each one, so they can go out as it arrives
+    png_bytep row = info->interlaced.data() + (size_t)row_num * info->width * info->pixelBytes;
+    if (new_row) {
+      if (info->guard && PNG_ROW_IN_INTERLACE_PASS(row_num, pass)) {
+        // Rows outside the pass are only its pixels spread over them
+        info->guard->rowDecoded(pass);
       }
-      png_write_row(info->png_write_ptr, new_row);
-      png_write_flush(info->png_write_ptr);
+      png_progressive_combine_row(png_ptr, row, new_row);
+    }
+    if (pass == 6) {
+      finishedRow(info, row, row_num);
+      info->rowsFinished = row_num + 1;
     }
   }
 
   void end_callback(png_structp png_ptr, png_infop png_info) {
-    std::cout << "Received end of png" << std::endl;
+    TRACE_SPAN("end_callback");
+    if (verboseOutput) {
+      std::cout << "Received end of png" << std::endl;
+    }
     struct userInfo *info = (struct userInfo*)png_get_progressive_ptr(png_ptr);
     if (info == nullptr) {
       throw std::runtime_error("No info struct in end_callback");
     }
     info->isDone = true;
 
+    // Images a single row high have no last pass, their rows are only
+    // complete now
+    for (png_uint_32 row_num = info->rowsFinished; !info->interlaced.empty() && row_num < info->height;
+        ++row_num) {
+      finishedRow(info, info->interlaced.data() + (size_t)row_num * info->width * info->pixelBytes,
+          row_num);
+    }
+    info->interlaced = {};
+
     // Write out metadata at the end
-    png_write_end(info->png_write_ptr, png_info);
-    png_write_flush(info->png_write_ptr);
+    for (Branch& branch : info->branches) {
+      if (branch.raw) {
+        continue;
+      }
+      png_write_end(branch.png_write_ptr, png_info);
+      png_write_flush(branch.png_write_ptr);
+    }
+    // Levels with an odd height still hold their last row, top down so each
+    // flushed row can complete the pair waiting in the level below
+    for (size_t level = 0; level < info->pyramid.size(); ++level) {
+      PyramidLevel& pyramidLevel = info->pyramid[level];
+      if (pyramidLevel.havePending) {
+        pyramidLevel.havePending = false;
+        pyramidRow(info, level, pyramidLevel.pendingRow.data(), true);
+      }
+    }
+    for (PyramidLevel& pyramidLevel : info->pyramid) {
+      if (pyramidLevel.branch) {
+        png_write_end(pyramidLevel.branch->png_write_ptr, png_info);
+        png_write_flush(pyramidLevel.branch->png_write_ptr);
+      }
+    }
+    if (info->tiler) {
+      info->tiler->finish();
+    }
   }
 };
 
 
-ReturnObj coPng(const char* inFilename, const char* outFilename, unsigned sampleRate)
-{
-  std::ifstream imageStream(inFilename,std::fstream::binary); // fstream:in is implied
-  if (!imageStream) {
-    throw std::runtime_error("Can't open file to read");
+// Owns the libpng read side for one image, so a job that throws part way
+// through doesn't leak its structs (each Branch owns its own writer)
+struct PngHandles {
+  png_structp png_ptr = nullptr;
+  png_infop info_ptr = nullptr;
+
+  ~PngHandles() {
+    if (png_ptr) {
+      png_destroy_read_struct(&png_ptr, &info_ptr, (png_infop*)nullptr);
+    }
   }
-  
-  Reader<1024> imageReader{std::move(imageStream)};
-  
+};
+
+// The shrink loop itself, for any awaitable handing out chunks of the image
+// (a Reader, or a ChunkReader fed from a socket)
+template <typename Input>
+static ReturnObj shrinkFrom(Input imageReader, ShrinkSpec spec)
+{
+  imageReader.hasher = spec.inputHash;
+
   // libpng boilerplate here
   //
   // reading setup
-  png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL); 
-  if (!png_ptr) {
+  PngHandles handles;
+  handles.png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, png_err, NULL);
+  if (!handles.png_ptr) {
     throw std::runtime_error("Error creating png struct");
   }
-  png_infop info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr) {
-    png_destroy_read_struct(&png_ptr, (png_infop*)nullptr, (png_infop*)nullptr);
+  handles.info_ptr = png_create_info_struct(handles.png_ptr);
+  if (!handles.info_ptr) {
     throw std::runtime_error("Error creating ping info ptr");
   }
-  
-  // writing setup
-  png_structp png_write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-      (png_voidp)nullptr, NULL, NULL);
-  if (!png_write_ptr) {
-    throw std::runtime_error("Error creating ping write info ptr");
-  }
+  png_structp png_ptr = handles.png_ptr;
+  png_infop info_ptr = handles.info_ptr;
 
-  // Have to use C-style FILE handle here, not easy to work around
-  FILE *outFilePtr = fopen(outFilename, "wb");
-  if (outFilePtr == nullptr) {
-    throw std::runtime_error("Can't open file to write");
-  }
-  png_init_io(png_write_ptr, outFilePtr);
-  
-  // User state for writing
+  // User state for writing, one writer per output
   struct PngReadWrite::userInfo info;
-  info.png_write_ptr = png_write_ptr;
-  info.sampleRate = sampleRate;
+  info.branches.reserve(spec.outputs.size());
+  for (const OutputSpec& output : spec.outputs) {
+    info.branches.emplace_back(output);
+  }
+  info.pyramidPrefix = spec.pyramidPrefix;
+  info.tiles = spec.tiles;
+  info.baseRate = spec.baseRate;
+  info.rowHash = spec.rowHash;
+  info.cancel = spec.cancel;
+  info.imagePixels = spec.imagePixels;
+  std::optional<InputGuard> guard;
+  if (spec.limits.any()) {
+    guard.emplace(spec.limits);
+    info.guard = &*guard;
+    if (spec.limits.maxChunkBytes) {
+      // Covers what zTXt or iCCP inflate to, the guard only sees their
+      // compressed size
+      png_set_chunk_malloc_max(png_ptr, spec.limits.maxChunkBytes);
+    }
+  }
   png_set_progressive_read_fn(png_ptr, (void*)&info /* user pointer */,
         PngReadWrite::info_callback, PngReadWrite::row_callback, PngReadWrite::end_callback);
-  png_set_interlace_handling(png_ptr);  
   //
   // end libpng boilerplate
 
@@ -241,8 +536,13 @@ ReturnObj coPng(const char* inFilename, const char* outFilename, unsigned sample
     // You can co_await a function that returns an Awaitable object,
     // or the awaitable object directly as we do here
     auto span = co_await imageReader;
+    if (spec.cancel) {
+      spec.cancel->check();
+    }
 
-    std::cout << "Read " << span.size() << " bytes" << std::endl;
+    if (verboseOutput) {
+      std::cout << "Read " << span.size() << " bytes" << std::endl;
+    }
 
     // at this point, the whole buffer chunk should be populated
     // process it through libpng
@@ -254,18 +554,40 @@ ReturnObj coPng(const char* inFilename, const char* outFilename, unsigned sample
     //
     // Note: would be a cool project to make a fully coroutine-based png
     // processing library, but this would be a very nontrivial endeavour
-    png_process_data(png_ptr, info_ptr, (png_bytep)span.data(), span.size()); 
+    if (guard) {
+      guard->feed(span);
+      guard->startWork();
+    }
+    {
+      TRACE_SPAN("png_process_data");
+      png_process_data(png_ptr, info_ptr, (png_bytep)span.data(), span.size());
+    }
+    if (guard) {
+      guard->stopWork();
+    }
 
     // Check if we are done reading, and therefore writing, the png
-    if (info.isDone || span.size() == 0) {
-      png_destroy_write_struct(&png_write_ptr,(png_infop*)nullptr);
-      png_destroy_read_struct(&png_ptr,&info_ptr, (png_infop*)nullptr);
-      fclose(outFilePtr);
+    // (handles and the branches clean up the libpng structs and output files)
+    if (info.isDone) {
       break;
+    } else if (span.size() == 0) {
+      throw std::runtime_error("Image ended before the end of the png");
     }
 
     // update when data translated
-    std::cout << "Wrote " << ftell(outFilePtr) << " bytes" << std::endl;
+    if (verboseOutput) {
+      long written = 0;
+      for (const PngReadWrite::Branch& branch : info.branches) {
+        if (branch.outFilePtr) {
+          written += ftell(branch.outFilePtr);
+        } else if (branch.memory) {
+          written += branch.memory->size();
+        } else if (branch.raw) {
+          written += branch.raw->pixels.size();
+        }
+      }
+      std::cout << "Wrote " << written << " bytes" << std::endl;
+    }
 
     imageReader.clear();
   };
@@ -273,26 +595,177 @@ ReturnObj coPng(const char* inFilename, const char* outFilename, unsigned sample
   // co_return is implied here
 }
 
+ReturnObj coPng(std::unique_ptr<std::istream> stream, BufferPool::Lease head, ShrinkSpec spec)
+{
+  return shrinkFrom(Reader<1024>{std::move(stream), std::move(head)}, std::move(spec));
+}
+
+ReturnObj coPng(ChunkReader input, ShrinkSpec spec)
+{
+  return shrinkFrom(std::move(input), std::move(spec));
+}
+
+ReturnObj coPng(MappedReader input, ShrinkSpec spec)
+{
+  return shrinkFrom(std::move(input), std::move(spec));
+}
+
+ReturnObj coPng(PrefetchedInput input, ShrinkSpec spec)
+{
+  return coPng(std::make_unique<std::ifstream>(std::move(input.stream)), std::move(input.head),
+      std::move(spec));
+}
+
+
+ReturnObj coPng(const char* inFilename, ShrinkSpec spec)
+{
+  std::ifstream imageStream(inFilename,std::fstream::binary); // fstream:in is implied
+  if (!imageStream) {
+    throw std::runtime_error("Can't open file to read");
+  }
+  return coPng(PrefetchedInput{std::move(imageStream)}, std::move(spec));
+}
+
+ReturnObj coPng(const char* inFilename, const char* outFilename, unsigned sampleRate)
+{
+  return coPng(inFilename, ShrinkSpec{{{outFilename, sampleRate}}});
+}
+
+
+void runPng(ReturnObj task)
+{
+  auto handle = task.handle;
+  while (!handle.done()) {
+    handle(); // same as resume()
+  }
+  std::exception_ptr exception = handle.promise().exception;
+  handle.destroy();
+  if (exception) {
+    std::rethrow_exception(exception);
+  }
+}
+
+void shrinkPng(const char* inFilename, ShrinkSpec spec)
+{
+  runPng(coPng(inFilename, std::move(spec)));
+}
+
 
 int main(int argc, char* argv[])
 {
-  if (argc != 4) {
-    std::cout << "Required arguments: inFile outFile sampleRate" << std::endl;
-    exit(-1);
+  // Traced builds (see trace.h) write what they recorded here on exit
+  if constexpr (Trace::compiledIn()) {
+    if (const char* tracePath = getenv("PNGSHRINK_TRACE")) {
+      Trace::dumpAtExit(tracePath);
+    }
+  }
+  if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+    return Batch::batchMain(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "sequence") == 0) {
+    return Sequence::sequenceMain(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "tar") == 0) {
+    return TarStream::tarMain(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+    return Server::serveMain(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "local") == 0) {
+    return LocalServer::localMain(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "pool") == 0) {
+    return Pool::poolMain(argc - 1, argv + 1);
+  }
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    return CorpusBench::benchMain(argc - 1, argv + 1);
   }
 
-  int sampleRate = atoi(argv[3]);
-  if (sampleRate <= 0) {
-    std::cout << "Sample rate must be greater than 0" << std::endl;
+  ShrinkSpec spec;
+  if (argc > 1 && strcmp(argv[1], "tiles") == 0) {
+    // Tiles of every level, written as the rows stream in
+    Tiles::TileSpec tiles;
+    int i = 2;
+    for (; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; ++i) {
+      if (strcmp(argv[i], "--size") == 0 && i + 2 < argc) {
+        tiles.tileSize = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "--layout") == 0 && i + 2 < argc) {
+        std::string layout = argv[++i];
+        if (layout == "dzi") {
+          tiles.layout = Tiles::Layout::Dzi;
+        } else if (layout == "xyz") {
+          tiles.layout = Tiles::Layout::Xyz;
+        } else {
+          std::cout << "Unknown tile layout " << layout << std::endl;
+          exit(-1);
+        }
+      } else if (strcmp(argv[i], "--rate") == 0 && i + 2 < argc) {
+        int sampleRate = atoi(argv[++i]);
+        if (sampleRate <= 0) {
+          std::cout << "Sample rate must be greater than 0" << std::endl;
+          exit(-1);
+        }
+        spec.baseRate = sampleRate;
+      } else if (strcmp(argv[i], "--archive") == 0) {
+        tiles.archive = true;
+      } else {
+        std::cout << "Unknown tiles option " << argv[i] << std::endl;
+        exit(-1);
+      }
+    }
+    if (argc - i != 2 || (int)tiles.tileSize <= 0) {
+      std::cout << "Required arguments: tiles [--size N] [--layout dzi|xyz] [--rate N] "
+          "[--archive] inFile outPath" << std::endl;
+      exit(-1);
+    }
+    tiles.outPath = argv[i + 1];
+    if (tiles.outPath.ends_with(".dzi")) {
+      tiles.outPath.resize(tiles.outPath.size() - 4);
+    }
+    spec.tiles = tiles;
+    argv += i - 1;
+  } else if (argc == 4 && strcmp(argv[1], "pyramid") == 0) {
+    // Mip chain written as outPrefix-1.png, outPrefix-2.png, ...
+    std::string prefix = argv[3];
+    if (prefix.ends_with(".png")) {
+      prefix.resize(prefix.size() - 4);
+    }
+    spec.pyramidPrefix = prefix;
+    argv++;
+  } else if (argc < 4 || argc % 2 != 0) {
+    // Extra outFile sampleRate pairs are shrunk from the same decode
+    std::cout << "Required arguments: inFile outFile sampleRate [outFile sampleRate]..." << std::endl;
+    std::cout << "       or: pyramid inFile outPrefix" << std::endl;
+    std::cout << "       or: tiles [--size N] [--layout dzi|xyz] [--rate N] [--archive] inFile outPath" << std::endl;
+    std::cout << "       or: batch [options] dir|glob|manifest..." << std::endl;
+    std::cout << "       or: sequence --out DIR [--rate N[,N...]] [--jobs N] frames..." << std::endl;
+    std::cout << "       or: tar [--rate N[,N...]] [in.tar|-] [out.tar|-]" << std::endl;
+    std::cout << "       or: serve [--listen HOST:PORT] [--threads N] [--timeout MS]"
+                 " [--input-buffer KB] [--output-buffer KB]" << std::endl;
+    std::cout << "       or: local --socket PATH [--jobs N]" << std::endl;
+    std::cout << "       or: pool [--workers N] [--rate N] < jobs" << std::endl;
     exit(-1);
+  } else {
+    for (int i = 2; i + 1 < argc; i += 2) {
+      int sampleRate = atoi(argv[i + 1]);
+      if (sampleRate <= 0) {
+        std::cout << "Sample rate must be greater than 0" << std::endl;
+        exit(-1);
+      }
+      spec.outputs.push_back({argv[i], (unsigned)sampleRate});
+    }
   }
 
-  auto handle = coPng(argv[1], argv[2], (unsigned)sampleRate).handle;
+  auto handle = coPng(argv[1], std::move(spec)).handle;
   auto &promise = handle.promise();
   std::cout << "Starting the png processing loop" << std::endl;
   while (!handle.done()) {
     handle(); // same as resume()
   }
+  std::exception_ptr exception = promise.exception;
   handle.destroy();
+  if (exception) {
+    std::rethrow_exception(exception);
+  }
   return 0;
 }
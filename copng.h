@@ -0,0 +1,445 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <ios>
+#include <iostream>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <span>
+#include <vector>
+#include <assert.h>
+
+#include "png.h"
+
+#include "bufferpool.h"
+#include "hash.h"
+#include "inputlimits.h"
+#include "kernels.h"
+#include "tiles.h"
+#include "trace.h"
+
+// libpng error handler that throws, shared by everything creating libpng structs
+void png_err(png_structp png_ptr, png_const_charp message);
+
+// Progress messages are useful when shrinking a single image by hand, but
+// drown out everything else once many jobs run at once (see batch mode)
+inline bool verboseOutput = true;
+
+// Coroutine task object, can be heap allocated
+struct ReturnObj {
+  // Used for return types and exceptions
+  struct promise_type {
+    // Holds whatever the coroutine threw so the caller can report it,
+    // a single bad image should not terminate a whole batch
+    std::exception_ptr exception;
+
+    ~promise_type() {
+      if (verboseOutput) {
+        std::cout << "promise_type is destroyed" << std::endl;
+      }
+    }
+    ReturnObj get_return_object() {
+      return {
+        .handle = std::coroutine_handle<promise_type>::from_promise(*this)
+      };
+    }
+    // means to NOT call the coroutine on initialization
+    // suspend_never would cause the coroutine to be called
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void unhandled_exception() {
+      exception = std::current_exception();
+    }
+    void return_void() {}
+  };
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+
+// Awaiter job: needs to read some data, suspend if more needed
+template <size_t bufSize>
+class Reader {
+ public:
+  Reader (std::unique_ptr<std::istream> && _imageStream, BufferPool::Lease && _prefetched = {})
+      : imageStream(std::move(_imageStream)), prefetched(std::move(_prefetched)) {}
+
+  // Usually a file, but any stream works, i.e. a member of a tar stream
+  std::unique_ptr<std::istream> imageStream;
+  // Start of the stream that was read ahead of time (see Prefetcher),
+  // handed out before anything more is read from imageStream
+  BufferPool::Lease prefetched;
+  size_t prefetchedPos = 0;
+  std::array<std::byte, bufSize> imageBuffer;
+  size_t totalRead = 0;
+  // When set, sees every byte handed out, in order
+  Hash::Hasher* hasher = nullptr;
+
+  bool await_ready() {
+     // will never be true, but worth noting if the stream is full, no need to suspend
+     return totalRead == bufSize;
+  }
+
+  bool await_suspend(std::coroutine_handle<> h) {
+    TRACE_SPAN("Reader::await_suspend");
+    if (prefetched) {
+      std::span<std::byte> head = prefetched.data().subspan(prefetchedPos);
+      size_t numCopied = std::min(head.size(), bufSize - totalRead);
+      memcpy(&imageBuffer[totalRead], head.data(), numCopied);
+      totalRead += numCopied;
+      prefetchedPos += numCopied;
+      if (prefetchedPos == prefetched.size) {
+        // Give the buffer back early so it can read ahead for another file
+        prefetched.release();
+      }
+      if (totalRead == bufSize) {
+        return false; // filled from memory, no need to suspend
+      }
+    }
+
+    size_t numRead = imageStream->readsome((char*)&imageBuffer.at(totalRead),
+        imageBuffer.max_size() - totalRead);
+    if (numRead == 0) {
+        if (verboseOutput) {
+          std::cout << "Reached end of file" << std::endl;
+        }
+        return false; // we are done
+    } else if (imageStream->fail()) {
+        throw std::runtime_error("There was an error reading the file");
+    }
+
+    totalRead += numRead;
+    assert(totalRead <= bufSize);
+    if (totalRead == bufSize) {
+        return false; // no need to suspend, we are done
+    } else {
+        return true; // need to suspend and try again later
+    }
+  }
+
+  // the return value here is the return value of co_await
+  std::span<std::byte> await_resume() {
+    std::span<std::byte> data{imageBuffer.begin(), totalRead};
+    if (hasher) {
+      hasher->update(data);
+    }
+    return data;
+  }
+
+  void clear() {
+    totalRead = 0;
+  }
+};
+
+
+// Chunks of an image pushed in by whoever receives them, i.e. a socket
+// event loop, for a ChunkReader to hand out
+struct ChunkQueue {
+  std::deque<std::vector<std::byte>> chunks;
+  // Bytes held in chunks, the one being decoded included
+  size_t bytes = 0;
+  // No more chunks will come
+  bool closed = false;
+
+  void push(std::span<const std::byte> data) {
+    chunks.emplace_back(data.begin(), data.end());
+    bytes += data.size();
+  }
+  // Whether resuming a job waiting on the reader lets it go on
+  bool ready() const { return !chunks.empty() || closed; }
+};
+
+// Awaiter job like Reader, for input that arrives on its own schedule.
+// Suspends before every chunk, like MappedReader, so whoever drives the job
+// decides whether to go on after each one, i.e. stops while the answer
+// isn't being read. With the queue empty it stays suspended until whoever
+// pushes the next chunk (or closes the queue) resumes the coroutine
+class ChunkReader {
+ public:
+  explicit ChunkReader(std::shared_ptr<ChunkQueue> _queue) : queue(std::move(_queue)) {}
+
+  std::shared_ptr<ChunkQueue> queue;
+  // When set, sees every byte handed out, in order
+  Hash::Hasher* hasher = nullptr;
+
+  // Closed and drained, straight through to the empty span
+  bool await_ready() { return queue->closed && queue->chunks.empty(); }
+  bool await_suspend(std::coroutine_handle<> h) { return true; }
+
+  // An empty span once the queue is closed and drained
+  std::span<std::byte> await_resume() {
+    if (queue->chunks.empty()) {
+      return {};
+    }
+    std::span<std::byte> data = queue->chunks.front();
+    if (hasher) {
+      hasher->update(data);
+    }
+    return data;
+  }
+
+  void clear() {
+    if (!queue->chunks.empty()) {
+      queue->bytes -= queue->chunks.front().size();
+      queue->chunks.pop_front();
+    }
+  }
+};
+
+// Awaiter job like Reader, over an image that is already in memory, i.e. a
+// mapped file. Hands out windows of that memory without copying it, so it
+// has to stay mapped until the job is done. Suspends before every window
+// although the data is there, so whoever drives the job still gets a say
+// between them
+class MappedReader {
+ public:
+  explicit MappedReader(std::span<const std::byte> _data, size_t _window = 64 * 1024)
+      : data(_data), window(_window) {}
+
+  std::span<const std::byte> data;
+  size_t window;
+  size_t pos = 0;
+  // When set, sees every byte handed out, in order
+  Hash::Hasher* hasher = nullptr;
+
+  // Nothing left, straight through to the empty span
+  bool await_ready() { return pos == data.size(); }
+  bool await_suspend(std::coroutine_handle<> h) { return true; }
+
+  std::span<const std::byte> await_resume() {
+    std::span<const std::byte> current = data.subspan(pos, std::min(window, data.size() - pos));
+    if (hasher) {
+      hasher->update(current);
+    }
+    return current;
+  }
+
+  void clear() {
+    pos += std::min(window, data.size() - pos);
+  }
+};
+
+
+// Thrown inside a job that was cancelled or ran past its deadline
+struct JobCancelled : std::runtime_error {
+  JobCancelled(bool _timedOut)
+      : std::runtime_error(_timedOut ? "Job timed out" : "Job cancelled"), timedOut(_timedOut) {}
+  bool timedOut;
+};
+
+// Lets whoever started a job stop it early, i.e. when its client went away
+// or it ran out of time. The job checks it after every co_await, before
+// every png_process_data call and at every row, and stops by throwing
+// JobCancelled, which unwinds the libpng structs and outputs like any
+// other error
+class CancelToken {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // May be called from any thread
+  void cancel() { cancelled = true; }
+  void setDeadline(Clock::time_point _deadline) { deadline = _deadline; }
+  Clock::time_point getDeadline() const { return deadline; }
+
+  void check() const {
+    if (cancelled) {
+      throw JobCancelled(false);
+    }
+    if (deadline != Clock::time_point::max() && Clock::now() >= deadline) {
+      throw JobCancelled(true);
+    }
+  }
+
+ private:
+  std::atomic<bool> cancelled = false;
+  Clock::time_point deadline = Clock::time_point::max();
+};
+
+// Takes encoded png bytes as they are produced
+using OutputSink = std::function<void(std::span<const png_byte>)>;
+
+// A shrunk image left unencoded, rows of pixels in the input's format
+// (one pixel per byte or more, see png_set_packing)
+struct RawImage {
+  Tiles::PixelFormat format;
+  png_uint_32 width = 0;
+  png_uint_32 height = 0;
+  std::vector<png_byte> pixels;
+};
+
+// One shrunk image to produce from an input. A new setting that changes the
+// encoded bytes has to be added to OutputCache::outputKey too
+struct OutputSpec {
+  std::string outFile;
+  unsigned sampleRate = 1;
+  // When set, the png is written here instead of to outFile
+  std::shared_ptr<std::vector<png_byte>> memory;
+  // When set, the rows are collected here instead of being encoded at all
+  std::shared_ptr<RawImage> raw;
+  // When set, the png is streamed here instead of to outFile
+  std::shared_ptr<OutputSink> sink;
+  // Encoder settings, libpng's defaults when negative: zlib level 0-9 and
+  // the PNG_FILTER_* flags rows may be filtered with
+  int compressionLevel = -1;
+  int filters = -1;
+  // Rows written between flushes of the encoder, 0 to only flush at the
+  // end. A flush ends the current deflate block, so the bytes so far can go
+  // out (a sink sees each row as it is shrunk) at some cost in size
+  unsigned flushRows = 1;
+};
+
+
+namespace PngReadWrite {
+  // One output image fed from the shared decode, with its own sample rate,
+  // row kernel and libpng writer
+  struct Branch {
+    // Creates the write struct and opens the output file
+    explicit Branch(const OutputSpec& output);
+    Branch(Branch&& other) noexcept;
+    Branch& operator=(Branch&&) = delete;
+    ~Branch();
+
+    // Encodes one row, flushing as often as flushRows asks
+    void writeRow(png_const_bytep row);
+
+    unsigned sampleRate = 1;
+    int compressionLevel = -1;
+    int filters = -1;
+    unsigned flushRows = 1;
+    unsigned rowsSinceFlush = 0;
+    // Write handle, used for progressive writes
+    png_structp png_write_ptr = nullptr;
+    // Have to use C-style FILE handle here, not easy to work around
+    FILE *outFilePtr = nullptr;
+    // Instead of outFilePtr for outputs kept in memory
+    std::shared_ptr<std::vector<png_byte>> memory;
+    // Instead of any encoding, for raw outputs
+    std::shared_ptr<RawImage> raw;
+    // Instead of outFilePtr for streamed outputs
+    std::shared_ptr<OutputSink> sink;
+    // Set up once the input header arrives
+    png_uint_32 outWidth = 0;
+    png_uint_32 outHeight = 0;
+    Kernels::RowKernel kernel = nullptr;
+    std::vector<png_byte> row;
+  };
+
+  // One level of a 2x mip chain. Input rows are paired up through
+  // pendingRow, each pair makes one output row which feeds the next level
+  struct PyramidLevel {
+    png_uint_32 inWidth = 0;
+    png_uint_32 inHeight = 0;
+    png_uint_32 outWidth = 0;
+    png_uint_32 outHeight = 0;
+    std::vector<png_byte> pendingRow;
+    bool havePending = false;
+    std::vector<png_byte> row;
+    // Only when the level is written out as its own png
+    std::optional<Branch> branch;
+  };
+
+  // User-provided struct to be accessed during png processing
+  struct userInfo {
+    // Check if we are done processing image
+    bool isDone = false;
+    // Every output shares the one decode
+    std::vector<Branch> branches;
+    // Mip chain levels, set up from the header when there is a
+    // pyramidPrefix or tiles. The chain starts from the input sampled at
+    // baseRate, which is tiled as well
+    std::string pyramidPrefix;
+    std::optional<Tiles::TileSpec> tiles;
+    unsigned baseRate = 1;
+    png_uint_32 baseHeight = 0;
+    Kernels::RowKernel baseKernel = nullptr;
+    std::vector<png_byte> baseRow;
+    std::vector<PyramidLevel> pyramid;
+    Kernels::BoxKernel boxKernel = nullptr;
+    std::unique_ptr<Tiles::Tiler> tiler;
+    // Hashes the header and every decoded row when set
+    Hash::Hasher* rowHash = nullptr;
+    const CancelToken* cancel = nullptr;
+    std::atomic<uint64_t>* imagePixels = nullptr;
+    InputGuard* guard = nullptr;
+    // The whole image for interlaced inputs, whose rows are only complete
+    // in the last Adam7 pass. Rows before rowsFinished were shrunk already
+    std::vector<png_byte> interlaced;
+    png_uint_32 rowsFinished = 0;
+    // Parameters for image manipulation
+    png_uint_32 width = 0;
+    png_uint_32 height = 0;
+    size_t rowWidth = 0;
+    size_t channels = 1;
+    size_t pixelBytes = 1;
+  };
+
+  void info_callback(png_structp png_ptr, png_infop png_info);
+  void finishedRow(struct userInfo *info, png_const_bytep row, png_uint_32 row_num);
+  void row_callback(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass);
+  void end_callback(png_structp png_ptr, png_infop png_info);
+};
+
+
+// An input file that was opened, and maybe partly read, ahead of time
+struct PrefetchedInput {
+  std::ifstream stream;
+  // First bytes of the file, already consumed from stream
+  BufferPool::Lease head;
+};
+
+// Everything to produce from one decode of an input
+struct ShrinkSpec {
+  std::vector<OutputSpec> outputs;
+  // When set, also writes a 2x box filtered mip chain down to 1x1 pixel as
+  // <pyramidPrefix>-1.png (half size), <pyramidPrefix>-2.png, ...
+  std::string pyramidPrefix;
+  // When set, cuts the base image and every level of its mip chain into
+  // tiles (see tiles.h)
+  std::optional<Tiles::TileSpec> tiles;
+  // The mip chain starts from the input sampled at this rate
+  unsigned baseRate = 1;
+  // When set, hashes the input as it is read (see OutputCache). Must
+  // outlive the coroutine
+  Hash::Hasher* inputHash = nullptr;
+  // When set, hashes the decoded image (header and rows), so images that
+  // are encoded differently but look the same hash the same. Must outlive
+  // the coroutine
+  Hash::Hasher* rowHash = nullptr;
+  // When set, the job stops with JobCancelled once it's cancelled or past
+  // its deadline. Must outlive the coroutine
+  const CancelToken* cancel = nullptr;
+  // When set, gets width * height as soon as the header is read, for
+  // schedulers that want to know how big a job is (see Executor). Must
+  // outlive the coroutine
+  std::atomic<uint64_t>* imagePixels = nullptr;
+  // Checked as the input streams in, the job stops with LimitExceeded at
+  // the first one it goes over
+  InputLimits limits;
+};
+
+// Shrinks one image, reading and writing progressively. Every output is
+// produced from the same decode. head, when set, holds the first bytes of
+// the image, already consumed from stream
+ReturnObj coPng(std::unique_ptr<std::istream> stream, BufferPool::Lease head, ShrinkSpec spec);
+ReturnObj coPng(PrefetchedInput input, ShrinkSpec spec);
+ReturnObj coPng(ChunkReader input, ShrinkSpec spec);
+ReturnObj coPng(MappedReader input, ShrinkSpec spec);
+ReturnObj coPng(const char* inFilename, ShrinkSpec spec);
+ReturnObj coPng(const char* inFilename, const char* outFilename, unsigned sampleRate);
+
+// Drives coPng to completion on the calling thread, rethrowing anything the
+// coroutine threw
+void runPng(ReturnObj task);
+void shrinkPng(const char* inFilename, ShrinkSpec spec);
@@ -0,0 +1,438 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <malloc.h>
+
+#include "batch.h"
+#include "benchstats.h"
+#include "copng.h"
+#include "corpusbench.h"
+
+namespace CorpusBench {
+  namespace {
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+      std::vector<std::string> sources;
+      unsigned runs = 5;
+      unsigned warmup = 1;
+      std::vector<unsigned> rates{4};
+      // 0 reads the file through coPng's own Reader, otherwise the file is
+      // loaded first and handed to the decoder this many KB at a time
+      size_t chunkKb = 0;
+      unsigned flushRows = 1;
+      int compressionLevel = -1;
+      int filters = -1;
+      std::string filtersName = "default";
+      std::string jsonFile;
+    };
+
+    struct CorpusFile {
+      std::string path;
+      uint64_t bytes = 0;
+      uint64_t pixels = 0;
+      // Groups this file counts towards, i.e. "color/rgb" and "size/small"
+      std::vector<std::string> groups;
+    };
+
+    struct Run {
+      double latencyMs = 0;
+      double firstByteMs = 0;
+      double peakRssMb = 0;
+    };
+
+    struct Group {
+      size_t files = 0;
+      size_t failed = 0;
+      // Totals for each timed run over the corpus
+      std::vector<double> nanoseconds;
+      std::vector<uint64_t> pixels;
+      std::vector<uint64_t> bytes;
+      // One per file per run
+      std::vector<Run> jobs;
+    };
+
+    uint32_t bigEndian32(const unsigned char* bytes) {
+      return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+    }
+
+    const char* colorName(int colorType) {
+      switch (colorType) {
+        case PNG_COLOR_TYPE_GRAY: return "gray";
+        case PNG_COLOR_TYPE_RGB: return "rgb";
+        case PNG_COLOR_TYPE_PALETTE: return "palette";
+        case PNG_COLOR_TYPE_GRAY_ALPHA: return "graya";
+        case PNG_COLOR_TYPE_RGB_ALPHA: return "rgba";
+      }
+      return "unknown";
+    }
+
+    const char* sizeClass(uint64_t pixels) {
+      if (pixels <= 64 * 64) {
+        return "tiny";
+      } else if (pixels <= 512 * 512) {
+        return "small";
+      } else if (pixels <= 4096 * 4096) {
+        return "medium";
+      }
+      return "large";
+    }
+
+    // Classifies a file by its IHDR, which has to be the first chunk
+    CorpusFile examine(const std::string& path) {
+      CorpusFile file{path};
+      unsigned char header[33];
+      std::ifstream in(path, std::ios::binary);
+      if (!in.read((char*)header, sizeof(header)) || png_sig_cmp(header, 0, 8) != 0 ||
+          memcmp(header + 12, "IHDR", 4) != 0) {
+        throw std::runtime_error(path + " isn't a png");
+      }
+      uint32_t width = bigEndian32(header + 16);
+      uint32_t height = bigEndian32(header + 20);
+      file.pixels = (uint64_t)width * height;
+      file.bytes = std::filesystem::file_size(path);
+      file.groups = {
+        "all",
+        std::string("color/") + colorName(header[25]),
+        "depth/" + std::to_string(header[24]),
+        header[28] == PNG_INTERLACE_NONE ? "interlace/none" : "interlace/adam7",
+        std::string("size/") + sizeClass(file.pixels),
+      };
+      return file;
+    }
+
+    std::vector<CorpusFile> findFiles(const std::vector<std::string>& sources) {
+      std::vector<std::string> paths;
+      for (const std::string& source : sources) {
+        if (std::filesystem::is_directory(source)) {
+          Batch::walkDirectory(source, 1, [&](const std::string& path, const std::string&) {
+            paths.push_back(path);
+          });
+        } else {
+          paths.push_back(source);
+        }
+      }
+      std::sort(paths.begin(), paths.end());
+      std::vector<CorpusFile> files;
+      for (const std::string& path : paths) {
+        try {
+          files.push_back(examine(path));
+        } catch (const std::exception& e) {
+          std::cout << "Skipping " << e.what() << std::endl;
+        }
+      }
+      return files;
+    }
+
+    // A line of /proc/self/status in MB, i.e. "VmRSS:"
+    double statusMb(const char* field) {
+      std::ifstream status("/proc/self/status");
+      for (std::string line; std::getline(status, line);) {
+        if (line.starts_with(field)) {
+          return atof(line.c_str() + strlen(field)) / 1024;
+        }
+      }
+      return 0;
+    }
+
+    // Linux keeps a high-water mark of resident memory per process that
+    // can be reset to the current RSS, which makes it a per job peak when
+    // jobs run one at a time. Freed memory the allocator holds on to is
+    // given back first, or it would count towards every later job. Returns
+    // the RSS it was reset to, what the process held before the job (the
+    // binary, the loaded input, ...), for the peak to leave out
+    double resetPeakRss() {
+      malloc_trim(0);
+      {
+        std::ofstream clearRefs("/proc/self/clear_refs");
+        clearRefs << "5";
+      }
+      return statusMb("VmHWM:");
+    }
+
+    Run runJob(const CorpusFile& file, const Options& options) {
+      std::optional<Clock::time_point> firstByte;
+      auto sink = std::make_shared<OutputSink>([&](std::span<const png_byte> data) {
+        if (!firstByte) {
+          firstByte = Clock::now();
+        }
+      });
+      ShrinkSpec spec;
+      for (unsigned rate : options.rates) {
+        OutputSpec output;
+        output.sampleRate = rate;
+        output.sink = sink;
+        output.compressionLevel = options.compressionLevel;
+        output.filters = options.filters;
+        output.flushRows = options.flushRows;
+        spec.outputs.push_back(std::move(output));
+      }
+
+      // Loaded outside the timing and the peak, like a caller that already
+      // holds the image in memory
+      std::vector<std::byte> data;
+      if (options.chunkKb > 0) {
+        data.resize(file.bytes);
+        std::ifstream in(file.path, std::ios::binary);
+        if (!in.read((char*)data.data(), data.size())) {
+          throw std::runtime_error("Can't read " + file.path);
+        }
+      }
+
+      double baseRssMb = resetPeakRss();
+      Clock::time_point start = Clock::now();
+      if (options.chunkKb > 0) {
+        runPng(coPng(MappedReader(data, options.chunkKb * 1024), std::move(spec)));
+      } else {
+        runPng(coPng(file.path.c_str(), std::move(spec)));
+      }
+      Clock::time_point end = Clock::now();
+
+      using Milliseconds = std::chrono::duration<double, std::milli>;
+      return {
+        .latencyMs = Milliseconds(end - start).count(),
+        .firstByteMs = Milliseconds(firstByte.value_or(end) - start).count(),
+        .peakRssMb = std::max(0.0, statusMb("VmHWM:") - baseRssMb),
+      };
+    }
+
+    bool parseFilters(const std::string& text, int& filters) {
+      filters = 0;
+      std::istringstream names(text);
+      std::string name;
+      while (std::getline(names, name, ',')) {
+        if (name == "none") {
+          filters |= PNG_FILTER_NONE;
+        } else if (name == "sub") {
+          filters |= PNG_FILTER_SUB;
+        } else if (name == "up") {
+          filters |= PNG_FILTER_UP;
+        } else if (name == "avg") {
+          filters |= PNG_FILTER_AVG;
+        } else if (name == "paeth") {
+          filters |= PNG_FILTER_PAETH;
+        } else if (name == "all") {
+          filters |= PNG_ALL_FILTERS;
+        } else {
+          return false;
+        }
+      }
+      return filters != 0;
+    }
+
+    void usage() {
+      std::cout << "Usage: bench [options] corpus..." << std::endl
+                << "  corpus is png files or directories (walked for *.png)" << std::endl
+                << "  --runs N        timed runs over the corpus (default 5)" << std::endl
+                << "  --warmup N      untimed runs first (default 1)" << std::endl
+                << "  --rate N[,N...] sample rate(s), one output each (default 4)" << std::endl
+                << "  --chunk KB      load each file first and decode it KB at a time" << std::endl
+                << "                  (default: read the file as shrinking does)" << std::endl
+                << "  --flush N       flush the encoder every N rows, 0 only at the end" << std::endl
+                << "                  (default 1)" << std::endl
+                << "  --level N       zlib compression level (default: libpng's)" << std::endl
+                << "  --filters F,... none, sub, up, avg, paeth or all (default: libpng's)" << std::endl
+                << "  --json FILE     write the results as JSON" << std::endl;
+    }
+  };
+
+  int benchMain(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      bool hasValue = i + 1 < argc;
+      if (arg == "--runs" && hasValue) {
+        options.runs = (unsigned)std::max(1, atoi(argv[++i]));
+      } else if (arg == "--warmup" && hasValue) {
+        options.warmup = (unsigned)std::max(0, atoi(argv[++i]));
+      } else if (arg == "--rate" && hasValue) {
+        if (!Batch::parseRates(argv[++i], options.rates)) {
+          std::cout << "Sample rate must be greater than 0" << std::endl;
+          return -1;
+        }
+      } else if (arg == "--chunk" && hasValue) {
+        options.chunkKb = (size_t)std::max(0, atoi(argv[++i]));
+      } else if (arg == "--flush" && hasValue) {
+        options.flushRows = (unsigned)std::max(0, atoi(argv[++i]));
+      } else if (arg == "--level" && hasValue) {
+        options.compressionLevel = std::clamp(atoi(argv[++i]), 0, 9);
+      } else if (arg == "--filters" && hasValue) {
+        options.filtersName = argv[++i];
+        if (!parseFilters(options.filtersName, options.filters)) {
+          std::cout << "Unknown filters " << options.filtersName << std::endl;
+          return -1;
+        }
+      } else if (arg == "--json" && hasValue) {
+        options.jsonFile = argv[++i];
+      } else if (arg.starts_with("--")) {
+        usage();
+        return -1;
+      } else {
+        options.sources.push_back(arg);
+      }
+    }
+    if (options.sources.empty()) {
+      usage();
+      return -1;
+    }
+    verboseOutput = false;
+
+    std::vector<CorpusFile> files;
+    try {
+      files = findFiles(options.sources);
+    } catch (const std::exception& e) {
+      std::cout << e.what() << std::endl;
+      return -1;
+    }
+    if (files.empty()) {
+      std::cout << "No pngs found" << std::endl;
+      return -1;
+    }
+
+    // Runs go over the whole corpus in turn rather than one file N times,
+    // so each run's totals are a sample taken under the same conditions
+    std::map<std::string, Group> groups;
+    for (const CorpusFile& file : files) {
+      for (const std::string& name : file.groups) {
+        groups[name];
+      }
+    }
+    // Why each file that failed did, empty for the others. A file that
+    // fails once is left out of every later run
+    std::vector<std::string> failed(files.size());
+    for (unsigned run = 0; run < options.warmup + options.runs; ++run) {
+      bool timed = run >= options.warmup;
+      if (timed) {
+        for (auto& [name, group] : groups) {
+          group.nanoseconds.push_back(0);
+          group.pixels.push_back(0);
+          group.bytes.push_back(0);
+        }
+      }
+      for (size_t i = 0; i < files.size(); ++i) {
+        if (!failed[i].empty()) {
+          continue;
+        }
+        Run result;
+        try {
+          result = runJob(files[i], options);
+        } catch (const std::exception& e) {
+          std::cout << files[i].path << " failed: " << e.what() << std::endl;
+          failed[i] = e.what()[0] ? e.what() : "unknown error";
+          continue;
+        }
+        if (!timed) {
+          continue;
+        }
+        for (const std::string& name : files[i].groups) {
+          Group& group = groups[name];
+          group.nanoseconds.back() += result.latencyMs * 1e6;
+          group.pixels.back() += files[i].pixels;
+          group.bytes.back() += files[i].bytes;
+          group.jobs.push_back(result);
+        }
+      }
+    }
+
+    for (size_t i = 0; i < files.size(); ++i) {
+      for (const std::string& name : files[i].groups) {
+        (failed[i].empty() ? groups[name].files : groups[name].failed) += 1;
+      }
+    }
+
+    std::vector<BenchStats::Benchmark> benchmarks;
+    printf("%-18s %6s %6s %9s %9s %9s %9s %9s %9s %9s\n", "group", "files", "failed", "Mpix/s",
+        "MB/s", "p50 ms", "p90 ms", "p99 ms", "ttfb p50", "peak MB");
+    for (const auto& [name, group] : groups) {
+      if (group.jobs.empty()) {
+        // Nothing to time, but the group shouldn't just vanish
+        printf("%-18s %6zu %6zu\n", name.c_str(), group.files, group.failed);
+        continue;
+      }
+      BenchStats::Benchmark time{"corpus/" + name + "/time", "ns/pixel"};
+      std::vector<double> megabytesPerSecond;
+      for (size_t run = 0; run < group.nanoseconds.size(); ++run) {
+        if (group.pixels[run] > 0) {
+          time.samples.push_back(group.nanoseconds[run] / group.pixels[run]);
+          megabytesPerSecond.push_back(group.bytes[run] * 1e3 / group.nanoseconds[run]);
+        }
+      }
+      double mpixelsPerSecond = 1e3 / BenchStats::median(time.samples);
+      double mbPerSecond = BenchStats::median(megabytesPerSecond);
+      time.metrics = {{"mpixels_per_s", mpixelsPerSecond}, {"mb_per_s", mbPerSecond},
+          {"files", (double)group.files}, {"failed", (double)group.failed}};
+
+      BenchStats::Benchmark latency{"corpus/" + name + "/latency", "ms"};
+      BenchStats::Benchmark firstByte{"corpus/" + name + "/ttfb", "ms"};
+      BenchStats::Benchmark peakRss{"corpus/" + name + "/peak_rss", "MB"};
+      for (const Run& job : group.jobs) {
+        latency.samples.push_back(job.latencyMs);
+        firstByte.samples.push_back(job.firstByteMs);
+        peakRss.samples.push_back(job.peakRssMb);
+      }
+      for (BenchStats::Benchmark* benchmark : {&latency, &firstByte}) {
+        for (auto [metric, p] : {std::pair{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}}) {
+          benchmark->metrics.push_back({metric, BenchStats::percentile(benchmark->samples, p)});
+        }
+      }
+      peakRss.metrics = {{"max", BenchStats::percentile(peakRss.samples, 1)}};
+
+      printf("%-18s %6zu %6zu %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.1f\n", name.c_str(), group.files,
+          group.failed, mpixelsPerSecond, mbPerSecond, latency.metrics[0].second, latency.metrics[1].second,
+          latency.metrics[2].second, firstByte.metrics[0].second, peakRss.metrics[0].second);
+      for (BenchStats::Benchmark* benchmark : {&time, &latency, &firstByte, &peakRss}) {
+        benchmarks.push_back(std::move(*benchmark));
+      }
+    }
+
+    if (!options.jsonFile.empty()) {
+      BenchStats::Context context = BenchStats::hostContext();
+      std::string corpus;
+      for (const std::string& source : options.sources) {
+        corpus += (corpus.empty() ? "" : " ") + source;
+      }
+      std::string rates;
+      for (unsigned rate : options.rates) {
+        rates += (rates.empty() ? "" : ",") + std::to_string(rate);
+      }
+      // One `path: error` line per file that was left out
+      std::string failures;
+      for (size_t i = 0; i < files.size(); ++i) {
+        if (!failed[i].empty()) {
+          failures += files[i].path + ": " + failed[i] + "\n";
+        }
+      }
+      context.insert(context.end(), {
+        {"corpus", corpus},
+        {"failed", failures},
+        {"runs", std::to_string(options.runs)},
+        {"rate", rates},
+        {"chunk_kb", options.chunkKb ? std::to_string(options.chunkKb) : "reader"},
+        {"flush_rows", std::to_string(options.flushRows)},
+        {"level", options.compressionLevel >= 0 ? std::to_string(options.compressionLevel) : "default"},
+        {"filters", options.filtersName},
+      });
+      std::ofstream out(options.jsonFile, std::ios::trunc);
+      BenchStats::writeJson(out, "corpus", context, benchmarks);
+      if (!out) {
+        std::cout << "Can't write " << options.jsonFile << std::endl;
+        return -1;
+      }
+    }
+    return std::any_of(failed.begin(), failed.end(), [](const std::string& error) {
+      return !error.empty();
+    }) ? 1 : 0;
+  }
+};
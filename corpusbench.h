@@ -0,0 +1,12 @@
+#pragma once
+
+// Bench mode: runs the whole shrink (read, decode, shrink, encode) over a
+// corpus of pngs several times and reports throughput, latency, time to the
+// first output byte and peak memory, overall and split by color type, bit
+// depth, interlacing and image size. The results are written in the
+// benchmark JSON format (see benchstats.h) so builds and settings can be
+// compared with each other
+namespace CorpusBench {
+  // Entry point for `pngshrink bench ...`, argv[0] is "bench"
+  int benchMain(int argc, char* argv[]);
+};
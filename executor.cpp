@@ -0,0 +1,133 @@
+#include <algorithm>
+
+#include "executor.h"
+
+Executor::Executor(unsigned numThreads, size_t _maxQueued) : maxQueued(_maxQueued) {
+  if (numThreads == 0) {
+    numThreads = 1;
+  }
+  for (unsigned i = 0; i < numThreads; ++i) {
+    workers.emplace_back([this] { workerLoop(); });
+  }
+}
+
+Executor::~Executor() {
+  {
+    std::lock_guard lock(mutex);
+    stopping = true;
+  }
+  workAvailable.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+void Executor::submit(Job job) {
+  std::unique_lock lock(mutex);
+  spaceAvailable.wait(lock, [this] { return queued < maxQueued; });
+  enqueue({.job = std::move(job)});
+  ++unfinished;
+  lock.unlock();
+  workAvailable.notify_one();
+}
+
+void Executor::setWeight(const std::string& tenant, double weight) {
+  std::lock_guard lock(mutex);
+  tenants[tenant].weight = std::max(weight, 1e-3);
+}
+
+void Executor::enqueue(Task task) {
+  Tenant& tenant = tenants[task.job.tenant];
+  if (tenant.queue.empty()) {
+    tenant.virtualTime = std::max(tenant.virtualTime, virtualClock);
+  }
+  task.cost = task.job.cost ? task.job.cost->load(std::memory_order_relaxed) : 0;
+  task.sequence = nextSequence++;
+  tenant.queue.push_back(std::move(task));
+  std::push_heap(tenant.queue.begin(), tenant.queue.end(), runsLater);
+  ++queued;
+}
+
+Executor::Task Executor::dequeue() {
+  // Tenants are few, a scan is cheaper than keeping them ordered
+  Tenant* next = nullptr;
+  for (auto& [name, tenant] : tenants) {
+    if (!tenant.queue.empty() && (!next || tenant.virtualTime < next->virtualTime)) {
+      next = &tenant;
+    }
+  }
+  virtualClock = std::max(virtualClock, next->virtualTime);
+  std::pop_heap(next->queue.begin(), next->queue.end(), runsLater);
+  Task task = std::move(next->queue.back());
+  next->queue.pop_back();
+  --queued;
+  return task;
+}
+
+void Executor::wait() {
+  std::unique_lock lock(mutex);
+  allDone.wait(lock, [this] { return unfinished == 0; });
+}
+
+void Executor::finish(Task& task, std::exception_ptr exception) {
+  if (task.job.done) {
+    task.job.done(exception);
+  }
+  std::lock_guard lock(mutex);
+  if (--unfinished == 0) {
+    allDone.notify_all();
+  }
+}
+
+void Executor::workerLoop() {
+  while (true) {
+    std::unique_lock lock(mutex);
+    workAvailable.wait(lock, [this] { return stopping || queued > 0; });
+    if (queued == 0) {
+      return; // stopping and nothing left to run
+    }
+    Task task = dequeue();
+    lock.unlock();
+    spaceAvailable.notify_one();
+
+    // Every resume ends at a chunk boundary, which is where a big job
+    // gives way once its time is up
+    auto sliceStart = std::chrono::steady_clock::now();
+    std::exception_ptr startError;
+    try {
+      if (!task.handle) {
+        task.handle = task.job.start().handle;
+      }
+      for (unsigned i = 0; i < sliceResumes && !task.handle.done(); ++i) {
+        task.handle(); // same as resume()
+        if (std::chrono::steady_clock::now() - sliceStart >= sliceTime) {
+          break;
+        }
+      }
+    } catch (...) {
+      // Only start() can throw here, the coroutine keeps its own exceptions
+      startError = std::current_exception();
+    }
+    std::chrono::duration<double> used = std::chrono::steady_clock::now() - sliceStart;
+    lock.lock();
+    Tenant& tenant = tenants[task.job.tenant];
+    tenant.virtualTime += used.count() / tenant.weight;
+    lock.unlock();
+
+    if (startError) {
+      finish(task, startError);
+    } else if (task.handle.done()) {
+      std::exception_ptr exception = task.handle.promise().exception;
+      task.handle.destroy();
+      finish(task, exception);
+    } else {
+      // Requeue behind its equals, with what's now known of its size,
+      // bypassing the producer limit since this job already counted
+      // against it
+      lock.lock();
+      enqueue(std::move(task));
+      lock.unlock();
+      workAvailable.notify_one();
+    }
+  }
+}
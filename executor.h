@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "copng.h"
+
+// Runs coroutine jobs (like coPng) on a small pool of threads. A worker
+// resumes a job for a slice and then puts it back on the queue if it
+// isn't finished, so one huge image can't hold a thread forever.
+//
+// Which job runs next: tenants get worker time in proportion to their
+// weights (weighted fair queuing on the time their slices took), and within
+// a tenant the job with the least expected work goes first, new jobs
+// included, so their header gets read and their size known early on
+class Executor {
+ public:
+  struct Job {
+    // Creates the coroutine, called on the worker that first runs the job
+    std::function<ReturnObj()> start;
+    // Called once the coroutine finishes, with whatever it threw
+    std::function<void(std::exception_ptr)> done;
+    // Who the job is for, all of a tenant's jobs share its share
+    std::string tenant;
+    // Expected work, i.e. pixels once the job has read its image header
+    // (see ShrinkSpec::imagePixels). 0 while unknown, or when not set
+    std::shared_ptr<std::atomic<uint64_t>> cost;
+  };
+
+  // maxQueued bounds how far producers can get ahead of the workers,
+  // submit blocks once that many jobs are waiting
+  Executor(unsigned numThreads, size_t maxQueued = 1024);
+  ~Executor();
+
+  void submit(Job job);
+
+  // A tenant's share relative to the others, 1 unless set
+  void setWeight(const std::string& tenant, double weight);
+
+  // Blocks until every submitted job has finished
+  void wait();
+
+ private:
+  struct Task {
+    Job job;
+    std::coroutine_handle<ReturnObj::promise_type> handle;
+    // Ordering within the tenant, least cost first then oldest
+    uint64_t cost = 0;
+    uint64_t sequence = 0;
+  };
+
+  struct Tenant {
+    double weight = 1;
+    // Worker seconds used, divided by weight
+    double virtualTime = 0;
+    // Heap, see runsLater
+    std::vector<Task> queue;
+  };
+
+  static bool runsLater(const Task& a, const Task& b) {
+    return a.cost != b.cost ? a.cost > b.cost : a.sequence > b.sequence;
+  }
+
+  // Caller holds mutex for these
+  void enqueue(Task task);
+  Task dequeue();
+
+  void workerLoop();
+  void finish(Task& task, std::exception_ptr exception);
+
+  // A job gets this many resumes (each one chunk of the image), or this
+  // long, whichever runs out first, before yielding its thread
+  static constexpr unsigned sliceResumes = 64;
+  static constexpr std::chrono::microseconds sliceTime{5000};
+
+  std::mutex mutex;
+  std::condition_variable workAvailable;
+  std::condition_variable spaceAvailable;
+  std::condition_variable allDone;
+  std::unordered_map<std::string, Tenant> tenants;
+  size_t queued = 0;
+  uint64_t nextSequence = 0;
+  // Highest virtual time handed out, a tenant that was idle starts from
+  // here instead of catching up on time it didn't use
+  double virtualClock = 0;
+  size_t maxQueued;
+  size_t unfinished = 0;
+  bool stopping = false;
+  std::vector<std::thread> workers;
+};
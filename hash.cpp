@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+namespace Hash {
+  namespace {
+    constexpr uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr uint64_t prime3 = 0x165667B19E3779F9ULL;
+    constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+    constexpr uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+    uint64_t rotl(uint64_t x, int r) {
+      return (x << r) | (x >> (64 - r));
+    }
+
+    // Little endian loads, memcpy keeps unaligned reads legal
+    uint64_t read64(const unsigned char* p) {
+      uint64_t value;
+      memcpy(&value, p, sizeof(value));
+      return value;
+    }
+
+    uint32_t read32(const unsigned char* p) {
+      uint32_t value;
+      memcpy(&value, p, sizeof(value));
+      return value;
+    }
+
+    uint64_t round(uint64_t acc, uint64_t input) {
+      acc += input * prime2;
+      acc = rotl(acc, 31);
+      return acc * prime1;
+    }
+
+    uint64_t mergeRound(uint64_t acc, uint64_t lane) {
+      acc ^= round(0, lane);
+      return acc * prime1 + prime4;
+    }
+  };
+
+  Hasher::Hasher(uint64_t _seed) : seed(_seed) {
+    lanes[0] = seed + prime1 + prime2;
+    lanes[1] = seed + prime2;
+    lanes[2] = seed;
+    lanes[3] = seed - prime1;
+  }
+
+  void Hasher::update(const void* data, size_t size) {
+    const unsigned char* p = (const unsigned char*)data;
+    totalSize += size;
+
+    // Top up a partly filled stripe first
+    if (buffered > 0) {
+      size_t numCopied = std::min(size, sizeof(buffer) - buffered);
+      memcpy(buffer + buffered, p, numCopied);
+      buffered += numCopied;
+      p += numCopied;
+      size -= numCopied;
+      if (buffered < sizeof(buffer)) {
+        return;
+      }
+      for (int i = 0; i < 4; ++i) {
+        lanes[i] = round(lanes[i], read64(buffer + 8 * i));
+      }
+      buffered = 0;
+    }
+
+    // Whole 32 byte stripes straight from the input
+    for (; size >= 32; p += 32, size -= 32) {
+      lanes[0] = round(lanes[0], read64(p));
+      lanes[1] = round(lanes[1], read64(p + 8));
+      lanes[2] = round(lanes[2], read64(p + 16));
+      lanes[3] = round(lanes[3], read64(p + 24));
+    }
+
+    memcpy(buffer, p, size);
+    buffered = size;
+  }
+
+  uint64_t Hasher::digest() const {
+    uint64_t hash;
+    if (totalSize >= 32) {
+      hash = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+      for (int i = 0; i < 4; ++i) {
+        hash = mergeRound(hash, lanes[i]);
+      }
+    } else {
+      hash = seed + prime5;
+    }
+    hash += totalSize;
+
+    // Whatever is left of the last stripe
+    const unsigned char* p = buffer;
+    size_t size = buffered;
+    for (; size >= 8; p += 8, size -= 8) {
+      hash ^= round(0, read64(p));
+      hash = rotl(hash, 27) * prime1 + prime4;
+    }
+    if (size >= 4) {
+      hash ^= (uint64_t)read32(p) * prime1;
+      hash = rotl(hash, 23) * prime2 + prime3;
+      p += 4;
+      size -= 4;
+    }
+    for (; size > 0; ++p, --size) {
+      hash ^= (*p) * prime5;
+      hash = rotl(hash, 11) * prime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+  }
+
+  uint64_t of(const void* data, size_t size, uint64_t seed) {
+    Hasher hasher(seed);
+    hasher.update(data, size);
+    return hasher.digest();
+  }
+
+  bool ofFile(const std::string& path, uint64_t& hash) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    Hasher hasher;
+    std::vector<char> buffer(1024 * 1024);
+    ssize_t numRead;
+    while ((numRead = read(fd, buffer.data(), buffer.size())) > 0) {
+      hasher.update(buffer.data(), numRead);
+    }
+    close(fd);
+    hash = hasher.digest();
+    return numRead == 0;
+  }
+
+  std::string hex(uint64_t hash) {
+    static const char digits[] = "0123456789abcdef";
+    std::string text(16, '0');
+    for (int i = 15; i >= 0; --i, hash >>= 4) {
+      text[i] = digits[hash & 0xf];
+    }
+    return text;
+  }
+
+  bool parseHex(const std::string& text, uint64_t& hash) {
+    if (text.size() != 16) {
+      return false;
+    }
+    hash = 0;
+    for (char c : text) {
+      int digit;
+      if (c >= '0' && c <= '9') {
+        digit = c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        digit = c - 'a' + 10;
+      } else {
+        return false;
+      }
+      hash = (hash << 4) | digit;
+    }
+    return true;
+  }
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+
+// Fast non-cryptographic 64 bit hashing (XXH64), used to recognise inputs
+// that were already shrunk. Fed incrementally so it can hash a stream as
+// it is read instead of making a separate pass over the file
+namespace Hash {
+  class Hasher {
+   public:
+    explicit Hasher(uint64_t seed = 0);
+
+    void update(const void* data, size_t size);
+    void update(std::span<const std::byte> data) { update(data.data(), data.size()); }
+
+    // Hash of everything passed to update so far, more can still be added
+    uint64_t digest() const;
+
+   private:
+    uint64_t seed;
+    uint64_t lanes[4];
+    unsigned char buffer[32];
+    size_t buffered = 0;
+    uint64_t totalSize = 0;
+  };
+
+  uint64_t of(const void* data, size_t size, uint64_t seed = 0);
+  // Hash of a whole file, the same value a Hasher fed it as it is read
+  // gets. False if it couldn't be read
+  bool ofFile(const std::string& path, uint64_t& hash);
+
+  // Fixed width lower case hex, usable as a file name
+  std::string hex(uint64_t hash);
+  // Returns false unless text is a full 16 digit hex hash
+  bool parseHex(const std::string& text, uint64_t& hash);
+};
@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <png.h>
+
+#include "inputlimits.h"
+
+namespace {
+  uint32_t bigEndian32(const unsigned char* bytes) {
+    return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+  }
+
+  std::chrono::nanoseconds threadCpuTime() {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return std::chrono::seconds(now.tv_sec) + std::chrono::nanoseconds(now.tv_nsec);
+  }
+
+  bool parseCount(const char* value, uint64_t& count) {
+    char* end = nullptr;
+    count = strtoull(value, &end, 10);
+    return *value != '\0' && *value != '-' && *end == '\0';
+  }
+};
+
+const char* reasonCode(LimitReason reason) {
+  switch (reason) {
+    case LimitReason::Pixels: return "pixels";
+    case LimitReason::RowBytes: return "row_bytes";
+    case LimitReason::InflateRatio: return "inflate_ratio";
+    case LimitReason::ChunkSize: return "chunk_size";
+    case LimitReason::CpuTime: return "cpu_time";
+  }
+  return "unknown";
+}
+
+InputLimits InputLimits::forServers() {
+  InputLimits limits;
+  limits.maxPixels = 16384ull * 16384;
+  limits.maxChunkBytes = 8 * 1024 * 1024;
+  return limits;
+}
+
+bool InputLimits::isOption(const std::string& arg) {
+  return arg == "--max-pixels" || arg == "--max-row-bytes" || arg == "--max-ratio" ||
+      arg == "--max-chunk" || arg == "--max-cpu";
+}
+
+bool InputLimits::parseOption(const std::string& arg, const char* value) {
+  uint64_t count = 0;
+  if (arg == "--max-ratio") {
+    char* end = nullptr;
+    double ratio = strtod(value, &end);
+    if (*value == '\0' || *end != '\0' || !(ratio >= 0)) {
+      return false;
+    }
+    maxInflateRatio = ratio;
+    return true;
+  } else if (!parseCount(value, count)) {
+    return false;
+  }
+  if (arg == "--max-pixels") {
+    maxPixels = count;
+  } else if (arg == "--max-row-bytes") {
+    maxRowBytes = count;
+  } else if (arg == "--max-chunk") {
+    maxChunkBytes = count * 1024;
+  } else if (arg == "--max-cpu") {
+    maxCpuTime = std::chrono::milliseconds(count);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* InputLimits::usage() {
+  return "  --max-pixels N      refuse images with more pixels than this\n"
+         "  --max-row-bytes N   refuse images with wider rows than this, in bytes\n"
+         "  --max-ratio R       stop when image data inflates more than R times\n"
+         "  --max-chunk KB      refuse bigger ancillary chunks (text, profiles)\n"
+         "  --max-cpu MS        stop a job after this much CPU time\n"
+         "                      0 turns a limit off\n";
+}
+
+void InputGuard::feed(std::span<const std::byte> data) {
+  const unsigned char* bytes = (const unsigned char*)data.data();
+  size_t size = data.size();
+  while (size > 0) {
+    if (signatureLeft > 0) {
+      size_t skip = std::min<uint64_t>(signatureLeft, size);
+      signatureLeft -= skip;
+      bytes += skip;
+      size -= skip;
+    } else if (chunkLeft == 0) {
+      // Only the length and type, the rest is libpng's to check
+      size_t take = std::min(sizeof(chunkHeader) - headerFill, size);
+      memcpy(chunkHeader + headerFill, bytes, take);
+      headerFill += take;
+      bytes += take;
+      size -= take;
+      if (headerFill == sizeof(chunkHeader)) {
+        headerFill = 0;
+        onChunkHeader();
+      }
+    } else {
+      size_t take = std::min<uint64_t>(chunkLeft, size);
+      if (inImageData) {
+        compressedBytes += take;
+      } else if (inHeaderChunk && ihdrFill < sizeof(ihdr)) {
+        size_t copy = std::min(sizeof(ihdr) - ihdrFill, take);
+        memcpy(ihdr + ihdrFill, bytes, copy);
+        ihdrFill += copy;
+        if (ihdrFill == sizeof(ihdr)) {
+          onHeader();
+        }
+      }
+      chunkLeft -= take;
+      bytes += take;
+      size -= take;
+    }
+  }
+}
+
+void InputGuard::onChunkHeader() {
+  uint32_t length = bigEndian32(chunkHeader);
+  const unsigned char* type = chunkHeader + 4;
+  // Lower case first letter marks an ancillary chunk
+  bool ancillary = type[0] & 0x20;
+  if (ancillary && limits.maxChunkBytes && length > limits.maxChunkBytes) {
+    throw LimitExceeded(LimitReason::ChunkSize, std::string((const char*)type, 4) + " chunk of " +
+        std::to_string(length) + " bytes, at most " + std::to_string(limits.maxChunkBytes));
+  }
+  inImageData = memcmp(type, "IDAT", 4) == 0;
+  inHeaderChunk = memcmp(type, "IHDR", 4) == 0;
+  // Data and CRC
+  chunkLeft = (uint64_t)length + 4;
+}
+
+void InputGuard::onHeader() {
+  width = bigEndian32(ihdr);
+  uint32_t height = bigEndian32(ihdr + 4);
+  unsigned bitDepth = ihdr[8];
+  unsigned channels = 0;
+  switch (ihdr[9]) {
+    case PNG_COLOR_TYPE_GRAY: channels = 1; break;
+    case PNG_COLOR_TYPE_RGB: channels = 3; break;
+    case PNG_COLOR_TYPE_PALETTE: channels = 1; break;
+    case PNG_COLOR_TYPE_GRAY_ALPHA: channels = 2; break;
+    case PNG_COLOR_TYPE_RGB_ALPHA: channels = 4; break;
+  }
+  bitsPerPixel = bitDepth * channels;
+  interlaced = ihdr[12] != PNG_INTERLACE_NONE;
+
+  uint64_t pixels = (uint64_t)width * height;
+  if (limits.maxPixels && pixels > limits.maxPixels) {
+    throw LimitExceeded(LimitReason::Pixels, std::to_string(width) + "x" + std::to_string(height) +
+        " is " + std::to_string(pixels) + " pixels, at most " + std::to_string(limits.maxPixels));
+  }
+  uint64_t rowBytes = ((uint64_t)width * bitsPerPixel + 7) / 8;
+  if (limits.maxRowBytes && rowBytes > limits.maxRowBytes) {
+    throw LimitExceeded(LimitReason::RowBytes, "rows of " + std::to_string(rowBytes) +
+        " bytes, at most " + std::to_string(limits.maxRowBytes));
+  }
+}
+
+void InputGuard::rowDecoded(int pass) {
+  // Rows come one per row of each Adam7 pass, with its filter type byte
+  uint64_t columns = interlaced ? PNG_PASS_COLS(width, pass) : width;
+  inflatedBytes += (columns * bitsPerPixel + 7) / 8 + 1;
+  if (limits.maxInflateRatio > 0 && inflatedBytes > InputLimits::minInflatedBytes &&
+      inflatedBytes > limits.maxInflateRatio * compressedBytes) {
+    char ratio[32];
+    snprintf(ratio, sizeof(ratio), "%.0f", compressedBytes ? (double)inflatedBytes / compressedBytes : 0.0);
+    throw LimitExceeded(LimitReason::InflateRatio, std::to_string(compressedBytes) +
+        " bytes inflated to " + std::to_string(inflatedBytes) + " (" + ratio + "x)");
+  }
+  // Reading the clock is a syscall, rows are too many to pay that for each
+  if (limits.maxCpuTime.count() && ++rowsSinceCpuCheck == 64) {
+    rowsSinceCpuCheck = 0;
+    checkCpu();
+  }
+}
+
+void InputGuard::startWork() {
+  if (limits.maxCpuTime.count()) {
+    cpuStart = threadCpuTime();
+    working = true;
+  }
+}
+
+void InputGuard::stopWork() {
+  if (working) {
+    cpuUsed += threadCpuTime() - cpuStart;
+    working = false;
+    checkCpu();
+  }
+}
+
+void InputGuard::checkCpu() {
+  std::chrono::nanoseconds used = cpuUsed;
+  if (working) {
+    used += threadCpuTime() - cpuStart;
+  }
+  if (used > limits.maxCpuTime) {
+    throw LimitExceeded(LimitReason::CpuTime,
+        std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(used).count()) +
+        "ms, at most " + std::to_string(limits.maxCpuTime.count()) + "ms");
+  }
+}
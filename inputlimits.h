@@ -0,0 +1,116 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+// Guards against inputs that cost far more than their size suggests: a tiny
+// png that declares a 100000x100000 image, deflate streams that inflate a
+// thousandfold, huge ancillary chunks, or plain slow decodes. Limits are
+// checked as the bytes stream in, so a hostile upload is refused at its
+// header or a few rows in, not after it has used up the machine
+enum class LimitReason {
+  Pixels,
+  RowBytes,
+  InflateRatio,
+  ChunkSize,
+  CpuTime,
+};
+
+// Stable, machine readable name, i.e. "inflate_ratio"
+const char* reasonCode(LimitReason reason);
+
+// Thrown inside a job whose input goes over one of its limits
+struct LimitExceeded : std::runtime_error {
+  LimitExceeded(LimitReason _reason, const std::string& detail)
+      : std::runtime_error(std::string("Over the ") + reasonCode(_reason) + " limit: " + detail),
+        reason(_reason) {}
+
+  LimitReason reason;
+};
+
+// 0 for no limit, which is what every field defaults to
+struct InputLimits {
+  // Width * height from IHDR
+  uint64_t maxPixels = 0;
+  // Bytes in one unfiltered row
+  uint64_t maxRowBytes = 0;
+  // Image data inflated so far over IDAT bytes read so far, checked once
+  // more than minInflatedBytes came out so small images never trip it
+  double maxInflateRatio = 0;
+  // Declared length of any ancillary chunk (tEXt, zTXt, iCCP, ...), also
+  // caps what libpng may inflate one of those to
+  uint64_t maxChunkBytes = 0;
+  // CPU time spent decoding and encoding, whichever threads it ran on
+  std::chrono::milliseconds maxCpuTime{0};
+
+  static constexpr uint64_t minInflatedBytes = 1024 * 1024;
+
+  bool any() const {
+    return maxPixels || maxRowBytes || maxInflateRatio > 0 || maxChunkBytes || maxCpuTime.count();
+  }
+
+  // What the server modes start from: room for a 16384x16384 image and
+  // about libpng's own default cap on chunks, the rest off
+  static InputLimits forServers();
+
+  // Command line options for these: `--max-pixels N`, `--max-row-bytes N`,
+  // `--max-ratio R`, `--max-chunk KB` and `--max-cpu MS`
+  static bool isOption(const std::string& arg);
+  // Returns false when value doesn't parse
+  bool parseOption(const std::string& arg, const char* value);
+  // Usage lines for the options above
+  static const char* usage();
+};
+
+// Checks one decode against its limits. The png chunk stream is followed
+// byte by byte as it is read, ahead of libpng
+class InputGuard {
+ public:
+  explicit InputGuard(const InputLimits& _limits) : limits(_limits) {}
+
+  // Before the bytes go to libpng
+  void feed(std::span<const std::byte> data);
+  // After each row libpng hands back, with its Adam7 pass (0 when not
+  // interlaced)
+  void rowDecoded(int pass);
+
+  // Around the calls that do the work, i.e. png_process_data. Time between
+  // them (waiting for input, queued in an executor) isn't counted
+  void startWork();
+  void stopWork();
+
+ private:
+  void onChunkHeader();
+  void onHeader();
+  void checkCpu();
+
+  InputLimits limits;
+
+  // Chunk stream position
+  uint64_t signatureLeft = 8;
+  unsigned char chunkHeader[8];
+  size_t headerFill = 0;
+  uint64_t chunkLeft = 0;
+  bool inImageData = false;
+  bool inHeaderChunk = false;
+  unsigned char ihdr[13];
+  size_t ihdrFill = 0;
+
+  // From IHDR
+  uint32_t width = 0;
+  unsigned bitsPerPixel = 0;
+  bool interlaced = false;
+
+  uint64_t compressedBytes = 0;
+  uint64_t inflatedBytes = 0;
+  unsigned rowsSinceCpuCheck = 0;
+
+  // Thread CPU time when the current stretch of work started
+  std::chrono::nanoseconds cpuStart{0};
+  bool working = false;
+  std::chrono::nanoseconds cpuUsed{0};
+};
@@ -0,0 +1,252 @@
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "json.h"
+
+namespace Json {
+  const Value* Value::find(std::string_view key) const {
+    if (type != Type::Object) {
+      return nullptr;
+    }
+    for (const auto& [name, value] : object) {
+      if (name == key) {
+        return &value;
+      }
+    }
+    return nullptr;
+  }
+
+  namespace {
+    // Recursive descent over a string_view, pos always points at the next
+    // unconsumed character
+    struct Parser {
+      std::string_view text;
+      size_t pos = 0;
+
+      [[noreturn]] void fail(const char* what) {
+        throw std::runtime_error("JSON parse error at offset " +
+            std::to_string(pos) + ": " + what);
+      }
+
+      void skipSpace() {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' ||
+              text[pos] == '\n' || text[pos] == '\r')) {
+          ++pos;
+        }
+      }
+
+      bool atEnd() {
+        skipSpace();
+        return pos == text.size();
+      }
+
+      void expect(char c) {
+        skipSpace();
+        if (pos >= text.size() || text[pos] != c) {
+          fail("unexpected character");
+        }
+        ++pos;
+      }
+
+      bool consumeWord(std::string_view word) {
+        if (text.substr(pos, word.size()) == word) {
+          pos += word.size();
+          return true;
+        }
+        return false;
+      }
+
+      static void appendUtf8(std::string& out, unsigned codePoint) {
+        if (codePoint < 0x80) {
+          out += (char)codePoint;
+        } else if (codePoint < 0x800) {
+          out += (char)(0xC0 | (codePoint >> 6));
+          out += (char)(0x80 | (codePoint & 0x3F));
+        } else if (codePoint < 0x10000) {
+          out += (char)(0xE0 | (codePoint >> 12));
+          out += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+          out += (char)(0x80 | (codePoint & 0x3F));
+        } else {
+          out += (char)(0xF0 | (codePoint >> 18));
+          out += (char)(0x80 | ((codePoint >> 12) & 0x3F));
+          out += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+          out += (char)(0x80 | (codePoint & 0x3F));
+        }
+      }
+
+      unsigned parseHex4() {
+        if (pos + 4 > text.size()) {
+          fail("truncated unicode escape");
+        }
+        unsigned value = 0;
+        for (int i = 0; i < 4; ++i) {
+          char c = text[pos++];
+          value <<= 4;
+          if (c >= '0' && c <= '9') value |= c - '0';
+          else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+          else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+          else fail("bad unicode escape");
+        }
+        return value;
+      }
+
+      std::string parseString() {
+        expect('"');
+        std::string out;
+        while (true) {
+          if (pos >= text.size()) {
+            fail("unterminated string");
+          }
+          char c = text[pos++];
+          if (c == '"') {
+            return out;
+          } else if (c != '\\') {
+            out += c;
+            continue;
+          }
+          if (pos >= text.size()) {
+            fail("unterminated escape");
+          }
+          switch (text[pos++]) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+              unsigned codePoint = parseHex4();
+              // Surrogate pair, the low half must follow directly
+              if (codePoint >= 0xD800 && codePoint < 0xDC00 &&
+                  consumeWord("\\u")) {
+                unsigned low = parseHex4();
+                codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+              }
+              appendUtf8(out, codePoint);
+              break;
+            }
+            default: fail("bad escape");
+          }
+        }
+      }
+
+      Value parseValue() {
+        skipSpace();
+        if (pos >= text.size()) {
+          fail("unexpected end of input");
+        }
+        Value value;
+        char c = text[pos];
+        if (c == '{') {
+          value.type = Value::Type::Object;
+          ++pos;
+          skipSpace();
+          if (pos < text.size() && text[pos] == '}') {
+            ++pos;
+            return value;
+          }
+          while (true) {
+            std::string key = parseString();
+            expect(':');
+            value.object.emplace_back(std::move(key), parseValue());
+            skipSpace();
+            if (pos < text.size() && text[pos] == ',') {
+              ++pos;
+              continue;
+            }
+            expect('}');
+            return value;
+          }
+        } else if (c == '[') {
+          value.type = Value::Type::Array;
+          ++pos;
+          skipSpace();
+          if (pos < text.size() && text[pos] == ']') {
+            ++pos;
+            return value;
+          }
+          while (true) {
+            value.array.push_back(parseValue());
+            skipSpace();
+            if (pos < text.size() && text[pos] == ',') {
+              ++pos;
+              continue;
+            }
+            expect(']');
+            return value;
+          }
+        } else if (c == '"') {
+          value.type = Value::Type::String;
+          value.string = parseString();
+        } else if (consumeWord("true")) {
+          value.type = Value::Type::Bool;
+          value.boolean = true;
+        } else if (consumeWord("false")) {
+          value.type = Value::Type::Bool;
+        } else if (consumeWord("null")) {
+          value.type = Value::Type::Null;
+        } else {
+          // strtod needs a terminated string, numbers are short so copy
+          size_t end = pos;
+          while (end < text.size() && std::string_view("+-.eE0123456789").find(text[end]) !=
+              std::string_view::npos) {
+            ++end;
+          }
+          std::string number(text.substr(pos, end - pos));
+          char* parsedEnd = nullptr;
+          value.type = Value::Type::Number;
+          value.number = strtod(number.c_str(), &parsedEnd);
+          if (number.empty() || parsedEnd != number.c_str() + number.size()) {
+            fail("bad value");
+          }
+          pos = end;
+        }
+        return value;
+      }
+    };
+  };
+
+  Value parse(std::string_view text) {
+    Parser parser{text};
+    Value value = parser.parseValue();
+    if (!parser.atEnd()) {
+      parser.fail("trailing characters");
+    }
+    return value;
+  }
+
+  std::vector<Value> parseAll(std::string_view text) {
+    Parser parser{text};
+    std::vector<Value> values;
+    while (!parser.atEnd()) {
+      values.push_back(parser.parseValue());
+    }
+    return values;
+  }
+
+  std::string quote(std::string_view text) {
+    std::string out = "\"";
+    for (char c : text) {
+      switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+          if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+            out += escaped;
+          } else {
+            out += c;
+          }
+      }
+    }
+    out += '"';
+    return out;
+  }
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Just enough JSON for job manifests and result files, not a general library
+namespace Json {
+  struct Value {
+    enum class Type { Null, Bool, Number, String, Array, Object };
+
+    Type type = Type::Null;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<Value> array;
+    // Kept in document order, objects here are small
+    std::vector<std::pair<std::string, Value>> object;
+
+    // Returns nullptr if this isn't an object or the key is missing
+    const Value* find(std::string_view key) const;
+  };
+
+  // Parses a single document, throws std::runtime_error on malformed input
+  Value parse(std::string_view text);
+
+  // Parses either one document or several whitespace separated ones
+  // (JSON lines), returning each top level value
+  std::vector<Value> parseAll(std::string_view text);
+
+  // Returns the string quoted and escaped for output
+  std::string quote(std::string_view text);
+};
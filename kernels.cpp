@@ -0,0 +1,90 @@
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "kernels.h"
+
+namespace Kernels {
+  namespace {
+    // With the pixel size known at compile time the copy becomes a couple
+    // of plain loads and stores instead of a memcpy call per pixel
+    template <size_t pixelBytes>
+    void sampleRow(png_const_bytep in, png_bytep out, size_t outWidth, unsigned sampleRate) {
+      const size_t stride = sampleRate * pixelBytes;
+      for (size_t x = 0; x < outWidth; ++x) {
+        memcpy(out, in, pixelBytes);
+        out += pixelBytes;
+        in += stride;
+      }
+    }
+
+    template <size_t channels>
+    void boxRow8(png_const_bytep top, png_const_bytep bottom, png_bytep out,
+        size_t outWidth, size_t columnStep) {
+      const size_t right = columnStep * channels;
+      for (size_t x = 0; x < outWidth; ++x) {
+        for (size_t c = 0; c < channels; ++c) {
+          unsigned sum = top[c] + top[c + right] + bottom[c] + bottom[c + right];
+          out[c] = (png_byte)((sum + 2) >> 2);
+        }
+        top += 2 * channels;
+        bottom += 2 * channels;
+        out += channels;
+      }
+    }
+
+    // 16 bit samples are big endian in png rows
+    template <size_t channels>
+    void boxRow16(png_const_bytep top, png_const_bytep bottom, png_bytep out,
+        size_t outWidth, size_t columnStep) {
+      auto sample = [](png_const_bytep p) { return (unsigned)(p[0] << 8 | p[1]); };
+      const size_t right = columnStep * channels * 2;
+      for (size_t x = 0; x < outWidth; ++x) {
+        for (size_t c = 0; c < 2 * channels; c += 2) {
+          unsigned sum = sample(top + c) + sample(top + c + right) +
+              sample(bottom + c) + sample(bottom + c + right);
+          unsigned average = (sum + 2) >> 2;
+          out[c] = (png_byte)(average >> 8);
+          out[c + 1] = (png_byte)average;
+        }
+        top += 4 * channels;
+        bottom += 4 * channels;
+        out += 2 * channels;
+      }
+    }
+
+    void boxRowPalette(png_const_bytep top, png_const_bytep bottom, png_bytep out,
+        size_t outWidth, size_t columnStep) {
+      for (size_t x = 0; x < outWidth; ++x) {
+        out[x] = top[2 * x];
+      }
+    }
+  };
+
+  RowKernel sampleKernel(size_t pixelBytes) {
+    switch (pixelBytes) {
+      case 1: return sampleRow<1>; // gray, palette
+      case 2: return sampleRow<2>; // gray + alpha, 16 bit gray
+      case 3: return sampleRow<3>; // rgb
+      case 4: return sampleRow<4>; // rgba, 16 bit gray + alpha
+      case 6: return sampleRow<6>; // 16 bit rgb
+      case 8: return sampleRow<8>; // 16 bit rgba
+    }
+    throw std::runtime_error("No row kernel for " + std::to_string(pixelBytes) + " byte pixels");
+  }
+
+  BoxKernel boxKernel(size_t channels, int bitDepth, bool palette) {
+    if (palette) {
+      return boxRowPalette;
+    }
+    switch (channels * (bitDepth == 16 ? 2 : 1)) {
+      case 1: return boxRow8<1>;
+      case 2: return bitDepth == 16 ? boxRow16<1> : boxRow8<2>;
+      case 3: return boxRow8<3>;
+      case 4: return bitDepth == 16 ? boxRow16<2> : boxRow8<4>;
+      case 6: return boxRow16<3>;
+      case 8: return boxRow16<4>;
+    }
+    throw std::runtime_error("No box kernel for " + std::to_string(channels) + " channels");
+  }
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+
+#include "png.h"
+
+// Row kernels: turn one decoded input row into one shrunk output row.
+// Rows are handed over with one or more whole bytes per pixel (sub byte
+// depths are unpacked by libpng first)
+namespace Kernels {
+  using RowKernel = void (*)(png_const_bytep in, png_bytep out, size_t outWidth,
+      unsigned sampleRate);
+
+  // Keeps every sampleRate'th pixel. Note this doesn't use any fancy
+  // algorithms like nearest neighbors, averaging, etc. as its not needed atm
+  RowKernel sampleKernel(size_t pixelBytes);
+
+  // 2x box filter: averages each 2x2 block of the top and bottom input rows
+  // into one output pixel. columnStep is 1, or 0 when the input is a single
+  // pixel wide and there is no right hand neighbour to average with
+  using BoxKernel = void (*)(png_const_bytep top, png_const_bytep bottom, png_bytep out,
+      size_t outWidth, size_t columnStep);
+
+  // Palette indexes can't be averaged, those just keep the top left pixel
+  BoxKernel boxKernel(size_t channels, int bitDepth, bool palette);
+};
@@ -0,0 +1,324 @@
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "copng.h"
+#include "executor.h"
+#include "localserver.h"
+
+namespace LocalServer {
+  namespace {
+    // Without these the client could change or truncate the input under
+    // the mapping, and a truncation would be a SIGBUS here
+    constexpr int requiredSeals = F_SEAL_SHRINK | F_SEAL_WRITE;
+    constexpr int outputSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+    // A request carries one fd, room for a few so extras can be closed
+    constexpr size_t maxFds = 4;
+
+    // One client connection, shared by its reader thread and the jobs it
+    // submitted, so it lasts until whichever of them finishes last
+    class Connection {
+     public:
+      explicit Connection(int _fd) : fd(_fd) {
+        // Clients are told apart by user, so one user's flood of jobs
+        // only slows that user down (see Executor)
+        ucred peer{};
+        socklen_t length = sizeof(peer);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0) {
+          tenant = "uid:" + std::to_string(peer.uid);
+        }
+      }
+      ~Connection() { close(fd); }
+
+      // Called from executor workers, one message at a time. A failed send
+      // means the client is gone, nothing is left to tell it
+      void reply(uint64_t id, Status status, const std::string& error, int outFd = -1) {
+        Reply reply{.status = status, .id = id};
+        iovec parts[2] = {
+          {&reply, sizeof(reply)},
+          {(void*)error.data(), error.size()},
+        };
+        msghdr message{};
+        message.msg_iov = parts;
+        message.msg_iovlen = error.empty() ? 1 : 2;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        if (outFd >= 0) {
+          message.msg_control = control;
+          message.msg_controllen = sizeof(control);
+          cmsghdr* header = CMSG_FIRSTHDR(&message);
+          header->cmsg_level = SOL_SOCKET;
+          header->cmsg_type = SCM_RIGHTS;
+          header->cmsg_len = CMSG_LEN(sizeof(int));
+          memcpy(CMSG_DATA(header), &outFd, sizeof(int));
+        }
+        std::lock_guard lock(sendMutex);
+        sendmsg(fd, &message, MSG_NOSIGNAL);
+      }
+
+      const int fd;
+      std::string tenant;
+
+     private:
+      std::mutex sendMutex;
+    };
+
+    // The mapped input and the memfd the output goes to, kept until the
+    // job is done with them
+    struct Job {
+      ~Job() {
+        if (input != MAP_FAILED) {
+          munmap(input, size);
+        }
+        if (outFd >= 0) {
+          close(outFd);
+        }
+      }
+
+      uint64_t id = 0;
+      unsigned sampleRate = 2;
+      void* input = MAP_FAILED;
+      size_t size = 0;
+      int outFd = -1;
+      // Filled in once the header is read
+      std::shared_ptr<std::atomic<uint64_t>> pixels = std::make_shared<std::atomic<uint64_t>>(0);
+    };
+
+    // Maps a request's input memfd, takes ownership of inFd
+    std::shared_ptr<Job> openJob(const Request& request, int inFd) {
+      auto job = std::make_shared<Job>();
+      job->id = request.id;
+      job->sampleRate = request.sampleRate;
+      struct stat status;
+      int seals = fcntl(inFd, F_GET_SEALS);
+      bool ok = seals >= 0 && (seals & requiredSeals) == requiredSeals && fstat(inFd, &status) == 0;
+      if (ok && status.st_size > 0) {
+        job->size = status.st_size;
+        job->input = mmap(nullptr, job->size, PROT_READ, MAP_PRIVATE, inFd, 0);
+      }
+      close(inFd);
+      if (!ok) {
+        throw std::runtime_error("Input must be a memfd sealed against writes and shrinking");
+      } else if (job->input == MAP_FAILED) {
+        throw std::runtime_error("Can't map the input");
+      }
+      madvise(job->input, job->size, MADV_SEQUENTIAL);
+
+      job->outFd = memfd_create("pngshrink-out", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+      if (job->outFd < 0) {
+        throw std::runtime_error(std::string("Can't create output memfd: ") + strerror(errno));
+      }
+      return job;
+    }
+
+    void writeAll(int fd, std::span<const png_byte> data) {
+      while (!data.empty()) {
+        ssize_t numWritten = write(fd, data.data(), data.size());
+        if (numWritten < 0 && errno == EINTR) {
+          continue;
+        } else if (numWritten <= 0) {
+          throw std::runtime_error(std::string("Can't write output memfd: ") + strerror(errno));
+        }
+        data = data.subspan(numWritten);
+      }
+    }
+
+    // Reads requests until the client hangs up, each one becomes a job
+    void serveClient(std::shared_ptr<Connection> connection, Executor& executor,
+        const InputLimits& limits) {
+      while (true) {
+        Request request;
+        iovec part{&request, sizeof(request)};
+        msghdr message{};
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * maxFds)];
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t numRead = recvmsg(connection->fd, &message, MSG_CMSG_CLOEXEC);
+        if (numRead < 0 && errno == EINTR) {
+          continue;
+        } else if (numRead <= 0) {
+          return;
+        }
+
+        // Whatever fds came along are ours to close
+        int inFd = -1;
+        size_t numFds = 0;
+        for (cmsghdr* header = CMSG_FIRSTHDR(&message); header;
+            header = CMSG_NXTHDR(&message, header)) {
+          if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+            continue;
+          }
+          size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+          for (size_t i = 0; i < count; ++i, ++numFds) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            if (numFds == 0) {
+              inFd = fd;
+            } else {
+              close(fd);
+            }
+          }
+        }
+
+        std::shared_ptr<Job> job;
+        try {
+          if ((size_t)numRead != sizeof(request) || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            throw std::runtime_error("Malformed request");
+          } else if (request.version != protocolVersion) {
+            throw std::runtime_error("Unsupported protocol version");
+          } else if (request.sampleRate == 0) {
+            throw std::runtime_error("Sample rate must be greater than 0");
+          } else if (numFds != 1) {
+            throw std::runtime_error("A request needs exactly one memfd");
+          }
+          int fd = inFd;
+          inFd = -1;
+          job = openJob(request, fd);
+        } catch (const std::exception& e) {
+          if (inFd >= 0) {
+            close(inFd);
+          }
+          connection->reply(request.id, BadRequest, e.what());
+          continue;
+        }
+
+        executor.submit({
+          .start = [job, &limits] {
+            auto sink = std::make_shared<OutputSink>([job](std::span<const png_byte> data) {
+              writeAll(job->outFd, data);
+            });
+            OutputSpec output{.sampleRate = job->sampleRate, .sink = std::move(sink)};
+            std::span<const std::byte> input((const std::byte*)job->input, job->size);
+            ShrinkSpec spec{{output}};
+            spec.imagePixels = job->pixels.get();
+            spec.limits = limits;
+            return coPng(MappedReader(input), std::move(spec));
+          },
+          .done = [connection, job](std::exception_ptr exception) {
+            std::string error;
+            Status status = Failed;
+            if (exception) {
+              try {
+                std::rethrow_exception(exception);
+              } catch (const LimitExceeded& e) {
+                error = e.what();
+                status = OverLimit;
+              } catch (const std::exception& e) {
+                error = e.what();
+              }
+            } else if (fcntl(job->outFd, F_ADD_SEALS, outputSeals) != 0 ||
+                lseek(job->outFd, 0, SEEK_SET) != 0) {
+              error = std::string("Can't seal the output: ") + strerror(errno);
+            }
+            if (error.empty()) {
+              connection->reply(job->id, Ok, "", job->outFd);
+            } else {
+              connection->reply(job->id, status, error);
+            }
+          },
+          .tenant = connection->tenant,
+          .cost = job->pixels,
+        });
+      }
+    }
+
+    void usage() {
+      std::cout << "Usage: local --socket PATH [--jobs N] [--weight UID=W]... [--max-... N]" << std::endl
+                << "  Shrinks sealed memfds passed over a unix socket, see localserver.h" << std::endl
+                << "  --socket PATH  SOCK_SEQPACKET socket to listen on, replaced if it exists" << std::endl
+                << "  --jobs N       worker threads (default: one per core)" << std::endl
+                << "  --weight UID=W share of worker time for clients running as UID," << std::endl
+                << "                 relative to others (default 1)" << std::endl
+                << InputLimits::usage()
+                << "                      (defaults: 268435456 pixels, 8192 KB chunks)" << std::endl;
+    }
+  };
+
+  int localMain(int argc, char* argv[]) {
+    std::string socketPath;
+    unsigned numThreads = std::thread::hardware_concurrency();
+    std::vector<std::pair<std::string, double>> weights;
+    InputLimits limits = InputLimits::forServers();
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      bool hasValue = i + 1 < argc;
+      if (arg == "--socket" && hasValue) {
+        socketPath = argv[++i];
+      } else if (arg == "--jobs" && hasValue) {
+        numThreads = (unsigned)std::max(1, atoi(argv[++i]));
+      } else if (arg == "--weight" && hasValue) {
+        std::string value = argv[++i];
+        size_t equals = value.find('=');
+        double weight = equals == std::string::npos ? 0 : atof(value.c_str() + equals + 1);
+        if (equals == 0 || weight <= 0) {
+          std::cout << "Expected --weight UID=W with W greater than 0" << std::endl;
+          return -1;
+        }
+        weights.emplace_back("uid:" + value.substr(0, equals), weight);
+      } else if (InputLimits::isOption(arg) && hasValue) {
+        if (!limits.parseOption(arg, argv[++i])) {
+          std::cout << arg << " needs a number, 0 for no limit" << std::endl;
+          return -1;
+        }
+      } else {
+        usage();
+        return -1;
+      }
+    }
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+      usage();
+      return -1;
+    }
+    memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+    verboseOutput = false;
+    signal(SIGPIPE, SIG_IGN);
+
+    int listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    struct stat existing;
+    if (lstat(socketPath.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+      unlink(socketPath.c_str());
+    }
+    if (listenFd < 0 || bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listenFd, SOMAXCONN) != 0) {
+      std::cerr << "Can't listen on " << socketPath << ": " << strerror(errno) << std::endl;
+      return -1;
+    }
+
+    Executor executor(numThreads);
+    for (const auto& [tenant, weight] : weights) {
+      executor.setWeight(tenant, weight);
+    }
+    std::cout << "Listening on " << socketPath << std::endl;
+    while (true) {
+      int clientFd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (clientFd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        std::cerr << "accept failed: " << strerror(errno) << std::endl;
+        return -1;
+      }
+      auto connection = std::make_shared<Connection>(clientFd);
+      std::thread([connection, &executor, &limits] {
+        serveClient(connection, executor, limits);
+      }).detach();
+    }
+  }
+};
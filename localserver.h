@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+
+// Local mode: shrinks pngs for processes on the same machine without the
+// filesystem or socket copies in between. A client connects to a
+// SOCK_SEQPACKET unix socket and sends, per image, one Request message with
+// a memfd of the png attached (SCM_RIGHTS). The memfd has to be sealed with
+// at least F_SEAL_SHRINK and F_SEAL_WRITE, the server maps it and decodes
+// straight from the mapping. Each Request is answered with one Reply
+// message carrying the same id, with a sealed memfd of the shrunk png
+// attached when status is Ok, or the error text after the Reply otherwise.
+// Replies can come back in a different order than the requests went out
+namespace LocalServer {
+  constexpr uint32_t protocolVersion = 1;
+
+  struct Request {
+    uint32_t version = protocolVersion;
+    uint32_t sampleRate = 2;
+    // Chosen by the client, echoed in the reply
+    uint64_t id = 0;
+  };
+
+  enum Status : uint32_t {
+    Ok = 0,
+    // The request itself was unusable, i.e. no fd or an unsealed one
+    BadRequest = 1,
+    // The png couldn't be shrunk
+    Failed = 2,
+    // The png went over an input limit, the error text starts with
+    // "Over the <reason> limit" (see inputlimits.h)
+    OverLimit = 3,
+  };
+
+  struct Reply {
+    uint32_t version = protocolVersion;
+    uint32_t status = Ok;
+    uint64_t id = 0;
+  };
+
+  // Entry point for `pngshrink local ...`, argv[0] is "local"
+  int localMain(int argc, char* argv[]);
+};
@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+#include <png.h>
+#include <zlib.h>
+
+#include "hash.h"
+#include "memorycache.h"
+
+MemoryCache::MemoryCache(size_t maxBytes, unsigned numShards)
+    : shardBytes(maxBytes / std::max(1u, numShards)), shards(std::max(1u, numShards)) {
+  std::random_device random;
+  hashSeed = (uint64_t)random() << 32 | random();
+}
+
+uint64_t MemoryCache::inputHash(const void* data, size_t size) const {
+  return Hash::of(data, size, hashSeed);
+}
+
+MemoryCache::Lookup MemoryCache::lookup(const Key& key, Waiter waiter) {
+  Shard& shard = shardFor(key);
+  std::lock_guard lock(shard.mutex);
+  auto entry = shard.entries.find(key);
+  if (entry != shard.entries.end()) {
+    shard.lru.splice(shard.lru.begin(), shard.lru, entry->second);
+    ++hits;
+    return {.png = entry->second->second};
+  }
+  auto flight = shard.flights.find(key);
+  if (flight != shard.flights.end()) {
+    flight->second.push_back(std::move(waiter));
+    ++coalesced;
+    return {};
+  }
+  shard.flights[key];
+  ++misses;
+  return {.lead = std::make_shared<Flight>()};
+}
+
+void MemoryCache::finish(const Key& key, std::shared_ptr<Flight> flight) {
+  Shard& shard = shardFor(key);
+  std::vector<Waiter> waiters;
+  {
+    std::lock_guard lock(shard.mutex);
+    auto found = shard.flights.find(key);
+    if (found != shard.flights.end()) {
+      waiters = std::move(found->second);
+      shard.flights.erase(found);
+    }
+    if (flight->png) {
+      store(shard, key, flight->png);
+    }
+  }
+  for (Waiter& waiter : waiters) {
+    waiter(flight);
+  }
+}
+
+void MemoryCache::store(Shard& shard, const Key& key, Png png) {
+  if (png->size() > shardBytes || shard.entries.contains(key)) {
+    return;
+  }
+  shard.lru.emplace_front(key, png);
+  shard.entries[key] = shard.lru.begin();
+  shard.bytes += png->size();
+  totalBytes += png->size();
+  while (shard.bytes > shardBytes) {
+    auto& [oldKey, oldPng] = shard.lru.back();
+    shard.bytes -= oldPng->size();
+    totalBytes -= oldPng->size();
+    shard.entries.erase(oldKey);
+    shard.lru.pop_back();
+    ++evictions;
+  }
+}
+
+namespace {
+  constexpr char fileMagic[8] = {'p', 'n', 'g', 'm', 'e', 'm', 'c', '2'};
+
+  // Bump whenever the same input and sample rate would be answered with
+  // different bytes, so a handoff to such a build drops the saved entries
+  constexpr uint32_t formatVersion = 1;
+
+  struct FileHeader {
+    uint32_t formatVersion;
+    uint32_t reserved;
+    uint64_t hashSeed;
+    // The encoder's output can change between libpng (and zlib) versions
+    char encoder[48];
+  };
+
+  struct EntryHeader {
+    uint64_t inputHash;
+    uint64_t inputBytes;
+    uint32_t sampleRate;
+    uint32_t reserved;
+    uint64_t size;
+  };
+
+  FileHeader fileHeader(uint64_t hashSeed) {
+    FileHeader header{formatVersion, 0, hashSeed, {}};
+    snprintf(header.encoder, sizeof(header.encoder), "libpng %s zlib %s",
+        PNG_LIBPNG_VER_STRING, ZLIB_VERSION);
+    return header;
+  }
+};
+
+size_t MemoryCache::save(const std::string& path) {
+  std::string tempPath = path + ".tmp";
+  FILE* file = fopen(tempPath.c_str(), "wb");
+  if (!file) {
+    throw std::runtime_error("Can't write " + tempPath + ": " + strerror(errno));
+  }
+  FileHeader fileInfo = fileHeader(hashSeed);
+  bool ok = fwrite(fileMagic, sizeof(fileMagic), 1, file) == 1 &&
+      fwrite(&fileInfo, sizeof(fileInfo), 1, file) == 1;
+  size_t count = 0;
+  for (Shard& shard : shards) {
+    // Copies of the pointers, so the lock isn't held while writing
+    std::vector<std::pair<Key, Png>> entries;
+    {
+      std::lock_guard lock(shard.mutex);
+      entries.assign(shard.lru.rbegin(), shard.lru.rend());
+    }
+    for (const auto& [key, png] : entries) {
+      EntryHeader header{key.inputHash, key.inputBytes, key.sampleRate, 0, png->size()};
+      ok = ok && fwrite(&header, sizeof(header), 1, file) == 1 &&
+          fwrite(png->data(), 1, png->size(), file) == png->size();
+      ++count;
+    }
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(tempPath.c_str(), path.c_str()) != 0) {
+    remove(tempPath.c_str());
+    throw std::runtime_error("Can't write " + path + ": " + strerror(errno));
+  }
+  return count;
+}
+
+size_t MemoryCache::load(const std::string& path) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    throw std::runtime_error("Can't read " + path + ": " + strerror(errno));
+  }
+  std::unique_ptr<FILE, int (*)(FILE*)> closer(file, fclose);
+  char magic[sizeof(fileMagic)];
+  if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, fileMagic, sizeof(magic)) != 0) {
+    throw std::runtime_error(path + " isn't a saved memory cache");
+  }
+  FileHeader fileInfo;
+  if (fread(&fileInfo, sizeof(fileInfo), 1, file) != 1) {
+    throw std::runtime_error(path + " is truncated");
+  }
+  FileHeader expected = fileHeader(fileInfo.hashSeed);
+  if (fileInfo.formatVersion != expected.formatVersion ||
+      memcmp(fileInfo.encoder, expected.encoder, sizeof(expected.encoder)) != 0) {
+    return 0;
+  }
+  hashSeed = fileInfo.hashSeed;
+  size_t count = 0;
+  EntryHeader header;
+  while (fread(&header, sizeof(header), 1, file) == 1) {
+    if (header.size > shardBytes) {
+      // Saved with a bigger budget than this cache has
+      fseek(file, header.size, SEEK_CUR);
+      continue;
+    }
+    auto png = std::make_shared<std::string>(header.size, '\0');
+    if (fread(png->data(), 1, header.size, file) != header.size) {
+      throw std::runtime_error(path + " is truncated");
+    }
+    Key key{header.inputHash, header.inputBytes, header.sampleRate};
+    Shard& shard = shardFor(key);
+    std::lock_guard lock(shard.mutex);
+    store(shard, key, std::move(png));
+    ++count;
+  }
+  return count;
+}
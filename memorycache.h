@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Shrunk pngs kept in memory for the server, so a hot input is decoded once
+// and then answered from here. Keyed by the input's hash and length and the
+// parameters, evicted least recently used first past a byte budget. The
+// entries are spread over shards with a lock each, so event loops hitting
+// different keys don't wait on one another.
+//
+// Also coalesces requests: while one job makes a missing entry, others that
+// want the same one register as waiters and get its outcome instead of
+// decoding the same input again
+class MemoryCache {
+ public:
+  struct Key {
+    // See inputHash below
+    uint64_t inputHash = 0;
+    uint64_t inputBytes = 0;
+    uint32_t sampleRate = 0;
+    bool operator==(const Key&) const = default;
+  };
+
+  using Png = std::shared_ptr<const std::string>;
+
+  // Outcome of the job making an entry, what its waiters answer with
+  struct Flight {
+    // Set when the job succeeded
+    Png png;
+    // Otherwise the failure to pass on, status 0 when it was the job's own
+    // (cancelled, timed out, too big to keep) and waiters should retry
+    int status = 0;
+    std::string error;
+  };
+
+  // Called once with the finished flight, on whichever thread finishes it
+  using Waiter = std::function<void(std::shared_ptr<const Flight>)>;
+
+  struct Lookup {
+    // Set on a hit
+    Png png;
+    // Set when the caller is to make the entry and pass this to finish.
+    // With neither set the caller was added as a waiter
+    std::shared_ptr<Flight> lead;
+  };
+
+  explicit MemoryCache(size_t maxBytes, unsigned numShards = 16);
+
+  // Hash of an input for its key. Seeded with a secret random value, so
+  // nobody outside can make an input whose key collides with someone
+  // else's and plant the wrong answer for it
+  uint64_t inputHash(const void* data, size_t size) const;
+
+  Lookup lookup(const Key& key, Waiter waiter);
+
+  // Ends the flight for key, storing its png if it has one, then calls its
+  // waiters outside the lock
+  void finish(const Key& key, std::shared_ptr<Flight> flight);
+
+  // Writes every entry to path (through a rename), least recently used
+  // first so that load brings back the same order. Throws on write errors,
+  // returns how many entries were written
+  size_t save(const std::string& path);
+  // Adds the entries save wrote to path, as far as the budget goes, and
+  // takes over the hash seed they were saved with. Call it before the
+  // first lookup. A missing file, or one from a build whose answers
+  // differ, is an empty cache, a damaged one throws
+  size_t load(const std::string& path);
+
+  // Largest png worth keeping, a shard's share of the budget
+  size_t maxEntryBytes() const { return shardBytes; }
+
+  size_t bytes() const { return totalBytes; }
+
+  std::atomic<uint64_t> hits = 0;
+  std::atomic<uint64_t> misses = 0;
+  std::atomic<uint64_t> coalesced = 0;
+  std::atomic<uint64_t> evictions = 0;
+
+ private:
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return key.inputHash ^ key.inputBytes ^ (key.sampleRate * 0x9e3779b97f4a7c15ull);
+    }
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    // Most recently used first
+    std::list<std::pair<Key, Png>> lru;
+    std::unordered_map<Key, std::list<std::pair<Key, Png>>::iterator, KeyHash> entries;
+    size_t bytes = 0;
+    std::unordered_map<Key, std::vector<Waiter>, KeyHash> flights;
+  };
+
+  Shard& shardFor(const Key& key) { return shards[KeyHash()(key) % shards.size()]; }
+  // Caller holds the shard's mutex
+  void store(Shard& shard, const Key& key, Png png);
+
+  size_t shardBytes;
+  uint64_t hashSeed;
+  std::vector<Shard> shards;
+  std::atomic<size_t> totalBytes = 0;
+};
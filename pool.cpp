@@ -0,0 +1,552 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "copng.h"
+#include "pool.h"
+#include "trace.h"
+
+namespace Pool {
+  namespace {
+    constexpr size_t maxPath = 4096;
+    constexpr size_t maxError = 512;
+    constexpr size_t ringSize = 64;
+    constexpr unsigned maxWorkers = 256;
+    // Who the supervisor's feeder and result reader are to the rings, the
+    // workers go by their index
+    constexpr unsigned supervisorTaker = maxWorkers;
+
+    // Shared between processes, so the atomics have to work without a lock
+    // that would live in only one of them
+    static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+    struct JobEntry {
+      uint64_t id = 0;
+      unsigned sampleRate = 1;
+      char inFile[maxPath] = {};
+      char outFile[maxPath] = {};
+    };
+
+    struct ResultEntry {
+      uint64_t id = 0;
+      bool ok = true;
+      char error[maxError] = {};
+    };
+
+    // Bounded multi producer, multi consumer queue (Vyukov's): each slot's
+    // sequence says whose turn it is, so a push or pop never waits on
+    // another process. A push or pop claims its slot by swapping its
+    // sequence for a mark naming who took it and for which position, and
+    // hands the slot on once the value is copied. The claim and the record
+    // of who made it are the one compare and swap, so when a worker dies in
+    // between, recover() can still tell which slot was left half done
+    template <typename T, size_t N>
+    class SharedRing {
+     public:
+      void init() {
+        for (size_t i = 0; i < N; ++i) {
+          slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+      }
+
+      // False when full, or while the slot next in line is still being
+      // popped. taker names the caller for recover()
+      bool push(const T& value, unsigned taker) {
+        uint64_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+          Slot& slot = slots[pos % N];
+          uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+          if (sequence & markBit) {
+            if (sequence != mark(true, (sequence >> takerShift) & takerMask, pos)) {
+              return false;
+            }
+            // Another push took this slot and hasn't moved tail on yet
+            tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed);
+            pos = tail.load(std::memory_order_relaxed);
+            continue;
+          }
+          int64_t diff = (int64_t)sequence - (int64_t)pos;
+          if (diff == 0) {
+            if (slot.sequence.compare_exchange_weak(sequence, mark(true, taker, pos),
+                    std::memory_order_acquire)) {
+              uint64_t expected = pos;
+              tail.compare_exchange_strong(expected, pos + 1, std::memory_order_relaxed);
+              slot.value = value;
+              slot.sequence.store(pos + 1, std::memory_order_release);
+              return true;
+            }
+            pos = tail.load(std::memory_order_relaxed);
+          } else if (diff < 0) {
+            return false;
+          } else {
+            pos = tail.load(std::memory_order_relaxed);
+          }
+        }
+      }
+
+      // False when empty, or while the slot next in line is still being
+      // pushed. takenId, when set, gets the value's id before the slot is
+      // handed on
+      bool pop(T& value, unsigned taker, std::atomic<uint64_t>* takenId = nullptr) {
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+          Slot& slot = slots[pos % N];
+          uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+          if (sequence & markBit) {
+            if (sequence != mark(false, (sequence >> takerShift) & takerMask, pos)) {
+              return false;
+            }
+            // Another pop took this slot and hasn't moved head on yet
+            head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed);
+            pos = head.load(std::memory_order_relaxed);
+            continue;
+          }
+          int64_t diff = (int64_t)sequence - (int64_t)(pos + 1);
+          if (diff == 0) {
+            if (slot.sequence.compare_exchange_weak(sequence, mark(false, taker, pos),
+                    std::memory_order_acquire)) {
+              uint64_t expected = pos;
+              head.compare_exchange_strong(expected, pos + 1, std::memory_order_relaxed);
+              value = slot.value;
+              if (takenId) {
+                takenId->store(value.id);
+              }
+              slot.sequence.store(pos + N, std::memory_order_release);
+              return true;
+            }
+            pos = head.load(std::memory_order_relaxed);
+          } else if (diff < 0) {
+            return false;
+          } else {
+            pos = head.load(std::memory_order_relaxed);
+          }
+        }
+      }
+
+      // Finishes whatever taker left half done when it died, so the ring
+      // doesn't stop at its slot for good. A slot it was popping is handed
+      // on and the id of the value in it returned; one it was pushing into
+      // is published empty (id 0) for the next pop to skip. 0 when taker
+      // held no slot. Only for a taker that can't touch the ring any more
+      uint64_t recover(unsigned taker) {
+        for (Slot& slot : slots) {
+          uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+          if (!(sequence & markBit) || ((sequence >> takerShift) & takerMask) != taker) {
+            continue;
+          }
+          uint64_t pos = sequence & posMask;
+          uint64_t expected = pos;
+          if (sequence & pushBit) {
+            tail.compare_exchange_strong(expected, pos + 1, std::memory_order_relaxed);
+            slot.value = T{};
+            slot.sequence.store(pos + 1, std::memory_order_release);
+            return 0;
+          }
+          head.compare_exchange_strong(expected, pos + 1, std::memory_order_relaxed);
+          uint64_t id = slot.value.id;
+          slot.sequence.store(pos + N, std::memory_order_release);
+          return id;
+        }
+        return 0;
+      }
+
+     private:
+      // A mark is the two flags, who took the slot and its position, which
+      // takes 2^48 pushes to wrap
+      static constexpr uint64_t markBit = 1ull << 63;
+      static constexpr uint64_t pushBit = 1ull << 62;
+      static constexpr unsigned takerShift = 48;
+      static constexpr uint64_t takerMask = (1ull << 14) - 1;
+      static constexpr uint64_t posMask = (1ull << takerShift) - 1;
+
+      static uint64_t mark(bool pushing, uint64_t taker, uint64_t pos) {
+        return markBit | (pushing ? pushBit : 0) | taker << takerShift | (pos & posMask);
+      }
+
+      struct Slot {
+        std::atomic<uint64_t> sequence;
+        T value;
+      };
+
+      Slot slots[N];
+      // Next to pop and next to push, on their own cache lines
+      alignas(64) std::atomic<uint64_t> head;
+      alignas(64) std::atomic<uint64_t> tail;
+    };
+
+    // Lives in a MAP_SHARED mapping made before the first fork
+    struct Shared {
+      SharedRing<JobEntry, ringSize> jobs;
+      SharedRing<ResultEntry, ringSize> results;
+      // Only for sleeping instead of spinning, the rings don't need them
+      sem_t jobsQueued;
+      sem_t jobSlotsFree;
+      sem_t resultsQueued;
+      std::atomic<bool> stopping;
+      // Id of the job each worker is running, 0 while it's idle. What the
+      // supervisor reports when that worker dies
+      std::atomic<uint64_t> running[maxWorkers];
+    };
+
+    // What the spawner tells the supervisor about a worker that died
+    struct Death {
+      unsigned index = 0;
+      // The job it was running, 0 if none
+      uint64_t id = 0;
+      int status = 0;
+      // Set when the replacement couldn't be forked either
+      int forkErrno = 0;
+    };
+
+    void waitFor(sem_t* semaphore) {
+      while (sem_wait(semaphore) != 0 && errno == EINTR) {}
+    }
+
+    [[noreturn]] void workerMain(Shared* shared, unsigned index, const InputLimits& limits) {
+      while (true) {
+        waitFor(&shared->jobsQueued);
+        if (shared->stopping) {
+          if constexpr (Trace::compiledIn()) {
+            if (const char* tracePath = getenv("PNGSHRINK_TRACE")) {
+              // Its own file next to the supervisor's, the decodes happen here
+              Trace::dump(std::string(tracePath) + "." + std::to_string(getpid()));
+            }
+          }
+          // Nothing of the supervisor's to clean up from here
+          _exit(0);
+        }
+        JobEntry job;
+        if (!shared->jobs.pop(job, index, &shared->running[index])) {
+          continue;
+        }
+        sem_post(&shared->jobSlotsFree);
+
+        ResultEntry result{.id = job.id};
+        try {
+          ShrinkSpec spec{{{job.outFile, job.sampleRate}}};
+          spec.limits = limits;
+          shrinkPng(job.inFile, std::move(spec));
+        } catch (const std::exception& e) {
+          result.ok = false;
+          snprintf(result.error, sizeof(result.error), "%s", e.what());
+          std::error_code ignored;
+          std::filesystem::remove(job.outFile, ignored);
+        }
+        while (!shared->results.push(result, index)) {
+          usleep(1000);
+        }
+        sem_post(&shared->resultsQueued);
+        shared->running[index] = 0;
+      }
+    }
+
+    pid_t startWorker(Shared* shared, unsigned index, const InputLimits& limits) {
+      shared->running[index] = 0;
+      pid_t pid = fork();
+      if (pid == 0) {
+        workerMain(shared, index, limits);
+      } else if (pid < 0) {
+        throw std::runtime_error(std::string("Can't fork a worker: ") + strerror(errno));
+      }
+      return pid;
+    }
+
+    // Forks the workers and replaces those that die, until the supervisor
+    // is stopping and they have all exited. Runs in a process of its own,
+    // forked before the supervisor starts any threads, so a fork never
+    // copies a lock (malloc's, iostreams') another thread was holding. Each
+    // death goes to the supervisor through deathsFd
+    [[noreturn]] void spawnerMain(Shared* shared, unsigned numWorkers, const InputLimits& limits,
+        int deathsFd) {
+      std::vector<pid_t> workers(numWorkers, -1);
+      auto start = [&](unsigned index) {
+        try {
+          workers[index] = startWorker(shared, index, limits);
+          return 0;
+        } catch (const std::exception& e) {
+          int error = errno;
+          std::cerr << e.what() << std::endl;
+          workers[index] = -1;
+          return error ? error : EAGAIN;
+        }
+      };
+      for (unsigned i = 0; i < numWorkers; ++i) {
+        if (int error = start(i)) {
+          Death death{.index = i, .forkErrno = error};
+          write(deathsFd, &death, sizeof(death));
+        }
+      }
+
+      while (true) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0 && errno == EINTR) {
+          continue;
+        } else if (pid < 0) {
+          // No workers left
+          _exit(0);
+        }
+        auto worker = std::find(workers.begin(), workers.end(), pid);
+        if (worker == workers.end()) {
+          continue;
+        }
+        unsigned index = worker - workers.begin();
+        *worker = -1;
+        Death death{.index = index, .id = shared->running[index].exchange(0), .status = status};
+        // A job it died taking is its job all the same, and the slot goes
+        // back to the feeder. Its result half written is dropped, the job
+        // is still in running
+        if (uint64_t taken = shared->jobs.recover(index)) {
+          death.id = taken;
+          sem_post(&shared->jobSlotsFree);
+        }
+        shared->results.recover(index);
+        // It may have died between being woken for a job and taking it
+        sem_post(&shared->jobsQueued);
+        if (!shared->stopping) {
+          death.forkErrno = start(index);
+        }
+        write(deathsFd, &death, sizeof(death));
+      }
+    }
+
+    std::string describeExit(int status) {
+      if (WIFSIGNALED(status)) {
+        return std::string("Worker killed by ") + strsignal(WTERMSIG(status));
+      }
+      return "Worker exited with status " + std::to_string(WEXITSTATUS(status));
+    }
+
+    void usage() {
+      std::cout << "Usage: pool [--workers N] [--rate N] [--max-... N]" << std::endl
+                << "  Reads `in out [rate]` lines from stdin and shrinks each in a" << std::endl
+                << "  preforked worker process, printing `ok<TAB>in`," << std::endl
+                << "  `failed<TAB>in<TAB>error` or `crashed<TAB>in<TAB>reason` per job" << std::endl
+                << "  --workers N  worker processes (default: one per core)" << std::endl
+                << "  --rate N     rate for lines that don't give one (default 2)" << std::endl
+                << InputLimits::usage()
+                << "                      (defaults: 268435456 pixels, 8192 KB chunks)" << std::endl;
+    }
+  };
+
+  int poolMain(int argc, char* argv[]) {
+    unsigned numWorkers = std::thread::hardware_concurrency();
+    unsigned defaultRate = 2;
+    InputLimits limits = InputLimits::forServers();
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      bool hasValue = i + 1 < argc;
+      if (arg == "--workers" && hasValue) {
+        numWorkers = (unsigned)std::clamp(atoi(argv[++i]), 1, (int)maxWorkers);
+      } else if (arg == "--rate" && hasValue) {
+        int rate = atoi(argv[++i]);
+        if (rate <= 0) {
+          std::cout << "Sample rate must be greater than 0" << std::endl;
+          return -1;
+        }
+        defaultRate = rate;
+      } else if (InputLimits::isOption(arg) && hasValue) {
+        if (!limits.parseOption(arg, argv[++i])) {
+          std::cout << arg << " needs a number, 0 for no limit" << std::endl;
+          return -1;
+        }
+      } else {
+        usage();
+        return -1;
+      }
+    }
+    numWorkers = std::clamp(numWorkers, 1u, maxWorkers);
+    verboseOutput = false;
+
+    void* mapping = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+      std::cerr << "Can't map shared memory: " << strerror(errno) << std::endl;
+      return -1;
+    }
+    Shared* shared = new (mapping) Shared;
+    shared->jobs.init();
+    shared->results.init();
+    sem_init(&shared->jobsQueued, 1, 0);
+    sem_init(&shared->jobSlotsFree, 1, ringSize);
+    sem_init(&shared->resultsQueued, 1, 0);
+    shared->stopping = false;
+
+    auto startTime = std::chrono::steady_clock::now();
+    int deathPipe[2];
+    if (pipe2(deathPipe, O_CLOEXEC) != 0) {
+      std::cerr << "Can't create a pipe: " << strerror(errno) << std::endl;
+      return -1;
+    }
+    pid_t spawner = fork();
+    if (spawner == 0) {
+      close(deathPipe[0]);
+      spawnerMain(shared, numWorkers, limits, deathPipe[1]);
+    } else if (spawner < 0) {
+      std::cerr << "Can't fork the worker spawner: " << strerror(errno) << std::endl;
+      return -1;
+    }
+    close(deathPipe[1]);
+    fcntl(deathPipe[0], F_SETFL, O_NONBLOCK);
+    unsigned liveWorkers = numWorkers;
+
+    // Jobs handed out and not yet reported, by id
+    struct Pending {
+      std::string inFile;
+      std::string outFile;
+    };
+    std::mutex mutex;
+    std::unordered_map<uint64_t, Pending> pending;
+    std::atomic<bool> inputDone = false;
+    size_t succeeded = 0, failed = 0, crashed = 0;
+    // The reason nothing more can run, i.e. every worker failed to fork
+    std::string fatal;
+
+    // Each job is reported once, whether its result or its worker's death
+    // comes in first
+    auto report = [&](uint64_t id, const char* status, const std::string& detail) {
+      std::lock_guard lock(mutex);
+      auto job = pending.find(id);
+      if (job == pending.end()) {
+        return;
+      }
+      std::cout << status << "\t" << job->second.inFile;
+      if (!detail.empty()) {
+        std::cout << "\t" << detail;
+      }
+      std::cout << std::endl;
+      if (strcmp(status, "ok") == 0) {
+        ++succeeded;
+      } else if (strcmp(status, "failed") == 0) {
+        ++failed;
+      } else {
+        ++crashed;
+        std::error_code ignored;
+        std::filesystem::remove(job->second.outFile, ignored);
+      }
+      pending.erase(job);
+    };
+
+    std::thread feeder([&] {
+      uint64_t nextId = 0;
+      std::string line;
+      while (std::getline(std::cin, line)) {
+        std::istringstream fields(line);
+        JobEntry job;
+        std::string inFile, outFile, rateText, extra;
+        if (!(fields >> inFile)) {
+          continue;
+        }
+        fields >> outFile >> rateText >> extra;
+        int rate = rateText.empty() ? defaultRate : atoi(rateText.c_str());
+        if (outFile.empty() || !extra.empty() || rate <= 0 || inFile.size() >= maxPath ||
+            outFile.size() >= maxPath) {
+          std::lock_guard lock(mutex);
+          std::cout << "failed\t" << inFile << "\tExpected `in out [rate]`" << std::endl;
+          ++failed;
+          continue;
+        }
+        job.id = ++nextId;
+        job.sampleRate = rate;
+        memcpy(job.inFile, inFile.c_str(), inFile.size() + 1);
+        memcpy(job.outFile, outFile.c_str(), outFile.size() + 1);
+        {
+          std::lock_guard lock(mutex);
+          pending[job.id] = {inFile, outFile};
+        }
+        waitFor(&shared->jobSlotsFree);
+        // A slot can still be on its way back from a worker's pop, or from
+        // one that died and isn't recovered yet
+        while (!shared->jobs.push(job, supervisorTaker)) {
+          usleep(1000);
+        }
+        sem_post(&shared->jobsQueued);
+      }
+      inputDone = true;
+    });
+
+    auto drainResults = [&] {
+      ResultEntry result;
+      while (shared->results.pop(result, supervisorTaker)) {
+        // Id 0 is what's left of a result its worker died writing
+        report(result.id, result.ok ? "ok" : "failed", result.error);
+      }
+    };
+
+    while (true) {
+      timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += 50 * 1000 * 1000;
+      if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000 * 1000 * 1000;
+      }
+      sem_timedwait(&shared->resultsQueued, &deadline);
+      drainResults();
+
+      Death death;
+      while (read(deathPipe[0], &death, sizeof(death)) == sizeof(death)) {
+        if (death.status != 0 || death.id != 0) {
+          // Anything it finished before dying is already in the ring
+          drainResults();
+          if (death.id != 0) {
+            report(death.id, "crashed", describeExit(death.status));
+          }
+        }
+        if (death.forkErrno != 0 && --liveWorkers == 0) {
+          fatal = std::string("Can't fork a worker: ") + strerror(death.forkErrno);
+        }
+      }
+      if (waitpid(spawner, nullptr, WNOHANG) == spawner) {
+        fatal = "The worker spawner exited";
+        spawner = -1;
+      }
+
+      std::lock_guard lock(mutex);
+      if (!fatal.empty() || (inputDone && pending.empty())) {
+        break;
+      }
+    }
+
+    shared->stopping = true;
+    for (unsigned i = 0; i < numWorkers; ++i) {
+      sem_post(&shared->jobsQueued);
+    }
+    if (!fatal.empty()) {
+      std::lock_guard lock(mutex);
+      for (const auto& [id, job] : pending) {
+        std::cout << "failed\t" << job.inFile << "\t" << fatal << std::endl;
+      }
+      std::cerr << fatal << std::endl;
+      // The feeder may be blocked on a full ring or on stdin
+      _exit(-1);
+    }
+    feeder.join();
+    waitpid(spawner, nullptr, 0);
+    close(deathPipe[0]);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+    std::cerr << "Shrunk " << succeeded << " images, " << failed << " failed, " << crashed
+              << " crashed a worker, in " << elapsed.count() << "s" << std::endl;
+    return failed + crashed > 0 ? 1 : 0;
+  }
+};
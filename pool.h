@@ -0,0 +1,14 @@
+#pragma once
+
+// Pool mode: a supervisor and a pool of preforked worker processes, for
+// inputs that may crash the decoder. Jobs go to the workers through a
+// lock-free ring in shared memory, and a worker that dies mid job is
+// replaced by a fresh fork; only the job it was running fails. Workers are
+// forked from a copy of the already loaded supervisor, so startup and
+// dynamic linking are paid once, not per image
+namespace Pool {
+  // Entry point for `pngshrink pool ...`, argv[0] is "pool". Reads
+  // `in out [rate]` lines from stdin until it closes and prints a result
+  // line per job on stdout
+  int poolMain(int argc, char* argv[]);
+};
@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <cmath>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+
+namespace {
+  // Weight of the newest sample in the moving averages
+  constexpr double smoothing = 0.2;
+
+  // How much of each file to ask the kernel for up front, enough to cover
+  // typical images without flooding the page cache with huge ones
+  constexpr off_t readAheadBytes = 4 << 20;
+
+  double smooth(double average, double sample) {
+    return average == 0 ? sample : average + smoothing * (sample - average);
+  }
+};
+
+Prefetcher::Prefetcher(BufferPool& _pool, unsigned _maxDepth)
+    : pool(_pool), maxDepth(std::max(1u, _maxDepth)) {
+  currentDepth = std::min(currentDepth, maxDepth);
+  for (unsigned i = 0; i < maxDepth; ++i) {
+    threads.emplace_back([this] { ioLoop(); });
+  }
+}
+
+Prefetcher::~Prefetcher() {
+  {
+    std::lock_guard lock(mutex);
+    stopping = true;
+  }
+  changed.notify_all();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+void Prefetcher::add(std::string path, Ready ready) {
+  std::unique_lock lock(mutex);
+  // Producers (like the directory walker) can be far faster than the disk,
+  // don't let the list of names grow without bound
+  changed.wait(lock, [this] { return queue.size() < 4 * maxDepth; });
+  queue.push_back({std::move(path), std::move(ready)});
+  lock.unlock();
+  changed.notify_all();
+}
+
+void Prefetcher::wait() {
+  std::unique_lock lock(mutex);
+  changed.wait(lock, [this] { return queue.empty() && inFlight == 0; });
+}
+
+unsigned Prefetcher::depth() {
+  std::lock_guard lock(mutex);
+  return currentDepth;
+}
+
+void Prefetcher::jobFinished() {
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard lock(mutex);
+  if (lastJobFinished != std::chrono::steady_clock::time_point{}) {
+    std::chrono::duration<double> interval = now - lastJobFinished;
+    averageJobInterval = smooth(averageJobInterval, interval.count());
+  }
+  lastJobFinished = now;
+}
+
+void Prefetcher::recordLatency(std::chrono::steady_clock::duration latency) {
+  std::lock_guard lock(mutex);
+  averageLatency = smooth(averageLatency, std::chrono::duration<double>(latency).count());
+  if (averageJobInterval > 0) {
+    // Little's law: to have the next input ready by the time a job finishes,
+    // keep latency / interval reads in flight, plus one for jitter
+    unsigned wanted = (unsigned)std::ceil(averageLatency / averageJobInterval) + 1;
+    currentDepth = std::clamp(wanted, 1u, maxDepth);
+  }
+  changed.notify_all();
+}
+
+std::shared_ptr<PrefetchedInput> Prefetcher::prefetch(const std::string& path,
+    BufferPool::Lease head) {
+  // Start the kernel reading the file into the page cache, the advice
+  // sticks to the file so this descriptor can be closed right away
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, readAheadBytes, POSIX_FADV_WILLNEED);
+    close(fd);
+  }
+
+  auto input = std::make_shared<PrefetchedInput>();
+  input->stream.open(path, std::fstream::binary);
+  if (!input->stream) {
+    throw std::runtime_error("Can't open file to read");
+  }
+  input->head = std::move(head);
+  std::span<std::byte> buffer = input->head.buffer();
+  input->stream.read((char*)buffer.data(), buffer.size());
+  if (input->stream.bad()) {
+    throw std::runtime_error("There was an error reading the file");
+  }
+  input->head.size = input->stream.gcount();
+  // A short read leaves eof/fail set, the Reader should still see a
+  // healthy stream that simply has nothing left
+  input->stream.clear();
+  return input;
+}
+
+void Prefetcher::ioLoop() {
+  while (true) {
+    std::unique_lock lock(mutex);
+    changed.wait(lock, [this] {
+      return (!queue.empty() && inFlight < currentDepth) || (stopping && queue.empty());
+    });
+    if (queue.empty()) {
+      return; // stopping and nothing left to read
+    }
+    Pending pending = std::move(queue.front());
+    queue.pop_front();
+    ++inFlight;
+    lock.unlock();
+    changed.notify_all();
+
+    // Waiting for a free buffer isn't I/O latency, keep it out of the timing
+    BufferPool::Lease head = pool.acquire();
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<PrefetchedInput> input;
+    std::exception_ptr error;
+    try {
+      input = prefetch(pending.path, std::move(head));
+    } catch (...) {
+      error = std::current_exception();
+    }
+    recordLatency(std::chrono::steady_clock::now() - start);
+
+    // Handing over may block (a full executor queue), which is exactly
+    // when reading further ahead would be wasted
+    pending.ready(std::move(input), error);
+
+    lock.lock();
+    --inFlight;
+    lock.unlock();
+    changed.notify_all();
+  }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bufferpool.h"
+#include "copng.h"
+
+// Opens upcoming inputs and reads their first chunk while earlier jobs are
+// still shrinking, so a job's Reader starts with data already in memory.
+// How many files are read ahead at once follows the observed open+read
+// latency against how quickly jobs finish
+class Prefetcher {
+ public:
+  // Called on a prefetch thread once the input is ready. error is set
+  // instead if the file couldn't be opened or read
+  using Ready = std::function<void(std::shared_ptr<PrefetchedInput> input, std::exception_ptr error)>;
+
+  Prefetcher(BufferPool& pool, unsigned maxDepth);
+  // Finishes everything already added
+  ~Prefetcher();
+
+  // Queues a file to read ahead, blocks if too many are waiting
+  void add(std::string path, Ready ready);
+
+  // Blocks until everything added has been handed to its Ready callback
+  void wait();
+
+  // Tells the prefetcher a job finished, which paces the read ahead
+  void jobFinished();
+
+  // Number of files currently allowed in flight
+  unsigned depth();
+
+ private:
+  struct Pending {
+    std::string path;
+    Ready ready;
+  };
+
+  void ioLoop();
+  std::shared_ptr<PrefetchedInput> prefetch(const std::string& path, BufferPool::Lease head);
+  void recordLatency(std::chrono::steady_clock::duration latency);
+
+  BufferPool& pool;
+  const unsigned maxDepth;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<Pending> queue;
+  unsigned inFlight = 0;
+  unsigned currentDepth = 2;
+  bool stopping = false;
+
+  // Moving averages, in seconds, driving currentDepth
+  double averageLatency = 0;
+  double averageJobInterval = 0;
+  std::chrono::steady_clock::time_point lastJobFinished;
+
+  std::vector<std::thread> threads;
+};
@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glob.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "copng.h"
+#include "executor.h"
+#include "hash.h"
+#include "sequence.h"
+
+namespace Sequence {
+  namespace {
+    struct Frame {
+      std::string inFile;
+      // Raw outputs, only encoded once the frame is known to differ from
+      // the one before it
+      std::vector<OutputSpec> outputs;
+      Hash::Hasher rowHash;
+      bool decoded = false;
+      // Set under the lock, unlike error which encoding sets later
+      bool decodeFailed = false;
+      std::exception_ptr error;
+      // The frame whose outputs this one's are, itself unless it's a
+      // duplicate
+      size_t source = 0;
+    };
+
+    bool isPngName(const std::string& name) {
+      return name.size() > 4 && strcasecmp(name.c_str() + name.size() - 4, ".png") == 0;
+    }
+
+    // Frames of each source in name order, i.e. frame_00001.png first
+    std::vector<std::string> listFrames(const std::vector<std::string>& sources) {
+      std::vector<std::string> frames;
+      for (const std::string& source : sources) {
+        std::vector<std::string> found;
+        struct stat st;
+        if (stat(source.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+          for (const auto& entry : std::filesystem::directory_iterator(source)) {
+            if (entry.is_regular_file() && isPngName(entry.path().filename())) {
+              found.push_back(entry.path());
+            }
+          }
+        } else if (source.find_first_of("*?[") != std::string::npos) {
+          glob_t matches;
+          if (glob(source.c_str(), 0, nullptr, &matches) == 0) {
+            found.assign(matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+          }
+          globfree(&matches);
+        } else {
+          found.push_back(source);
+        }
+        std::sort(found.begin(), found.end());
+        frames.insert(frames.end(), found.begin(), found.end());
+      }
+      return frames;
+    }
+
+    void writeFile(const std::string& outFile, const std::vector<png_byte>& data) {
+      std::ofstream out(outFile, std::ios::binary | std::ios::trunc);
+      out.write((const char*)data.data(), data.size());
+      if (!out) {
+        throw std::runtime_error("Can't write " + outFile);
+      }
+    }
+
+    void usage() {
+      std::cout << "Usage: sequence --out DIR [options] frames..." << std::endl
+                << "  frames are files, directories (their *.png files) or glob patterns," << std::endl
+                << "  taken in name order" << std::endl
+                << "  --out DIR       output directory, frames keep their file names" << std::endl
+                << "  --rate N[,N...] sample rate(s) (default 2), several rates go under" << std::endl
+                << "                  DIR/<rate>x" << std::endl
+                << "  --jobs N        worker threads (default: one per core)" << std::endl;
+    }
+  };
+
+  int sequenceMain(int argc, char* argv[]) {
+    std::string outDir;
+    std::vector<unsigned> rates{2};
+    unsigned numThreads = std::thread::hardware_concurrency();
+    std::vector<std::string> sources;
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      bool hasValue = i + 1 < argc;
+      if (arg == "--out" && hasValue) {
+        outDir = argv[++i];
+      } else if (arg == "--rate" && hasValue) {
+        if (!Batch::parseRates(argv[++i], rates)) {
+          std::cout << "Sample rate must be greater than 0" << std::endl;
+          return -1;
+        }
+      } else if (arg == "--jobs" && hasValue) {
+        numThreads = (unsigned)std::max(1, atoi(argv[++i]));
+      } else if (arg.starts_with("--")) {
+        usage();
+        return -1;
+      } else {
+        sources.push_back(arg);
+      }
+    }
+    if (sources.empty() || outDir.empty()) {
+      usage();
+      return -1;
+    }
+    verboseOutput = false;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> inputs = listFrames(sources);
+    std::vector<std::string> outDirs;
+    for (unsigned rate : rates) {
+      outDirs.push_back(rates.size() == 1 ? outDir :
+          (std::filesystem::path(outDir) / (std::to_string(rate) + "x")).string());
+      std::filesystem::create_directories(outDirs.back());
+    }
+
+    std::vector<Frame> frames(inputs.size());
+    std::mutex mutex;
+    std::condition_variable decided;
+    size_t nextUndecided = 0;
+    size_t duplicates = 0;
+    // Frames may finish in any order but are decided in order, this bounds
+    // how many decoded frames can wait for an earlier one
+    size_t window = 2 * (size_t)numThreads + 2;
+
+    auto encode = [](Frame& frame) {
+      try {
+        for (OutputSpec& output : frame.outputs) {
+          RawImage& raw = *output.raw;
+          writeFile(output.outFile, Tiles::encodePng(raw.format, raw.width, raw.height,
+              raw.pixels.data(), raw.width * raw.format.pixelBytes));
+          output.raw = nullptr;
+        }
+      } catch (...) {
+        frame.error = std::current_exception();
+      }
+    };
+
+    // Called as each frame finishes decoding. Decides every frame that has
+    // all frames before it decided, then encodes the ones that differ from
+    // their predecessor outside the lock
+    auto settle = [&](size_t index, std::exception_ptr error) {
+      std::vector<Frame*> toEncode;
+      {
+        std::lock_guard lock(mutex);
+        frames[index].decoded = true;
+        frames[index].error = error;
+        frames[index].decodeFailed = error != nullptr;
+        for (; nextUndecided < frames.size() && frames[nextUndecided].decoded; ++nextUndecided) {
+          Frame& frame = frames[nextUndecided];
+          frame.source = nextUndecided;
+          if (frame.decodeFailed) {
+            continue;
+          }
+          Frame* previous = nextUndecided > 0 ? &frames[nextUndecided - 1] : nullptr;
+          if (previous && !previous->decodeFailed &&
+              previous->rowHash.digest() == frame.rowHash.digest()) {
+            frame.source = previous->source;
+            frame.outputs.clear();
+            ++duplicates;
+          } else {
+            toEncode.push_back(&frame);
+          }
+        }
+      }
+      decided.notify_all();
+      for (Frame* frame : toEncode) {
+        encode(*frame);
+      }
+    };
+
+    {
+      Executor executor(numThreads, numThreads);
+      for (size_t i = 0; i < frames.size(); ++i) {
+        {
+          std::unique_lock lock(mutex);
+          decided.wait(lock, [&] { return i < nextUndecided + window; });
+        }
+        Frame& frame = frames[i];
+        frame.inFile = inputs[i];
+        std::string name = std::filesystem::path(inputs[i]).filename();
+        for (size_t r = 0; r < rates.size(); ++r) {
+          frame.outputs.push_back({(std::filesystem::path(outDirs[r]) / name).string(), rates[r],
+              nullptr, std::make_shared<RawImage>()});
+        }
+        executor.submit({
+          .start = [&frame] {
+            ShrinkSpec spec{frame.outputs};
+            spec.rowHash = &frame.rowHash;
+            return coPng(frame.inFile.c_str(), std::move(spec));
+          },
+          .done = [&settle, i](std::exception_ptr exception) {
+            settle(i, exception);
+          },
+        });
+      }
+      executor.wait();
+    }
+
+    // Duplicates are linked once every frame they could point at is written
+    size_t failed = 0;
+    for (size_t i = 0; i < frames.size(); ++i) {
+      Frame& frame = frames[i];
+      if (!frame.error && frame.source != i) {
+        Frame& source = frames[frame.source];
+        try {
+          if (source.error) {
+            throw std::runtime_error("Identical to " + source.inFile + ", which failed");
+          }
+          std::string name = std::filesystem::path(frame.inFile).filename();
+          for (size_t r = 0; r < rates.size(); ++r) {
+            std::filesystem::path target = std::filesystem::path(outDirs[r]) /
+                std::filesystem::path(source.inFile).filename();
+            std::filesystem::path link = std::filesystem::path(outDirs[r]) / name;
+            std::filesystem::remove(link);
+            std::error_code linkError;
+            std::filesystem::create_hard_link(target, link, linkError);
+            if (linkError) {
+              std::filesystem::copy_file(target, link);
+            }
+          }
+        } catch (...) {
+          frame.error = std::current_exception();
+        }
+      }
+      if (frame.error) {
+        ++failed;
+        try {
+          std::rethrow_exception(frame.error);
+        } catch (const std::exception& e) {
+          std::cerr << frame.inFile << ": " << e.what() << std::endl;
+        }
+      }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Shrunk " << frames.size() - failed << " frames (" << duplicates
+              << " duplicates linked), " << failed << " failed, in " << elapsed.count() << "s"
+              << std::endl;
+    return failed > 0 ? -1 : 0;
+  }
+};
@@ -0,0 +1,10 @@
+#pragma once
+
+// Sequence mode: shrinks numbered frames (frame_00001.png, ...) in parallel.
+// Each frame's decoded image is hashed as it streams through, and a frame
+// that turns out identical to the one before it is linked to that frame's
+// output instead of being encoded again
+namespace Sequence {
+  // Entry point for `pngshrink sequence ...`, argv[0] is "sequence"
+  int sequenceMain(int argc, char* argv[]);
+};
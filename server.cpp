@@ -0,0 +1,1494 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "copng.h"
+#include "memorycache.h"
+#include "server.h"
+#include "trace.h"
+#include "websocket.h"
+
+namespace Server {
+  namespace {
+    constexpr size_t readChunkBytes = 64 * 1024;
+    constexpr size_t maxHeaderBytes = 64 * 1024;
+    constexpr int maxEvents = 256;
+    // Most body handed to a job in one go
+    constexpr size_t pieceBytes = 16 * 1024;
+    // How often each event loop looks for jobs past their deadline
+    constexpr int deadlineTickMs = 100;
+    // How long an idle connection stays open once the server is draining,
+    // any request that comes in meanwhile is answered with Connection: close
+    constexpr int drainGraceMs = 1000;
+
+    // Shared by every event loop, null when caching is off
+    std::unique_ptr<MemoryCache> cache;
+    // Settings for new connections, swapped by a reload
+    std::atomic<std::shared_ptr<const Options>> currentOptions;
+    // Set to stop accepting and return from the event loops once their
+    // connections are done
+    std::atomic<bool> draining = false;
+    // How long a handoff waits for the new process to start serving
+    constexpr int handoffTimeoutMs = 10000;
+
+    // Counters for GET /metrics, shared by every event loop. A job is a
+    // POST or a WebSocket message
+    struct Metrics {
+      std::atomic<uint64_t> jobsStarted = 0;
+      std::atomic<uint64_t> jobsSucceeded = 0;
+      std::atomic<uint64_t> jobsFailed = 0;
+      // The client went away before the answer was done
+      std::atomic<uint64_t> jobsCancelled = 0;
+      std::atomic<uint64_t> jobsTimedOut = 0;
+      // Refused for going over an input limit, by LimitReason
+      std::atomic<uint64_t> jobsOverLimit[(int)LimitReason::CpuTime + 1] = {};
+      std::atomic<int64_t> openConnections = 0;
+
+      std::string text() const {
+        std::string text = "# TYPE pngshrink_jobs_total counter\n";
+        std::pair<const char*, uint64_t> results[] = {
+          {"started", jobsStarted}, {"ok", jobsSucceeded}, {"failed", jobsFailed},
+          {"cancelled", jobsCancelled}, {"timeout", jobsTimedOut},
+        };
+        for (const auto& [result, count] : results) {
+          text += std::string("pngshrink_jobs_total{result=\"") + result + "\"} " +
+              std::to_string(count) + "\n";
+        }
+        text += "# TYPE pngshrink_jobs_over_limit_total counter\n";
+        for (int reason = 0; reason <= (int)LimitReason::CpuTime; ++reason) {
+          text += std::string("pngshrink_jobs_over_limit_total{reason=\"") +
+              reasonCode((LimitReason)reason) + "\"} " + std::to_string(jobsOverLimit[reason]) + "\n";
+        }
+        if (cache) {
+          text += "# TYPE pngshrink_cache_requests_total counter\n";
+          std::pair<const char*, uint64_t> lookups[] = {
+            {"hit", cache->hits}, {"miss", cache->misses}, {"coalesced", cache->coalesced},
+          };
+          for (const auto& [result, count] : lookups) {
+            text += std::string("pngshrink_cache_requests_total{result=\"") + result + "\"} " +
+                std::to_string(count) + "\n";
+          }
+          text += "# TYPE pngshrink_cache_evictions_total counter\n"
+              "pngshrink_cache_evictions_total " + std::to_string(cache->evictions) + "\n"
+              "# TYPE pngshrink_cache_bytes gauge\n"
+              "pngshrink_cache_bytes " + std::to_string(cache->bytes()) + "\n";
+        }
+        text += "# TYPE pngshrink_open_connections gauge\n"
+            "pngshrink_open_connections " + std::to_string(openConnections) + "\n";
+        return text;
+      }
+    };
+    Metrics metrics;
+
+    std::string lowerCase(std::string_view text) {
+      std::string lower(text);
+      std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) {
+        return std::tolower(c);
+      });
+      return lower;
+    }
+
+    std::string_view trim(std::string_view text) {
+      while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+        text.remove_prefix(1);
+      }
+      while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) {
+        text.remove_suffix(1);
+      }
+      return text;
+    }
+
+    // Thrown for requests that can't be answered at all, the connection
+    // gets a 400 and is closed since its framing can't be trusted
+    struct BadRequest : std::runtime_error {
+      using std::runtime_error::runtime_error;
+    };
+
+    struct Request {
+      std::string method;
+      std::string path;
+      std::string query;
+      bool keepAlive = true;
+      bool chunked = false;
+      uint64_t contentLength = 0;
+      bool expectContinue = false;
+      // Asks to switch to the WebSocket protocol
+      bool upgradeWebSocket = false;
+      std::string webSocketKey;
+    };
+
+    Request parseRequest(std::string_view head) {
+      Request request;
+      size_t lineEnd = head.find("\r\n");
+      std::string_view line = head.substr(0, lineEnd);
+      size_t methodEnd = line.find(' ');
+      size_t targetEnd = line.rfind(' ');
+      if (methodEnd == std::string_view::npos || targetEnd <= methodEnd) {
+        throw BadRequest("Malformed request line");
+      }
+      request.method = line.substr(0, methodEnd);
+      std::string_view target = line.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+      std::string_view version = line.substr(targetEnd + 1);
+      if (!version.starts_with("HTTP/1.")) {
+        throw BadRequest("Unsupported HTTP version");
+      }
+      // Keep-alive is the default from HTTP/1.1 on
+      request.keepAlive = version != "HTTP/1.0";
+      size_t queryStart = target.find('?');
+      request.path = target.substr(0, queryStart);
+      if (queryStart != std::string_view::npos) {
+        request.query = target.substr(queryStart + 1);
+      }
+
+      bool hasLength = false;
+      while (lineEnd != std::string_view::npos && lineEnd + 2 < head.size()) {
+        size_t start = lineEnd + 2;
+        lineEnd = head.find("\r\n", start);
+        line = head.substr(start, lineEnd == std::string_view::npos ? lineEnd : lineEnd - start);
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos) {
+          throw BadRequest("Malformed header");
+        }
+        std::string name = lowerCase(trim(line.substr(0, colon)));
+        std::string_view rawValue = trim(line.substr(colon + 1));
+        std::string value = lowerCase(rawValue);
+        if (name == "content-length") {
+          if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+            throw BadRequest("Malformed Content-Length");
+          }
+          request.contentLength = std::stoull(value);
+          hasLength = true;
+        } else if (name == "transfer-encoding") {
+          if (!value.ends_with("chunked")) {
+            throw BadRequest("Unsupported Transfer-Encoding");
+          }
+          request.chunked = true;
+        } else if (name == "connection") {
+          if (value.find("close") != std::string::npos) {
+            request.keepAlive = false;
+          } else if (value.find("keep-alive") != std::string::npos) {
+            request.keepAlive = true;
+          }
+        } else if (name == "expect") {
+          request.expectContinue = value == "100-continue";
+        } else if (name == "upgrade") {
+          request.upgradeWebSocket = value == "websocket";
+        } else if (name == "sec-websocket-key") {
+          // base64, so case matters
+          request.webSocketKey = rawValue;
+        }
+      }
+      if (request.chunked && hasLength) {
+        throw BadRequest("Both Content-Length and chunked Transfer-Encoding");
+      }
+      return request;
+    }
+
+    // Value of name in a query string, or "" when it isn't there
+    std::string queryValue(std::string_view query, std::string_view name) {
+      while (!query.empty()) {
+        size_t end = query.find('&');
+        std::string_view param = query.substr(0, end);
+        if (param.starts_with(name) && param.size() > name.size() && param[name.size()] == '=') {
+          return std::string(param.substr(name.size() + 1));
+        }
+        if (end == std::string_view::npos) {
+          break;
+        }
+        query.remove_prefix(end + 1);
+      }
+      return "";
+    }
+
+    // Pulls a request body out of the connection's input, with either a
+    // Content-Length or chunked framing, as much as has arrived
+    class BodyDecoder {
+     public:
+      void reset(const Request& request) {
+        if (request.chunked) {
+          state = State::ChunkSize;
+        } else {
+          remaining = request.contentLength;
+          state = remaining > 0 ? State::Data : State::Done;
+        }
+      }
+
+      bool done() const { return state == State::Done; }
+
+      // Returns how many bytes of data were used up, calling out with the
+      // body bytes among them
+      size_t feed(std::string_view data, const std::function<void(std::string_view)>& out) {
+        size_t used = 0;
+        while (used < data.size() && state != State::Done) {
+          std::string_view rest = data.substr(used);
+          if (state == State::Data || state == State::ChunkData) {
+            size_t length = std::min<uint64_t>(remaining, rest.size());
+            out(rest.substr(0, length));
+            used += length;
+            remaining -= length;
+            if (remaining == 0) {
+              state = state == State::Data ? State::Done : State::ChunkDataEnd;
+            }
+            continue;
+          }
+
+          // Everything else is line based
+          size_t lineEnd = rest.find("\r\n");
+          if (lineEnd == std::string_view::npos) {
+            if (rest.size() > maxHeaderBytes) {
+              throw BadRequest("Chunk framing line too long");
+            }
+            break;
+          }
+          std::string_view line = rest.substr(0, lineEnd);
+          used += lineEnd + 2;
+          if (state == State::ChunkSize) {
+            // Chunk extensions after ';' are allowed and ignored
+            std::string size(trim(line.substr(0, line.find(';'))));
+            if (size.empty() || size.size() > 15 ||
+                size.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+              throw BadRequest("Malformed chunk size");
+            }
+            remaining = std::stoull(size, nullptr, 16);
+            state = remaining > 0 ? State::ChunkData : State::Trailers;
+          } else if (state == State::ChunkDataEnd) {
+            if (!line.empty()) {
+              throw BadRequest("Missing CRLF after chunk");
+            }
+            state = State::ChunkSize;
+          } else if (state == State::Trailers && line.empty()) {
+            state = State::Done;
+          }
+        }
+        return used;
+      }
+
+     private:
+      enum class State { Data, ChunkSize, ChunkData, ChunkDataEnd, Trailers, Done };
+      State state = State::Done;
+      uint64_t remaining = 0;
+    };
+
+    // Hands a connection the outcome of a job it waited on (see
+    // MemoryCache) from whichever thread ran that job, and wakes the
+    // connection's event loop through an eventfd
+    class Mailbox {
+     public:
+      struct Letter {
+        int connectionFd = -1;
+        // Tells a connection from a later one that got the same fd
+        uint64_t serial = 0;
+        std::shared_ptr<const MemoryCache::Flight> flight;
+      };
+
+      Mailbox() : fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        if (fd < 0) {
+          throw std::runtime_error(std::string("Can't create eventfd: ") + strerror(errno));
+        }
+      }
+      ~Mailbox() { close(fd); }
+
+      void post(Letter letter) {
+        {
+          std::lock_guard lock(mutex);
+          letters.push_back(std::move(letter));
+        }
+        uint64_t one = 1;
+        write(fd, &one, sizeof(one));
+      }
+
+      std::vector<Letter> take() {
+        uint64_t count;
+        read(fd, &count, sizeof(count));
+        std::lock_guard lock(mutex);
+        return std::exchange(letters, {});
+      }
+
+      const int fd;
+
+     private:
+      std::mutex mutex;
+      std::vector<Letter> letters;
+    };
+
+    std::atomic<uint64_t> nextSerial = 0;
+
+    class Connection {
+     public:
+      Connection(int _fd, const Options& options, std::shared_ptr<Mailbox> _mailbox)
+          : fd(_fd),
+            serial(++nextSerial),
+            maxTimeoutMs(options.timeoutMs),
+            limits(options.limits),
+            // Room for a whole header block, whatever was asked for
+            inputHighWater(std::max(options.inputHighWater, maxHeaderBytes + 1)),
+            outputHighWater(std::max<size_t>(options.outputHighWater, 1)),
+            mailbox(std::move(_mailbox)) {
+        ++metrics.openConnections;
+      }
+      Connection(const Connection&) = delete;
+      Connection& operator=(const Connection&) = delete;
+
+      ~Connection() {
+        // The job's output sink points back at this connection. Destroying
+        // the suspended coroutine frees its libpng structs and buffers now
+        if (job) {
+          ++metrics.jobsCancelled;
+          job.destroy();
+        }
+        // Whoever waited on the job runs it themselves
+        endFlight(0, "");
+        close(fd);
+        --metrics.openConnections;
+      }
+
+      // Both return false once the connection should be closed
+      bool onReadable() {
+        char buffer[readChunkBytes];
+        // A few reads at most, then let the other connections have a turn
+        for (int i = 0; i < 4 && !peerClosed && !closing; ++i) {
+          size_t room = inputHighWater - std::min(inputHighWater, pendingInput());
+          if (room == 0) {
+            break;
+          }
+          ssize_t numRead = recv(fd, buffer, std::min(room, sizeof(buffer)), 0);
+          if (numRead > 0) {
+            in.append(buffer, numRead);
+            if ((size_t)numRead < std::min(room, sizeof(buffer))) {
+              break;
+            }
+          } else if (numRead == 0) {
+            peerClosed = true;
+          } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+          } else if (errno != EINTR) {
+            return false;
+          }
+        }
+
+        if (!service()) {
+          return false;
+        }
+        if (peerClosed) {
+          // Whatever was asked for in full still gets its answer
+          if ((inRequest && !body.done()) || inMessage) {
+            return false;
+          }
+          closing = true;
+        }
+        return !(closing && out.empty());
+      }
+
+      bool onWritable() {
+        return service() && !(closing && out.empty());
+      }
+
+      // Once the server is shutting down: whatever request or message is in
+      // progress gets its answer, then the connection closes. An idle HTTP
+      // connection gets drainGraceMs more, closing it right away would race
+      // with a request the client may be sending. False if it can close
+      // right away
+      bool drain(CancelToken::Clock::time_point now) {
+        keepAlive = false;
+        drainingSince = now;
+        if (webSocket && !inMessage && !job && !waiting) {
+          closeWebSocket(WebSocket::GoingAway, "Server shutting down");
+        }
+        return onWritable();
+      }
+
+      // The job this connection waited on finished, on this thread or
+      // another. False once the connection should be closed
+      bool onFlightDone(uint64_t letterSerial, const MemoryCache::Flight& done) {
+        if (letterSerial != serial || !waiting) {
+          return true;
+        }
+        waiting = false;
+        if (done.png) {
+          respondPng(*done.png, "coalesced");
+        } else if (done.status != 0) {
+          respond(done.status, done.status == 413 ? "Content Too Large" : "Unprocessable Entity",
+              done.error + "\n");
+        } else {
+          lookUpCache(true);
+        }
+        return onWritable();
+      }
+
+      // Called every deadlineTickMs, false once the connection should be
+      // closed. A job past its deadline is resumed so that it finds out and
+      // unwinds itself, wherever it was waiting
+      bool onTick(CancelToken::Clock::time_point now) {
+        if (drainingSince && !webSocket && !inRequest && inPos == in.size() &&
+            now - *drainingSince >= std::chrono::milliseconds(drainGraceMs)) {
+          closing = true;
+          return onWritable();
+        }
+        if (!job || job.done() || cancel->getDeadline() > now) {
+          return true;
+        }
+        jobStarted = true;
+        job();
+        if (job.done()) {
+          finishJob();
+        }
+        return onWritable();
+      }
+
+      // Reading stops while either side is past its high-water mark, the
+      // peer's TCP window does the rest
+      uint32_t wantedEvents() const {
+        uint32_t events = outPos < out.size() ? EPOLLOUT : 0;
+        if (!peerClosed && !closing && !outputFull() && pendingInput() < inputHighWater) {
+          events |= EPOLLIN | EPOLLRDHUP;
+        }
+        return events;
+      }
+
+      const int fd;
+      const uint64_t serial;
+      uint32_t events = 0;
+
+     private:
+      // Processes what has been read and sends what it can, and again as
+      // long as sending made room for more of the answer
+      bool service() {
+        while (true) {
+          process();
+          bool wasFull = outputFull();
+          if (!flush()) {
+            return false;
+          }
+          if (!wasFull || outputFull() || closing) {
+            return true;
+          }
+        }
+      }
+
+      bool flush() {
+        while (outPos < out.size()) {
+          ssize_t numSent = send(fd, out.data() + outPos, out.size() - outPos, MSG_NOSIGNAL);
+          if (numSent > 0) {
+            outPos += numSent;
+          } else if (numSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+          } else if (numSent < 0 && errno == EINTR) {
+            continue;
+          } else {
+            return false;
+          }
+        }
+        if (outPos == out.size()) {
+          out.clear();
+          outPos = 0;
+        } else if (outPos > readChunkBytes) {
+          out.erase(0, outPos);
+          outPos = 0;
+        }
+        return true;
+      }
+
+      bool outputFull() const { return out.size() - outPos >= outputHighWater; }
+
+      // Read but not yet decoded, queued body included
+      size_t pendingInput() const {
+        return in.size() - inPos + (queue ? queue->bytes : 0);
+      }
+
+      // How much more body the job may be handed now. Body nobody is
+      // waiting for is dropped as it's parsed, so that's unlimited
+      size_t bodyRoom() const {
+        if (!queue || !job || job.done()) {
+          return std::string::npos;
+        }
+        return inputHighWater - std::min(inputHighWater, queue->bytes);
+      }
+
+      // Queued in pieces, so one resume decodes (and answers) a bounded
+      // amount and the output high-water mark holds within a piece
+      void feedJob(std::string_view data) {
+        if (!job || job.done()) {
+          return;
+        }
+        for (size_t pos = 0; pos < data.size(); pos += pieceBytes) {
+          queue->push(std::as_bytes(std::span(data.substr(pos, pieceBytes))));
+        }
+      }
+
+      void process() {
+        try {
+          if (!webSocket) {
+            processRequests();
+          }
+          if (webSocket) {
+            processFrames();
+          }
+        } catch (const BadRequest& e) {
+          if (!responseStarted) {
+            keepAlive = false;
+            respond(400, "Bad Request", std::string(e.what()) + "\n");
+          }
+          closing = true;
+        } catch (const WebSocket::ProtocolError& e) {
+          closeWebSocket(e.code, e.what());
+        }
+
+        // Drop what has been parsed, now and then rather than every time
+        if (inPos == in.size()) {
+          in.clear();
+          inPos = 0;
+        } else if (inPos > readChunkBytes) {
+          in.erase(0, inPos);
+          inPos = 0;
+        }
+      }
+
+      // Works through whatever HTTP input has arrived: headers, body, and
+      // any pipelined requests after it, one request at a time
+      void processRequests() {
+        while (!closing && !webSocket && !outputFull()) {
+          if (!inRequest && !startRequest()) {
+            break;
+          }
+          if (holdBody && !startCachedRequest()) {
+            break;
+          }
+          size_t used = body.feed(std::string_view(in).substr(inPos, bodyRoom()),
+              [this](std::string_view data) { feedJob(data); });
+          inPos += used;
+          if (body.done() && queue) {
+            queue->closed = true;
+          }
+          pump();
+          if (!body.done() || !responseDone) {
+            break;
+          }
+          endRequest();
+        }
+      }
+
+      // After an upgrade every binary message is a png, its fragments go to
+      // the job as they arrive and the answer goes back as one message
+      void processFrames() {
+        if (outputFull()) {
+          return;
+        }
+        std::span<char> data(in.data() + inPos, std::min(in.size() - inPos, bodyRoom()));
+        inPos += frames.feed(data, [this](const WebSocket::Frame& frame, std::string_view payload,
+            uint64_t offset) {
+          if (frame.opcode >= WebSocket::Close) {
+            onControl(frame.opcode, payload);
+            return !closing;
+          }
+          bool frameEnd = offset + payload.size() == frame.length;
+          if (offset == 0 && (frame.opcode == WebSocket::Continuation) != inMessage) {
+            throw WebSocket::ProtocolError(WebSocket::ProtocolErrorCode,
+                "Unexpected frame in message sequence");
+          }
+          if (offset == 0 && !inMessage) {
+            if (frame.opcode != WebSocket::Binary) {
+              throw WebSocket::ProtocolError(WebSocket::UnsupportedData,
+                  "Send pngs as binary messages");
+            }
+            inMessage = true;
+            startJob(sampleRate);
+          }
+          feedJob(payload);
+          if (frameEnd && frame.fin) {
+            inMessage = false;
+            queue->closed = true;
+          }
+          pump();
+          if (!inMessage && responseDone) {
+            endRequest();
+          }
+          return !closing && !outputFull();
+        });
+      }
+
+      void onControl(WebSocket::Opcode opcode, std::string_view payload) {
+        if (opcode == WebSocket::Ping) {
+          // Allowed in between the fragments of an answer
+          WebSocket::appendFrame(out, WebSocket::Pong, payload);
+        } else if (opcode == WebSocket::Close) {
+          // Echo the status code back, then hang up
+          if (!closing) {
+            WebSocket::appendFrame(out, WebSocket::Close, payload.substr(0, 2));
+          }
+          closing = true;
+        }
+      }
+
+      void closeWebSocket(WebSocket::CloseCode code, const std::string& reason) {
+        if (!closing) {
+          WebSocket::appendClose(out, code, reason);
+        }
+        closing = true;
+      }
+
+      // Parses the next request's headers once they have all arrived, and
+      // starts on its answer. Returns false while they're incomplete
+      bool startRequest() {
+        size_t headEnd = in.find("\r\n\r\n", inPos);
+        if (headEnd == std::string::npos) {
+          if (in.size() - inPos > maxHeaderBytes) {
+            throw BadRequest("Request headers too large");
+          }
+          return false;
+        }
+        Request request = parseRequest(std::string_view(in).substr(inPos, headEnd - inPos));
+        inPos = headEnd + 4;
+        inRequest = true;
+        keepAlive = request.keepAlive && !drainingSince;
+        body.reset(request);
+        if (request.expectContinue && !body.done()) {
+          out += "HTTP/1.1 100 Continue\r\n\r\n";
+        }
+
+        if (request.path == "/shrink") {
+          std::string rateText = queryValue(request.query, "rate");
+          int rate = rateText.empty() ? 2 : atoi(rateText.c_str());
+          std::string timeoutText = queryValue(request.query, "timeout");
+          timeoutMs = maxTimeoutMs;
+          if (!timeoutText.empty() && atoi(timeoutText.c_str()) > 0) {
+            unsigned asked = atoi(timeoutText.c_str());
+            timeoutMs = maxTimeoutMs > 0 ? std::min(asked, maxTimeoutMs) : asked;
+          }
+          if (rate <= 0) {
+            respond(400, "Bad Request", "Sample rate must be greater than 0\n");
+          } else if (request.upgradeWebSocket && request.method == "GET") {
+            acceptWebSocket(request, rate);
+          } else if (request.method != "POST") {
+            respond(405, "Method Not Allowed", "POST a png to /shrink\n");
+          } else if (cache && !request.chunked && request.contentLength <= inputHighWater) {
+            // Small enough to hold whole, see startCachedRequest
+            holdBody = true;
+            heldLength = request.contentLength;
+            cacheKey.sampleRate = rate;
+          } else {
+            startJob(rate);
+          }
+        } else if (request.path == "/health") {
+          respond(200, "OK", "ok\n");
+        } else if (request.path == "/metrics") {
+          respond(200, "OK", metrics.text());
+        } else if (request.path == "/debug/trace") {
+          if constexpr (Trace::compiledIn()) {
+            respond(200, "OK", Trace::json(), "application/json");
+          } else {
+            respond(404, "Not Found", "Not found\n");
+          }
+        } else {
+          respond(404, "Not Found", "Not found\n");
+        }
+        return true;
+      }
+
+      // Once the whole body is in, hashes it and answers from the cache,
+      // waits for a job already making the same answer, or runs the job
+      // and fills the cache. False while more body is to come
+      bool startCachedRequest() {
+        std::string_view data = std::string_view(in).substr(inPos, heldLength);
+        if (data.size() < heldLength) {
+          return false;
+        }
+        holdBody = false;
+        cacheKey.inputHash = cache->inputHash(data.data(), data.size());
+        cacheKey.inputBytes = data.size();
+        heldBody = data;
+        lookUpCache(false);
+        return true;
+      }
+
+      // bodyConsumed when heldBody is all that's left of the body, after a
+      // wait for a job that gave up
+      void lookUpCache(bool bodyConsumed) {
+        auto lookup = cache->lookup(cacheKey,
+            [mailbox = mailbox, fd = fd, serial = serial](auto done) {
+              mailbox->post({fd, serial, std::move(done)});
+            });
+        if (lookup.png) {
+          respondPng(*lookup.png, "hit");
+        } else if (lookup.lead) {
+          flight = std::move(lookup.lead);
+          capturing = true;
+          cacheResult = "miss";
+          startJob(cacheKey.sampleRate);
+          if (bodyConsumed) {
+            feedJob(heldBody);
+            queue->closed = true;
+            pump();
+          }
+        } else {
+          waiting = true;
+          return;
+        }
+        heldBody.clear();
+      }
+
+      // Hands the job's outcome to whoever waited on it, and caches the
+      // answer if it was a 200. Status 0 tells them to retry
+      void endFlight(int status, const std::string& error) {
+        if (!flight) {
+          return;
+        }
+        if (status == 200 && capturing) {
+          flight->png = std::make_shared<const std::string>(std::move(capture));
+        } else if (status != 200) {
+          flight->status = status;
+          flight->error = error;
+        }
+        cache->finish(cacheKey, std::move(flight));
+        flight = nullptr;
+        capturing = false;
+        capture.clear();
+      }
+
+      void acceptWebSocket(const Request& request, unsigned rate) {
+        if (request.webSocketKey.empty()) {
+          respond(400, "Bad Request", "Missing Sec-WebSocket-Key\n");
+          return;
+        }
+        out += "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: " + WebSocket::acceptKey(request.webSocketKey) + "\r\n\r\n";
+        keepAlive = true;
+        responseDone = true;
+        webSocket = true;
+        sampleRate = rate;
+      }
+
+      void startJob(unsigned rate) {
+        queue = std::make_shared<ChunkQueue>();
+        auto sink = std::make_shared<OutputSink>([this](std::span<const png_byte> data) {
+          appendChunk(data);
+        });
+        OutputSpec output{.sampleRate = rate, .sink = std::move(sink)};
+        cancel = std::make_unique<CancelToken>();
+        if (timeoutMs > 0) {
+          cancel->setDeadline(CancelToken::Clock::now() + std::chrono::milliseconds(timeoutMs));
+        }
+        ShrinkSpec spec{{output}};
+        spec.cancel = cancel.get();
+        spec.limits = limits;
+        job = coPng(ChunkReader(queue), std::move(spec)).handle;
+        jobStarted = false;
+        ++metrics.jobsStarted;
+      }
+
+      // Runs the job as far as the body that has arrived lets it. A job
+      // others wait on runs regardless of how fast its client reads, or one
+      // client that stops reading would hold them all up. Its answer is
+      // bounded by what the cache keeps, see appendChunk
+      void pump() {
+        while (job && !job.done() && (!jobStarted || queue->ready()) &&
+            (capturing || !outputFull())) {
+          jobStarted = true;
+          job(); // same as resume()
+        }
+        if (job && job.done()) {
+          finishJob();
+        }
+      }
+
+      void finishJob() {
+        std::exception_ptr exception = job.promise().exception;
+        job.destroy();
+        job = nullptr;
+        cancel = nullptr;
+        responseDone = true;
+        if (!exception) {
+          ++metrics.jobsSucceeded;
+          if (webSocket) {
+            WebSocket::appendFrameHeader(out,
+                responseStarted ? WebSocket::Continuation : WebSocket::Binary, true, 0);
+          } else {
+            appendChunk({});
+            out += "0\r\n\r\n";
+          }
+          endFlight(200, "");
+          return;
+        }
+
+        std::string error;
+        bool timedOut = false;
+        bool overLimit = false;
+        try {
+          std::rethrow_exception(exception);
+        } catch (const JobCancelled& e) {
+          error = e.what();
+          timedOut = e.timedOut;
+        } catch (const LimitExceeded& e) {
+          error = e.what();
+          overLimit = true;
+          ++metrics.jobsOverLimit[(int)e.reason];
+        } catch (const std::exception& e) {
+          error = e.what();
+        }
+        if (overLimit && !webSocket && !body.done()) {
+          // Same as a timeout, the rest of the body isn't worth reading
+          keepAlive = false;
+          closing = true;
+        }
+        if (timedOut) {
+          ++metrics.jobsTimedOut;
+          if (!webSocket && !body.done()) {
+            // The rest of the body isn't worth waiting for
+            keepAlive = false;
+            closing = true;
+          }
+        } else {
+          ++metrics.jobsFailed;
+        }
+        // A timeout was this request's own, the input may still be fine
+        endFlight(timedOut ? 0 : overLimit ? 413 : 422, error);
+        if (timedOut && !webSocket && !responseStarted) {
+          respond(503, "Service Unavailable", error + "\n");
+        } else if (overLimit && !webSocket && !responseStarted) {
+          respond(413, "Content Too Large", error + "\n");
+        } else if (webSocket && !responseStarted) {
+          // Answered with a text message instead of a binary one
+          WebSocket::appendFrame(out, WebSocket::Text, error);
+        } else if (webSocket) {
+          closeWebSocket(WebSocket::InvalidPayload, error);
+        } else if (!responseStarted) {
+          respond(422, "Unprocessable Entity", error + "\n");
+        } else {
+          // Too late for an error status, cutting the chunked response
+          // short is the only way left to tell the client
+          closing = true;
+        }
+      }
+
+      // Sends the headers with the first piece, then each piece as a chunk.
+      // On a WebSocket each piece is a fragment of one binary message
+      void appendChunk(std::span<const png_byte> data) {
+        if (webSocket) {
+          if (!data.empty()) {
+            WebSocket::appendFrameHeader(out,
+                responseStarted ? WebSocket::Continuation : WebSocket::Binary, false, data.size());
+            out.append((const char*)data.data(), data.size());
+            responseStarted = true;
+          }
+          return;
+        }
+        if (capturing) {
+          if (capture.size() + data.size() > cache->maxEntryBytes()) {
+            // Too big to keep, waiters run it themselves rather than wait
+            // for a job that is paced by this client from here on
+            capturing = false;
+            capture = {};
+            endFlight(0, "");
+          } else {
+            capture.append((const char*)data.data(), data.size());
+          }
+        }
+        if (!responseStarted) {
+          responseStarted = true;
+          out += "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\nTransfer-Encoding: chunked\r\n";
+          if (cacheResult) {
+            out += std::string("X-Cache: ") + cacheResult + "\r\n";
+          }
+          out += keepAlive ? "\r\n" : "Connection: close\r\n\r\n";
+        }
+        if (data.empty()) {
+          return;
+        }
+        char size[20];
+        snprintf(size, sizeof(size), "%zx\r\n", data.size());
+        out += size;
+        out.append((const char*)data.data(), data.size());
+        out += "\r\n";
+      }
+
+      void respondPng(const std::string& png, const char* result) {
+        responseStarted = true;
+        responseDone = true;
+        out += "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\nContent-Length: " +
+            std::to_string(png.size()) + "\r\nX-Cache: " + result + "\r\n";
+        out += keepAlive ? "\r\n" : "Connection: close\r\n\r\n";
+        out += png;
+      }
+
+      void respond(int status, const std::string& reason, const std::string& text,
+          const char* contentType = "text/plain") {
+        responseStarted = true;
+        responseDone = true;
+        out += "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\nContent-Type: " +
+            contentType + "\r\nContent-Length: " + std::to_string(text.size()) + "\r\n";
+        out += keepAlive ? "\r\n" : "Connection: close\r\n\r\n";
+        out += text;
+      }
+
+      void endRequest() {
+        if (!keepAlive && webSocket) {
+          closeWebSocket(WebSocket::GoingAway, "Server shutting down");
+        } else if (!keepAlive) {
+          closing = true;
+        }
+        inRequest = false;
+        responseStarted = false;
+        responseDone = false;
+        queue = nullptr;
+        cacheResult = nullptr;
+        heldBody.clear();
+      }
+
+      std::string in;
+      size_t inPos = 0;
+      std::string out;
+      size_t outPos = 0;
+      bool peerClosed = false;
+      // Stop reading, close once out is sent
+      bool closing = false;
+      // Set once the server shuts down, see drain
+      std::optional<CancelToken::Clock::time_point> drainingSince;
+
+      // The request being answered
+      bool inRequest = false;
+      bool keepAlive = true;
+      BodyDecoder body;
+      bool responseStarted = false;
+      bool responseDone = false;
+      std::shared_ptr<ChunkQueue> queue;
+      std::coroutine_handle<ReturnObj::promise_type> job;
+      bool jobStarted = false;
+      std::unique_ptr<CancelToken> cancel;
+      unsigned timeoutMs = 0;
+      const unsigned maxTimeoutMs;
+      const InputLimits limits;
+
+      const size_t inputHighWater;
+      const size_t outputHighWater;
+
+      // A cacheable request, see startCachedRequest
+      const std::shared_ptr<Mailbox> mailbox;
+      bool holdBody = false;
+      size_t heldLength = 0;
+      MemoryCache::Key cacheKey;
+      // Kept while waiting, in case the job waited on gives up and this
+      // request has to run it after all
+      std::string heldBody;
+      bool waiting = false;
+      // Set while this connection's job makes a cache entry
+      std::shared_ptr<MemoryCache::Flight> flight;
+      bool capturing = false;
+      std::string capture;
+      const char* cacheResult = nullptr;
+
+      // After an upgrade, in place of requests
+      bool webSocket = false;
+      unsigned sampleRate = 2;
+      WebSocket::FrameDecoder frames;
+      bool inMessage = false;
+    };
+
+    int listenOn(const Options& options) {
+      int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd < 0) {
+        throw std::runtime_error(std::string("Can't create socket: ") + strerror(errno));
+      }
+      int on = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      // Every event loop gets its own listening socket, the kernel spreads
+      // new connections over them
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+      sockaddr_in address{};
+      address.sin_family = AF_INET;
+      address.sin_port = htons(options.port);
+      if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1) {
+        close(fd);
+        throw std::runtime_error("Can't parse address " + options.host);
+      }
+      if (bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        int savedErrno = errno;
+        close(fd);
+        throw std::runtime_error("Can't listen on " + options.host + ":" +
+            std::to_string(options.port) + ": " + strerror(savedErrno));
+      }
+      return fd;
+    }
+
+    void updateEvents(int epollFd, Connection& connection) {
+      uint32_t wanted = connection.wantedEvents();
+      if (wanted != connection.events) {
+        connection.events = wanted;
+        epoll_event event{.events = wanted, .data = {.fd = connection.fd}};
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event);
+      }
+    }
+
+    // One thread's share of the server: its own listening sockets, epoll
+    // set and connections, which never move to another thread. Returns
+    // once the server is draining and its last connection has closed
+    void runLoop(std::vector<int> listenFds) {
+      int epollFd = epoll_create1(EPOLL_CLOEXEC);
+      if (epollFd < 0) {
+        throw std::runtime_error(std::string("Can't create epoll: ") + strerror(errno));
+      }
+      for (int listenFd : listenFds) {
+        epoll_event listenEvent{.events = EPOLLIN, .data = {.fd = listenFd}};
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent);
+      }
+      auto mailbox = std::make_shared<Mailbox>();
+      epoll_event mailboxEvent{.events = EPOLLIN, .data = {.fd = mailbox->fd}};
+      epoll_ctl(epollFd, EPOLL_CTL_ADD, mailbox->fd, &mailboxEvent);
+      std::unordered_map<int, std::unique_ptr<Connection>> connections;
+
+      epoll_event events[maxEvents];
+      auto nextTick = CancelToken::Clock::now();
+      while (true) {
+        auto now = CancelToken::Clock::now();
+        if (now >= nextTick) {
+          nextTick = now + std::chrono::milliseconds(deadlineTickMs);
+          bool startDraining = draining && !listenFds.empty();
+          if (startDraining) {
+            // Whoever took over the sockets (if anyone) accepts from here on
+            for (int listenFd : listenFds) {
+              epoll_ctl(epollFd, EPOLL_CTL_DEL, listenFd, nullptr);
+              close(listenFd);
+            }
+            listenFds.clear();
+          }
+          for (auto connection = connections.begin(); connection != connections.end();) {
+            if ((startDraining && !connection->second->drain(now)) ||
+                !connection->second->onTick(now)) {
+              epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->first, nullptr);
+              connection = connections.erase(connection);
+              continue;
+            }
+            updateEvents(epollFd, *connection->second);
+            ++connection;
+          }
+          if (draining && connections.empty()) {
+            close(epollFd);
+            return;
+          }
+        }
+
+        int numEvents = epoll_wait(epollFd, events, maxEvents, deadlineTickMs);
+        if (numEvents < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          throw std::runtime_error(std::string("epoll_wait failed: ") + strerror(errno));
+        }
+
+        for (int i = 0; i < numEvents; ++i) {
+          int fd = events[i].data.fd;
+          if (std::find(listenFds.begin(), listenFds.end(), fd) != listenFds.end()) {
+            // Settings as of now, a reload applies to connections after it
+            std::shared_ptr<const Options> options = currentOptions.load();
+            int clientFd;
+            while ((clientFd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+              int on = 1;
+              setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+              auto connection = std::make_unique<Connection>(clientFd, *options, mailbox);
+              connection->events = connection->wantedEvents();
+              epoll_event event{.events = connection->events, .data = {.fd = clientFd}};
+              epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &event);
+              connections[clientFd] = std::move(connection);
+            }
+            continue;
+          } else if (fd == mailbox->fd) {
+            for (Mailbox::Letter& letter : mailbox->take()) {
+              auto found = connections.find(letter.connectionFd);
+              if (found == connections.end()) {
+                continue;
+              } else if (!found->second->onFlightDone(letter.serial, *letter.flight)) {
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, found->first, nullptr);
+                connections.erase(found);
+                continue;
+              }
+              updateEvents(epollFd, *found->second);
+            }
+            continue;
+          }
+
+          auto found = connections.find(fd);
+          if (found == connections.end()) {
+            continue;
+          }
+          Connection& connection = *found->second;
+          uint32_t ready = events[i].events;
+          bool keep = !(ready & EPOLLERR);
+          if (keep && (ready & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+            keep = connection.onReadable();
+          }
+          if (keep && (ready & EPOLLOUT)) {
+            keep = connection.onWritable();
+          }
+          if (!keep) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+            connections.erase(found);
+            continue;
+          }
+          updateEvents(epollFd, connection);
+        }
+      }
+    }
+
+    void usage() {
+      std::cout << "Usage: serve [--listen HOST:PORT] [--threads N] [--timeout MS]"
+                   " [--input-buffer KB] [--output-buffer KB] [--cache MB]" << std::endl
+                << "             [--cache-file PATH] [--config FILE] [--max-... N]" << std::endl
+                << "  POST a png to /shrink?rate=N (default 2) to get it back shrunk" << std::endl
+                << "  or open a WebSocket on it and send each png as a binary message" << std::endl
+                << "  --listen HOST:PORT  address to listen on (default 127.0.0.1:8080)" << std::endl
+                << "  --threads N         event loop threads (default: one per core)" << std::endl
+                << "  --timeout MS        longest a job may take (default: no limit)," << std::endl
+                << "                      requests can ask for less with ?timeout=MS" << std::endl
+                << "  --input-buffer KB   unprocessed upload held per connection before" << std::endl
+                << "                      reading pauses (default 256)" << std::endl
+                << "  --output-buffer KB  unsent answer held per connection before" << std::endl
+                << "                      decoding pauses (default 256)" << std::endl
+                << "  --cache MB          shrunk pngs kept in memory for repeated" << std::endl
+                << "                      requests (default 64, 0 for none)" << std::endl
+                << "  --cache-file PATH   saves the memory cache there on shutdown and" << std::endl
+                << "                      handoff, and loads it at startup" << std::endl
+                << "  --config FILE       more of these options, read again on SIGHUP" << std::endl
+                << InputLimits::usage()
+                << "                      (defaults: 268435456 pixels, 8192 KB chunks)" << std::endl
+                << "  SIGHUP reloads --config, SIGUSR2 hands the sockets to a new process" << std::endl
+                << "  and exits once in-flight requests are done, SIGTERM just does the latter" << std::endl;
+    }
+
+    // Applies command line style options to options. False with error set
+    // on anything that isn't one or doesn't parse
+    bool applyArgs(const std::vector<std::string>& args, Options& options, std::string& error) {
+      for (size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        bool hasValue = i + 1 < args.size();
+        const char* value = hasValue ? args[i + 1].c_str() : "";
+        if (arg == "--listen" && hasValue) {
+          std::string listen = args[++i];
+          size_t colon = listen.rfind(':');
+          if (colon == std::string::npos) {
+            error = "--listen needs HOST:PORT";
+            return false;
+          }
+          options.host = listen.substr(0, colon);
+          options.port = (unsigned short)atoi(listen.c_str() + colon + 1);
+        } else if (arg == "--threads" && hasValue) {
+          options.threads = (unsigned)std::max(1, atoi(args[++i].c_str()));
+        } else if (arg == "--timeout" && hasValue) {
+          options.timeoutMs = (unsigned)std::max(0, atoi(args[++i].c_str()));
+        } else if (arg == "--input-buffer" && hasValue) {
+          options.inputHighWater = (size_t)std::max(1, atoi(args[++i].c_str())) * 1024;
+        } else if (arg == "--output-buffer" && hasValue) {
+          options.outputHighWater = (size_t)std::max(1, atoi(args[++i].c_str())) * 1024;
+        } else if (arg == "--cache" && hasValue) {
+          options.cacheBytes = (size_t)std::max(0, atoi(args[++i].c_str())) * 1024 * 1024;
+        } else if (arg == "--cache-file" && hasValue) {
+          options.cacheFile = args[++i];
+        } else if (arg == "--config" && hasValue) {
+          options.configFile = args[++i];
+        } else if (InputLimits::isOption(arg) && hasValue) {
+          ++i;
+          if (!options.limits.parseOption(arg, value)) {
+            error = arg + " needs a number, 0 for no limit";
+            return false;
+          }
+        } else {
+          error = "Unknown option " + arg;
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // The command line over the config file (if it names one) over the
+    // defaults
+    bool loadOptions(const std::vector<std::string>& commandLine, Options& options,
+        std::string& error) {
+      Options fromCommandLine;
+      if (!applyArgs(commandLine, fromCommandLine, error)) {
+        return false;
+      }
+      options = Options();
+      if (!fromCommandLine.configFile.empty()) {
+        std::ifstream file(fromCommandLine.configFile);
+        if (!file) {
+          error = "Can't read " + fromCommandLine.configFile;
+          return false;
+        }
+        std::vector<std::string> words;
+        std::string line;
+        while (std::getline(file, line)) {
+          std::istringstream lineWords(line.substr(0, line.find('#')));
+          std::string word;
+          while (lineWords >> word) {
+            words.push_back(word);
+          }
+        }
+        if (!applyArgs(words, options, error)) {
+          error = fromCommandLine.configFile + ": " + error;
+          return false;
+        }
+      }
+      return applyArgs(commandLine, options, error);
+    }
+
+    // Command line of this process, what a reload and a handoff start from
+    std::vector<std::string> serveArgs;
+
+    void reload() {
+      Options options;
+      std::string error;
+      if (!loadOptions(serveArgs, options, error)) {
+        std::cerr << "Reload failed, keeping the old settings: " << error << std::endl;
+        return;
+      }
+      // Sockets, threads and the cache stay as they are until a restart
+      std::shared_ptr<const Options> old = currentOptions.load();
+      options.host = old->host;
+      options.port = old->port;
+      options.threads = old->threads;
+      options.cacheBytes = old->cacheBytes;
+      options.cacheFile = old->cacheFile;
+      currentOptions = std::make_shared<const Options>(std::move(options));
+      std::cerr << "Reloaded settings" << std::endl;
+    }
+
+    void saveCache(const std::string& cacheFile) {
+      if (!cache || cacheFile.empty()) {
+        return;
+      }
+      try {
+        size_t count = cache->save(cacheFile);
+        std::cerr << "Saved " << count << " cached pngs to " << cacheFile << std::endl;
+      } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+
+    // Listening sockets passed down by the process this one took over
+    // from, see handOff
+    std::vector<int> inheritedListeners() {
+      std::vector<int> fds;
+      const char* list = getenv("PNGSHRINK_LISTEN_FDS");
+      if (!list) {
+        return fds;
+      }
+      std::istringstream fdList(list);
+      std::string item;
+      while (std::getline(fdList, item, ',')) {
+        int fd = atoi(item.c_str());
+        int listening = 0;
+        socklen_t length = sizeof(listening);
+        if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) == 0 && listening) {
+          fcntl(fd, F_SETFD, FD_CLOEXEC);
+          fds.push_back(fd);
+        }
+      }
+      unsetenv("PNGSHRINK_LISTEN_FDS");
+      return fds;
+    }
+
+    // Tells the process that handed over the sockets that this one is
+    // serving, so it can stop
+    void notifyReady() {
+      const char* readyFd = getenv("PNGSHRINK_READY_FD");
+      if (!readyFd) {
+        return;
+      }
+      int fd = atoi(readyFd);
+      char ready = 1;
+      write(fd, &ready, 1);
+      close(fd);
+      unsetenv("PNGSHRINK_READY_FD");
+    }
+
+    // Starts the binary again (as found now, so a new build takes over)
+    // with the listening sockets inherited, and waits for it to serve.
+    // False if it didn't come up, this process keeps serving then
+    bool handOff(const std::vector<int>& listenFds) {
+      int ready[2];
+      if (pipe2(ready, O_CLOEXEC) != 0) {
+        std::cerr << "Can't hand off: " << strerror(errno) << std::endl;
+        return false;
+      }
+      // Everything the child needs is built before the fork, it may only
+      // make async-signal-safe calls until exec
+      std::string fdList;
+      for (int fd : listenFds) {
+        fdList += (fdList.empty() ? "" : ",") + std::to_string(fd);
+      }
+      std::vector<std::string> ownVars = {
+        "PNGSHRINK_LISTEN_FDS=" + fdList, "PNGSHRINK_READY_FD=" + std::to_string(ready[1]),
+      };
+      std::vector<char*> env;
+      for (char** var = environ; *var; ++var) {
+        if (strncmp(*var, "PNGSHRINK_", 10) != 0) {
+          env.push_back(*var);
+        }
+      }
+      for (std::string& var : ownVars) {
+        env.push_back(var.data());
+      }
+      env.push_back(nullptr);
+      std::vector<std::string> argStrings = {program_invocation_name};
+      argStrings.insert(argStrings.end(), serveArgs.begin(), serveArgs.end());
+      argStrings.insert(argStrings.begin() + 1, "serve");
+      std::vector<char*> args;
+      for (std::string& arg : argStrings) {
+        args.push_back(arg.data());
+      }
+      args.push_back(nullptr);
+
+      pid_t pid = fork();
+      if (pid == 0) {
+        for (int fd : listenFds) {
+          fcntl(fd, F_SETFD, 0);
+        }
+        fcntl(ready[1], F_SETFD, 0);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr);
+        execvpe(args[0], args.data(), env.data());
+        _exit(127);
+      }
+      close(ready[1]);
+      bool started = false;
+      if (pid > 0) {
+        pollfd wait{.fd = ready[0], .events = POLLIN};
+        char byte;
+        started = poll(&wait, 1, handoffTimeoutMs) == 1 && read(ready[0], &byte, 1) == 1;
+        if (!started) {
+          kill(pid, SIGKILL);
+          waitpid(pid, nullptr, 0);
+        }
+      }
+      close(ready[0]);
+      std::cerr << (started ? "Handed off to pid " + std::to_string(pid) :
+          std::string("Handoff failed, still serving")) << std::endl;
+      return started;
+    }
+  };
+
+  void serve(const Options& options) {
+    unsigned numThreads = options.threads > 0 ? options.threads :
+        std::max(1u, std::thread::hardware_concurrency());
+    currentOptions = std::make_shared<const Options>(options);
+    if (options.cacheBytes > 0) {
+      cache = std::make_unique<MemoryCache>(options.cacheBytes);
+      if (!options.cacheFile.empty()) {
+        try {
+          size_t count = cache->load(options.cacheFile);
+          std::cerr << "Loaded " << count << " cached pngs from " << options.cacheFile << std::endl;
+        } catch (const std::exception& e) {
+          std::cerr << e.what() << std::endl;
+        }
+      }
+    }
+    // Sockets taken over from the previous process keep their queued
+    // connections, more are added if this one runs more threads. Listening
+    // on all of them up front means a taken port fails right away
+    std::vector<int> listenFds = inheritedListeners();
+    while (listenFds.size() < numThreads) {
+      listenFds.push_back(listenOn(options));
+    }
+    std::vector<std::vector<int>> loopFds(numThreads);
+    for (size_t i = 0; i < listenFds.size(); ++i) {
+      loopFds[i % numThreads].push_back(listenFds[i]);
+    }
+
+    // Only this thread takes these signals, the event loops inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    for (int signal : {SIGHUP, SIGUSR2, SIGTERM, SIGINT}) {
+      sigaddset(&signals, signal);
+    }
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::atomic<unsigned> running = numThreads;
+    bool handedOff = false;
+    std::vector<std::thread> threads;
+    for (std::vector<int>& fds : loopFds) {
+      threads.emplace_back([fds, &running] {
+        try {
+          runLoop(fds);
+        } catch (const std::exception& e) {
+          std::cerr << e.what() << std::endl;
+          exit(-1);
+        }
+        --running;
+      });
+    }
+    notifyReady();
+
+    while (running > 0) {
+      timespec timeout{.tv_sec = 0, .tv_nsec = deadlineTickMs * 1000 * 1000};
+      int signal = sigtimedwait(&signals, nullptr, &timeout);
+      if (signal == SIGHUP) {
+        reload();
+      } else if (signal == SIGUSR2 && !draining) {
+        // Saved first so the new process starts warm
+        saveCache(options.cacheFile);
+        if (handOff(listenFds)) {
+          handedOff = true;
+          draining = true;
+        }
+      } else if ((signal == SIGTERM || signal == SIGINT) && !draining) {
+        std::cerr << "Finishing in-flight requests" << std::endl;
+        draining = true;
+      }
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    if (!handedOff) {
+      saveCache(options.cacheFile);
+    }
+  }
+
+  int serveMain(int argc, char* argv[]) {
+    serveArgs.assign(argv + 1, argv + argc);
+    Options options;
+    std::string error;
+    if (!loadOptions(serveArgs, options, error)) {
+      std::cout << error << std::endl;
+      usage();
+      return -1;
+    }
+    verboseOutput = false;
+    signal(SIGPIPE, SIG_IGN);
+    // A socket per connection, and there may be thousands
+    rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+      files.rlim_cur = files.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    std::cout << "Listening on " << options.host << ":" << options.port << std::endl;
+    serve(options);
+    return 0;
+  }
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+
+#include "inputlimits.h"
+
+// Server mode: a small HTTP/1.1 endpoint that shrinks PNGs posted to it.
+// The request body is fed into the decoder as it arrives and the shrunk
+// png streams back with chunked transfer encoding as rows come out, so a
+// thumbnail costs one decode and no process spawn. Connections are kept
+// alive and may pipeline requests
+namespace Server {
+  struct Options {
+    std::string host = "127.0.0.1";
+    unsigned short port = 8080;
+    // Event loop threads, each accepts and serves its own connections
+    unsigned threads = 0;
+    // Per connection high-water marks. Past inputHighWater bytes of
+    // unprocessed upload the socket isn't read, and past outputHighWater
+    // bytes of unsent answer the job isn't resumed (nor the socket read),
+    // so a slow peer on either side stalls its own connection instead of
+    // growing our buffers
+    size_t inputHighWater = 256 * 1024;
+    size_t outputHighWater = 256 * 1024;
+    // Longest a job may take from its request's headers to its last byte,
+    // 0 for no limit. A request may ask for less with ?timeout=MS
+    unsigned timeoutMs = 0;
+    // Uploads over these are refused with 413 (see inputlimits.h)
+    InputLimits limits = InputLimits::forServers();
+    // Budget for shrunk pngs kept in memory, 0 for none. Requests whose
+    // body fits inputHighWater are answered from there when they can, and
+    // identical ones in flight at the same time share one job
+    size_t cacheBytes = 64 * 1024 * 1024;
+    // Where the memory cache is saved on shutdown and handoff, and loaded
+    // from at startup
+    std::string cacheFile;
+    // More options, in command line form, under the command line's own.
+    // Read again on SIGHUP, which applies to connections accepted after it
+    // (all but the listening address, threads and cache)
+    std::string configFile;
+  };
+
+  // Runs until SIGTERM or SIGINT, or a handoff on SIGUSR2 (see serveMain),
+  // and the requests in flight then are answered
+  void serve(const Options& options);
+
+  // Entry point for `pngshrink serve ...`, argv[0] is "serve". On SIGUSR2
+  // it starts the binary again with the same arguments, handing over the
+  // listening sockets, and waits until the new process is serving. Then it
+  // stops accepting, answers what it had in flight and exits. Nothing
+  // queued to connect is lost, and with --cache-file the new process starts
+  // with the old one's cache
+  int serveMain(int argc, char* argv[]);
+};
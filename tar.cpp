@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include "tar.h"
+
+namespace {
+  constexpr size_t blockSize = 512;
+
+  // ustar header layout, all numbers are octal text
+  struct TarHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+  };
+  static_assert(sizeof(TarHeader) == blockSize);
+
+  void writeOctal(char* field, size_t fieldSize, unsigned long long value) {
+    snprintf(field, fieldSize, "%0*llo", (int)fieldSize - 1, value);
+  }
+
+  // Octal text, or big endian binary (GNU) when the top bit is set
+  uint64_t readNumber(const char* field, size_t fieldSize) {
+    uint64_t value = 0;
+    if (field[0] & 0x80) {
+      value = field[0] & 0x7f;
+      for (size_t i = 1; i < fieldSize; ++i) {
+        value = (value << 8) | (unsigned char)field[i];
+      }
+      return value;
+    }
+    for (size_t i = 0; i < fieldSize && field[i] != '\0'; ++i) {
+      if (field[i] >= '0' && field[i] <= '7') {
+        value = (value << 3) | (field[i] - '0');
+      }
+    }
+    return value;
+  }
+
+  // Fields fill their whole width without a terminator when they're full
+  std::string readString(const char* field, size_t fieldSize) {
+    return std::string(field, strnlen(field, fieldSize));
+  }
+
+  uint64_t paddingFor(uint64_t size) {
+    return (blockSize - size % blockSize) % blockSize;
+  }
+};
+
+TarWriter::TarWriter(const std::string& archiveFile) {
+  out = fopen(archiveFile.c_str(), "wb");
+  if (out == nullptr) {
+    throw std::runtime_error("Can't open archive " + archiveFile + " to write");
+  }
+}
+
+TarWriter::~TarWriter() {
+  if (out) {
+    fclose(out);
+  }
+}
+
+void TarWriter::writeAll(const void* data, size_t size) {
+  if (fwrite(data, 1, size, out) != size) {
+    throw std::runtime_error("There was an error writing the archive");
+  }
+}
+
+void TarWriter::add(const std::string& name, std::span<const unsigned char> data) {
+  TarHeader header;
+  memset(&header, 0, sizeof(header));
+
+  if (name.size() <= sizeof(header.name)) {
+    memcpy(header.name, name.data(), name.size());
+  } else {
+    // Split at a slash so the tail fits in name and the head in prefix
+    size_t split = name.rfind('/', sizeof(header.prefix));
+    if (split == std::string::npos || name.size() - split - 1 > sizeof(header.name)) {
+      throw std::runtime_error("Name too long for a tar archive: " + name);
+    }
+    memcpy(header.prefix, name.data(), split);
+    memcpy(header.name, name.data() + split + 1, name.size() - split - 1);
+  }
+
+  writeOctal(header.mode, sizeof(header.mode), 0644);
+  writeOctal(header.uid, sizeof(header.uid), 0);
+  writeOctal(header.gid, sizeof(header.gid), 0);
+  writeOctal(header.size, sizeof(header.size), data.size());
+  writeOctal(header.mtime, sizeof(header.mtime), (unsigned long long)time(nullptr));
+  header.typeflag = '0';
+  memcpy(header.magic, "ustar", 6);
+  memcpy(header.version, "00", 2);
+
+  // The checksum is computed with its own field set to spaces
+  memset(header.checksum, ' ', sizeof(header.checksum));
+  unsigned checksum = 0;
+  for (size_t i = 0; i < blockSize; ++i) {
+    checksum += ((unsigned char*)&header)[i];
+  }
+  snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+  header.checksum[7] = ' ';
+
+  writeAll(&header, sizeof(header));
+  writeAll(data.data(), data.size());
+  static const char zeros[blockSize] = {};
+  size_t padding = (blockSize - data.size() % blockSize) % blockSize;
+  writeAll(zeros, padding);
+}
+
+void TarWriter::finish() {
+  if (!out) {
+    return;
+  }
+  static const char zeros[2 * blockSize] = {};
+  writeAll(zeros, sizeof(zeros));
+  int result = fclose(out);
+  out = nullptr;
+  if (result != 0) {
+    throw std::runtime_error("There was an error writing the archive");
+  }
+}
+
+
+// Hands the current member's data to an istream, straight into the
+// caller's buffer for bulk reads
+class TarReader::MemberBuf : public std::streambuf {
+ public:
+  explicit MemberBuf(TarReader& _reader) : reader(_reader) {}
+
+ protected:
+  std::streamsize showmanyc() override {
+    if (reader.remaining == 0) {
+      return -1;
+    }
+    return (std::streamsize)std::min<uint64_t>(reader.remaining, INT_MAX);
+  }
+
+  int_type underflow() override {
+    size_t numRead = reader.read(buffer, sizeof(buffer));
+    if (numRead == 0) {
+      return traits_type::eof();
+    }
+    setg(buffer, buffer, buffer + numRead);
+    return traits_type::to_int_type(buffer[0]);
+  }
+
+  std::streamsize xsgetn(char* data, std::streamsize size) override {
+    std::streamsize numCopied = std::min<std::streamsize>(size, egptr() - gptr());
+    memcpy(data, gptr(), numCopied);
+    gbump(numCopied);
+    while (numCopied < size) {
+      size_t numRead = reader.read(data + numCopied, size - numCopied);
+      if (numRead == 0) {
+        break;
+      }
+      numCopied += numRead;
+    }
+    return numCopied;
+  }
+
+ private:
+  TarReader& reader;
+  char buffer[4096];
+};
+
+namespace {
+  struct MemberStream : std::istream {
+    explicit MemberStream(std::unique_ptr<std::streambuf> _buf)
+        : std::istream(_buf.get()), buf(std::move(_buf)) {}
+    std::unique_ptr<std::streambuf> buf;
+  };
+};
+
+void TarReader::readAll(void* data, size_t size) {
+  if (fread(data, 1, size, in) != size) {
+    throw std::runtime_error("Tar archive ended in the middle of a member");
+  }
+}
+
+void TarReader::skip(uint64_t size) {
+  char scratch[64 * 1024];
+  while (size > 0) {
+    size_t chunk = std::min<uint64_t>(size, sizeof(scratch));
+    readAll(scratch, chunk);
+    size -= chunk;
+  }
+}
+
+bool TarReader::next(Member& member) {
+  skip(remaining + padding);
+  remaining = 0;
+  padding = 0;
+
+  std::string longName;
+  while (true) {
+    TarHeader header;
+    size_t numRead = fread(&header, 1, sizeof(header), in);
+    if (numRead == 0 && feof(in)) {
+      // Missing end of archive marker, take it as the end anyway
+      return false;
+    } else if (numRead != sizeof(header)) {
+      throw std::runtime_error("Tar archive ended in the middle of a header");
+    }
+
+    const unsigned char* bytes = (const unsigned char*)&header;
+    if (std::all_of(bytes, bytes + blockSize, [](unsigned char c) { return c == 0; })) {
+      return false;
+    }
+    unsigned checksum = 0;
+    for (size_t i = 0; i < blockSize; ++i) {
+      bool inChecksum = i >= offsetof(TarHeader, checksum) &&
+          i < offsetof(TarHeader, checksum) + sizeof(header.checksum);
+      checksum += inChecksum ? ' ' : bytes[i];
+    }
+    if (checksum != readNumber(header.checksum, sizeof(header.checksum))) {
+      throw std::runtime_error("Not a tar archive, or a corrupt one");
+    }
+
+    uint64_t size = readNumber(header.size, sizeof(header.size));
+    if (header.typeflag == 'L' || header.typeflag == 'x') {
+      // The name of the next member, GNU style or in a pax record
+      std::string data(size, '\0');
+      readAll(data.data(), size);
+      skip(paddingFor(size));
+      if (header.typeflag == 'L') {
+        longName = data.c_str();
+        continue;
+      }
+      // "<length> key=value\n" records
+      for (size_t pos = 0; pos < data.size();) {
+        size_t length = strtoull(data.c_str() + pos, nullptr, 10);
+        size_t space = data.find(' ', pos);
+        if (length == 0 || space == std::string::npos || pos + length > data.size()) {
+          break;
+        }
+        std::string record = data.substr(space + 1, pos + length - space - 2);
+        if (record.starts_with("path=")) {
+          longName = record.substr(5);
+        }
+        pos += length;
+      }
+      continue;
+    } else if (header.typeflag == 'g' || header.typeflag == 'K') {
+      // Global pax headers and long link names don't matter here
+      skip(size + paddingFor(size));
+      continue;
+    }
+
+    if (!longName.empty()) {
+      member.name = longName;
+    } else {
+      std::string prefix = readString(header.prefix, sizeof(header.prefix));
+      std::string name = readString(header.name, sizeof(header.name));
+      member.name = prefix.empty() ? name : prefix + "/" + name;
+    }
+    member.regular = header.typeflag == '0' || header.typeflag == '\0' ||
+        header.typeflag == '7';
+    member.size = size;
+    remaining = size;
+    padding = paddingFor(size);
+    return true;
+  }
+}
+
+size_t TarReader::read(void* data, size_t size) {
+  size = std::min<uint64_t>(size, remaining);
+  if (size == 0) {
+    return 0;
+  }
+  readAll(data, size);
+  remaining -= size;
+  return size;
+}
+
+std::unique_ptr<std::istream> TarReader::memberStream() {
+  return std::make_unique<MemberStream>(std::make_unique<MemberBuf>(*this));
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <istream>
+#include <memory>
+#include <span>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// Writes a ustar archive one member at a time, so many small outputs can go
+// into a single sequential file (or stream) instead of one file each
+class TarWriter {
+ public:
+  // Takes ownership of the file, which is closed by finish or the destructor
+  explicit TarWriter(FILE* _out) : out(_out) {}
+  explicit TarWriter(const std::string& archiveFile);
+  TarWriter(const TarWriter&) = delete;
+  TarWriter& operator=(const TarWriter&) = delete;
+  ~TarWriter();
+
+  // Appends a regular file. Names are split over the ustar prefix field,
+  // anything that still doesn't fit is rejected
+  void add(const std::string& name, std::span<const unsigned char> data);
+
+  // Writes the end of archive marker and closes the file
+  void finish();
+
+ private:
+  void writeAll(const void* data, size_t size);
+
+  FILE* out = nullptr;
+};
+
+// Reads a tar archive (ustar, with GNU long names and pax paths) strictly
+// front to back, so it works on pipes. Member data is read in place rather
+// than extracted anywhere
+class TarReader {
+ public:
+  struct Member {
+    std::string name;
+    uint64_t size = 0;
+    // Directories, links and so on are listed but have no data
+    bool regular = false;
+  };
+
+  // Doesn't take ownership of the file
+  explicit TarReader(FILE* _in) : in(_in) {}
+  TarReader(const TarReader&) = delete;
+  TarReader& operator=(const TarReader&) = delete;
+
+  // Moves on to the next member, skipping whatever wasn't read of the
+  // current one. Returns false at the end of the archive
+  bool next(Member& member);
+
+  // Reads from the current member, returns 0 at its end
+  size_t read(void* data, size_t size);
+
+  // Stream over the current member, only valid until next is called
+  std::unique_ptr<std::istream> memberStream();
+
+ private:
+  class MemberBuf;
+
+  void readAll(void* data, size_t size);
+  void skip(uint64_t size);
+
+  FILE* in;
+  // Data left of the current member, and the padding after it
+  uint64_t remaining = 0;
+  uint64_t padding = 0;
+};
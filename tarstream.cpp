@@ -0,0 +1,122 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <strings.h>
+
+#include "batch.h"
+#include "copng.h"
+#include "tar.h"
+#include "tarstream.h"
+
+namespace TarStream {
+  namespace {
+    // Large stdio buffers, the archives are read and written strictly in order
+    constexpr size_t streamBufferSize = 1024 * 1024;
+
+    bool isPngName(const std::string& name) {
+      return name.size() > 4 && strcasecmp(name.c_str() + name.size() - 4, ".png") == 0;
+    }
+
+    void usage() {
+      std::cerr << "Usage: tar [--rate N[,N...]] [in.tar|-] [out.tar|-]" << std::endl
+                << "  reads stdin and writes stdout when no (or - for) files are given," << std::endl
+                << "  only png members are shrunk, everything else is dropped" << std::endl
+                << "  --rate N[,N...] sample rate(s) (default 2), with several rates each" << std::endl
+                << "                  output goes under <rate>x/ in the output archive" << std::endl;
+    }
+  };
+
+  int tarMain(int argc, char* argv[]) {
+    std::vector<unsigned> rates{2};
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      if (arg == "--rate" && i + 1 < argc) {
+        if (!Batch::parseRates(argv[++i], rates)) {
+          std::cerr << "Sample rate must be greater than 0" << std::endl;
+          return -1;
+        }
+      } else if (arg.starts_with("--") || files.size() == 2) {
+        usage();
+        return -1;
+      } else {
+        files.push_back(arg);
+      }
+    }
+    // stdout may well be the archive, keep it clean
+    verboseOutput = false;
+
+    FILE* in = stdin;
+    if (!files.empty() && files[0] != "-") {
+      in = fopen(files[0].c_str(), "rb");
+      if (in == nullptr) {
+        std::cerr << "Can't open " << files[0] << " to read" << std::endl;
+        return -1;
+      }
+    }
+    setvbuf(in, nullptr, _IOFBF, streamBufferSize);
+    FILE* out = stdout;
+    if (files.size() > 1 && files[1] != "-") {
+      out = fopen(files[1].c_str(), "wb");
+      if (out == nullptr) {
+        std::cerr << "Can't open " << files[1] << " to write" << std::endl;
+        return -1;
+      }
+    }
+    setvbuf(out, nullptr, _IOFBF, streamBufferSize);
+
+    auto start = std::chrono::steady_clock::now();
+    size_t succeeded = 0;
+    size_t failed = 0;
+    int status = 0;
+    TarReader reader(in);
+    TarWriter writer(out);
+    try {
+      TarReader::Member member;
+      while (reader.next(member)) {
+        if (!member.regular || !isPngName(member.name)) {
+          continue;
+        }
+
+        // Outputs stay in memory until the member is done, a failed image
+        // leaves nothing half written in the archive
+        std::vector<OutputSpec> outputs;
+        for (unsigned rate : rates) {
+          std::string name = rates.size() == 1 ? member.name :
+              std::to_string(rate) + "x/" + member.name;
+          outputs.push_back({name, rate, std::make_shared<std::vector<png_byte>>()});
+        }
+        try {
+          runPng(coPng(reader.memberStream(), {}, {outputs}));
+        } catch (const std::exception& e) {
+          std::cerr << member.name << ": " << e.what() << std::endl;
+          ++failed;
+          continue;
+        }
+        for (const OutputSpec& output : outputs) {
+          writer.add(output.outFile, *output.memory);
+        }
+        ++succeeded;
+      }
+      writer.finish();
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      status = -1;
+    }
+    if (in != stdin) {
+      fclose(in);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << "Shrunk " << succeeded << " images, " << failed << " failed, in "
+              << elapsed.count() << "s" << std::endl;
+    if (failed > 0) {
+      status = -1;
+    }
+    return status;
+  }
+};
@@ -0,0 +1,9 @@
+#pragma once
+
+// Tar stream mode: shrinks every png member of a tar archive (a file or
+// stdin) as it streams past and writes the outputs as another tar archive,
+// so many small images become one sequential read and one sequential write
+namespace TarStream {
+  // Entry point for `pngshrink tar ...`, argv[0] is "tar"
+  int tarMain(int argc, char* argv[]);
+};
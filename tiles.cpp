@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "copng.h"
+#include "tiles.h"
+
+namespace Tiles {
+  namespace {
+    void appendData(png_structp png_ptr, png_bytep data, png_size_t length) {
+      auto* out = (std::vector<png_byte>*)png_get_io_ptr(png_ptr);
+      out->insert(out->end(), data, data + length);
+    }
+
+    void flushData(png_structp png_ptr) {}
+
+    // Runs work(0..count-1) spread over the cores, the calling thread
+    // included, and rethrows the first exception any of them hit
+    void parallelFor(unsigned count, const std::function<void(unsigned)>& work) {
+      std::atomic<unsigned> next = 0;
+      std::exception_ptr error;
+      std::mutex errorMutex;
+      auto worker = [&] {
+        for (unsigned i = next++; i < count; i = next++) {
+          try {
+            work(i);
+          } catch (...) {
+            std::lock_guard lock(errorMutex);
+            if (!error) {
+              error = std::current_exception();
+            }
+          }
+        }
+      };
+
+      unsigned numThreads = std::min(count, std::max(1u, std::thread::hardware_concurrency()));
+      std::vector<std::thread> threads;
+      for (unsigned i = 1; i < numThreads; ++i) {
+        threads.emplace_back(worker);
+      }
+      worker();
+      for (auto& thread : threads) {
+        thread.join();
+      }
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+  };
+
+  std::vector<png_byte> encodePng(const PixelFormat& format, png_uint_32 width,
+      png_uint_32 height, const png_byte* rows, size_t rowStride) {
+    std::vector<png_byte> out;
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+        (png_voidp)nullptr, png_err, NULL);
+    if (!png_ptr) {
+      throw std::runtime_error("Error creating ping write info ptr");
+    }
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+      png_destroy_write_struct(&png_ptr, (png_infop*)nullptr);
+      throw std::runtime_error("Error creating ping write info ptr");
+    }
+
+    try {
+      png_set_write_fn(png_ptr, &out, appendData, flushData);
+      png_set_IHDR(png_ptr, info_ptr, width, height, format.bitDepth, format.colorType,
+          PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+      if (!format.palette.empty()) {
+        png_set_PLTE(png_ptr, info_ptr, format.palette.data(), format.palette.size());
+      }
+      if (format.hasTrans) {
+        png_set_tRNS(png_ptr, info_ptr, format.transAlpha.data(), format.transAlpha.size(),
+            (png_color_16p)&format.transColor);
+      }
+      png_write_info(png_ptr, info_ptr);
+      png_set_packing(png_ptr);
+      for (png_uint_32 y = 0; y < height; ++y) {
+        png_write_row(png_ptr, rows + y * rowStride);
+      }
+      png_write_end(png_ptr, nullptr);
+    } catch (...) {
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      throw;
+    }
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return out;
+  }
+
+  Tiler::Tiler(TileSpec _spec, PixelFormat _format,
+      std::vector<std::pair<png_uint_32, png_uint_32>> levelSizes)
+      : spec(std::move(_spec)), format(std::move(_format)) {
+    if (spec.tileSize == 0) {
+      throw std::runtime_error("Tile size must be greater than 0");
+    }
+    for (auto [width, height] : levelSizes) {
+      levels.push_back({.width = width, .height = height});
+      // XYZ zoom 0 is the level that fits in one tile, nothing smaller
+      if (spec.layout == Layout::Xyz && width <= spec.tileSize && height <= spec.tileSize) {
+        break;
+      }
+    }
+    name = std::filesystem::path(spec.outPath).filename();
+    if (spec.archive) {
+      archive = std::make_unique<TarWriter>(spec.outPath + ".tar");
+    }
+  }
+
+  Tiler::~Tiler() = default;
+
+  std::string Tiler::tilePath(size_t level, unsigned column, unsigned row) const {
+    // Both layouts count levels up from the smallest one, 1x1 for DZI and
+    // the single tile for XYZ
+    std::string levelName = std::to_string(levels.size() - 1 - level);
+    if (spec.layout == Layout::Dzi) {
+      return name + "_files/" + levelName + "/" + std::to_string(column) + "_" +
+          std::to_string(row) + ".png";
+    }
+    return name + "/" + levelName + "/" + std::to_string(column) + "/" +
+        std::to_string(row) + ".png";
+  }
+
+  void Tiler::writeFile(const std::string& relPath, const std::vector<png_byte>& data) {
+    if (archive) {
+      archive->add(relPath, data);
+      return;
+    }
+    std::filesystem::path path = std::filesystem::path(spec.outPath).parent_path() / relPath;
+    if (path.has_parent_path()) {
+      // A bare outPath puts the .dzi file in the working directory
+      std::filesystem::create_directories(path.parent_path());
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write((const char*)data.data(), data.size());
+    if (!out) {
+      throw std::runtime_error("Can't write tile " + path.string());
+    }
+  }
+
+  void Tiler::addRow(size_t level, png_const_bytep row) {
+    if (level >= levels.size()) {
+      // Below XYZ zoom 0
+      return;
+    }
+    Level& tileLevel = levels[level];
+    size_t rowBytes = tileLevel.width * format.pixelBytes;
+    if (tileLevel.band.empty()) {
+      tileLevel.band.resize(spec.tileSize * rowBytes);
+    }
+    memcpy(tileLevel.band.data() + tileLevel.bandRows * rowBytes, row, rowBytes);
+    if (++tileLevel.bandRows == spec.tileSize) {
+      flushBand(level);
+    }
+  }
+
+  void Tiler::flushBand(size_t level) {
+    Level& tileLevel = levels[level];
+    if (tileLevel.bandRows == 0) {
+      return;
+    }
+    size_t rowBytes = tileLevel.width * format.pixelBytes;
+    unsigned columns = (tileLevel.width + spec.tileSize - 1) / spec.tileSize;
+
+    // Encoding is the expensive part and every tile is independent, writing
+    // stays in order so the layout (and any archive) is deterministic
+    std::vector<std::vector<png_byte>> encoded(columns);
+    parallelFor(columns, [&](unsigned column) {
+      png_uint_32 left = column * spec.tileSize;
+      png_uint_32 tileWidth = std::min<png_uint_32>(spec.tileSize, tileLevel.width - left);
+      encoded[column] = encodePng(format, tileWidth, tileLevel.bandRows,
+          tileLevel.band.data() + left * format.pixelBytes, rowBytes);
+    });
+    for (unsigned column = 0; column < columns; ++column) {
+      writeFile(tilePath(level, column, tileLevel.bandIndex), encoded[column]);
+    }
+
+    tileLevel.bandRows = 0;
+    ++tileLevel.bandIndex;
+  }
+
+  void Tiler::finish() {
+    for (size_t level = 0; level < levels.size(); ++level) {
+      flushBand(level);
+      // Done with this level, don't hold on to its band
+      std::vector<png_byte>().swap(levels[level].band);
+    }
+
+    if (spec.layout == Layout::Dzi) {
+      std::string dzi = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+          "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"png\" "
+          "Overlap=\"0\" TileSize=\"" + std::to_string(spec.tileSize) + "\">\n"
+          "  <Size Width=\"" + std::to_string(levels[0].width) + "\" Height=\"" +
+          std::to_string(levels[0].height) + "\"/>\n"
+          "</Image>\n";
+      writeFile(name + ".dzi", std::vector<png_byte>(dzi.begin(), dzi.end()));
+    }
+    if (archive) {
+      archive->finish();
+    }
+  }
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "png.h"
+
+#include "tar.h"
+
+// Cuts every level of a mip chain into square tiles as the rows stream in.
+// Each level only buffers one band (tileSize rows) before its tiles are
+// encoded, in parallel, and written out
+namespace Tiles {
+  enum class Layout {
+    // name.dzi plus name_files/<level>/<col>_<row>.png
+    Dzi,
+    // name/<level>/<col>/<row>.png
+    Xyz,
+  };
+
+  struct TileSpec {
+    // Path without extension, the layout adds its own
+    std::string outPath;
+    unsigned tileSize = 256;
+    Layout layout = Layout::Dzi;
+    // Write everything into outPath.tar instead of a directory tree
+    bool archive = false;
+  };
+
+  // What every tile png is encoded as, copied from the input header
+  struct PixelFormat {
+    int bitDepth = 8;
+    int colorType = PNG_COLOR_TYPE_RGB;
+    size_t pixelBytes = 3;
+    std::vector<png_color> palette;
+    std::vector<png_byte> transAlpha;
+    png_color_16 transColor = {};
+    bool hasTrans = false;
+  };
+
+  // Encodes rows (one pixel per byte for depths under 8) into a png in memory
+  std::vector<png_byte> encodePng(const PixelFormat& format, png_uint_32 width,
+      png_uint_32 height, const png_byte* rows, size_t rowStride);
+
+  class Tiler {
+   public:
+    // levelSizes holds the width and height of each level, the full size
+    // base image first, then every halving down to 1x1. The XYZ layout
+    // stops at the first level that fits in one tile and ignores the rest
+    Tiler(TileSpec spec, PixelFormat format,
+        std::vector<std::pair<png_uint_32, png_uint_32>> levelSizes);
+    ~Tiler();
+
+    // Adds the next row of a level (0 is the base image)
+    void addRow(size_t level, png_const_bytep row);
+
+    // Writes out the partly filled last bands and the layout's metadata
+    void finish();
+
+   private:
+    struct Level {
+      png_uint_32 width = 0;
+      png_uint_32 height = 0;
+      std::vector<png_byte> band;
+      unsigned bandRows = 0;
+      unsigned bandIndex = 0;
+    };
+
+    void flushBand(size_t level);
+    std::string tilePath(size_t level, unsigned column, unsigned row) const;
+    void writeFile(const std::string& relPath, const std::vector<png_byte>& data);
+
+    TileSpec spec;
+    PixelFormat format;
+    std::vector<Level> levels;
+    std::unique_ptr<TarWriter> archive;
+    // Base name of outPath, paths inside an archive are relative to it
+    std::string name;
+  };
+};
@@ -0,0 +1,146 @@
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "trace.h"
+
+namespace Trace {
+#ifdef PNGSHRINK_TRACE
+  namespace {
+    // A thread's oldest events are overwritten once it has recorded more
+    constexpr size_t ringSize = 1 << 16;
+
+    // Fields are atomics only so a dump reading a slot as it is overwritten
+    // isn't undefined, all of it is relaxed
+    struct Event {
+      std::atomic<const char*> name;
+      std::atomic<uint64_t> start;
+      std::atomic<uint64_t> end;
+    };
+
+    // Written by its own thread only. The writer claims an index before
+    // touching its slot and publishes it after, so a reader can copy the
+    // ring while it is written and then drop whatever was claimed under it
+    struct Ring {
+      pid_t tid = 0;
+      std::atomic<uint64_t> claimed = 0;
+      std::atomic<uint64_t> head = 0;
+      std::array<Event, ringSize> events;
+    };
+
+    // Rings outlive their threads, so a dump still has what exited threads
+    // (finished jobs) recorded
+    std::mutex ringsMutex;
+    std::vector<std::shared_ptr<Ring>> rings;
+
+    Ring& threadRing() {
+      thread_local std::shared_ptr<Ring> ring = [] {
+        auto ring = std::make_shared<Ring>();
+        ring->tid = gettid();
+        std::lock_guard lock(ringsMutex);
+        rings.push_back(ring);
+        return ring;
+      }();
+      return *ring;
+    }
+
+    struct Copied {
+      const char* name;
+      uint64_t start;
+      uint64_t end;
+    };
+
+    std::vector<Copied> snapshot(const Ring& ring) {
+      uint64_t head = ring.head.load(std::memory_order_acquire);
+      uint64_t first = head > ringSize ? head - ringSize : 0;
+      std::vector<Copied> events;
+      events.reserve(head - first);
+      for (uint64_t i = first; i < head; ++i) {
+        const Event& event = ring.events[i % ringSize];
+        events.push_back({event.name.load(std::memory_order_relaxed),
+            event.start.load(std::memory_order_relaxed), event.end.load(std::memory_order_relaxed)});
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      // Index i's slot is reused by index i + ringSize
+      uint64_t claimed = ring.claimed.load(std::memory_order_relaxed);
+      uint64_t firstIntact = claimed >= ringSize ? claimed - ringSize + 1 : 0;
+      if (firstIntact > first) {
+        events.erase(events.begin(), events.begin() + std::min(firstIntact - first, (uint64_t)events.size()));
+      }
+      return events;
+    }
+  };
+
+  uint64_t now() {
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+  }
+
+  void record(const char* name, uint64_t start, uint64_t end) {
+    Ring& ring = threadRing();
+    uint64_t index = ring.head.load(std::memory_order_relaxed);
+    ring.claimed.store(index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    Event& event = ring.events[index % ringSize];
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(start, std::memory_order_relaxed);
+    event.end.store(end, std::memory_order_relaxed);
+    ring.head.store(index + 1, std::memory_order_release);
+  }
+
+  std::string json() {
+    std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    std::vector<std::shared_ptr<Ring>> allRings;
+    {
+      std::lock_guard lock(ringsMutex);
+      allRings = rings;
+    }
+    // Timestamps stay on the monotonic clock, in microseconds, so traces
+    // from several processes (pool workers) line up
+    std::string pid = std::to_string(getpid());
+    bool first = true;
+    char times[64];
+    for (const std::shared_ptr<Ring>& ring : allRings) {
+      std::string tid = std::to_string(ring->tid);
+      for (const Copied& event : snapshot(*ring)) {
+        snprintf(times, sizeof(times), ",\"ts\":%.3f,\"dur\":%.3f", event.start / 1e3,
+            (event.end - event.start) / 1e3);
+        out += first ? "\n" : ",\n";
+        out += "{\"name\":" + Json::quote(event.name) + ",\"ph\":\"X\"" + times +
+            ",\"pid\":" + pid + ",\"tid\":" + tid + "}";
+        first = false;
+      }
+    }
+    out += "\n]}\n";
+    return out;
+  }
+
+  bool dump(const std::string& path) {
+    std::ofstream out(path, std::ios::trunc);
+    out << json();
+    return (bool)out;
+  }
+
+  void dumpAtExit(const std::string& path) {
+    static std::string exitPath;
+    if (exitPath.empty()) {
+      std::atexit([] {
+        if (!dump(exitPath)) {
+          fprintf(stderr, "Can't write trace to %s\n", exitPath.c_str());
+        }
+      });
+    }
+    exitPath = path;
+  }
+#endif
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Timed spans around the hot paths of a job (reading, png_process_data, the
+// libpng callbacks, encoding rows and flushes), for when a job is slow and
+// it isn't clear where the time went. Only recorded in builds with
+// -DPNGSHRINK_TRACE (`make pngshrink-trace`), anywhere else TRACE_SPAN is
+// an empty statement and costs nothing.
+//
+// Each thread records into a ring of its own latest events, with no locks
+// or writes shared with other threads. json() gathers every thread's ring
+// into the Chrome trace event format, which chrome://tracing and Perfetto
+// open
+namespace Trace {
+  // Whether this build records anything. A constant, so callers can guard
+  // the functions below with `if constexpr` and leave nothing of the trace
+  // in other builds
+#ifdef PNGSHRINK_TRACE
+  inline constexpr bool compiledIn() { return true; }
+#else
+  inline constexpr bool compiledIn() { return false; }
+#endif
+
+  // These are only defined when compiledIn()
+
+  // Every thread's recorded spans as a Chrome trace ({"traceEvents": [...]}).
+  // May be called from any thread while others keep recording
+  std::string json();
+  // Writes json() to path, false if that failed
+  bool dump(const std::string& path);
+  // Dumps to path when the process exits normally
+  void dumpAtExit(const std::string& path);
+
+#ifdef PNGSHRINK_TRACE
+  // Nanoseconds on a monotonic clock
+  uint64_t now();
+  // name must outlive the trace, i.e. a string literal
+  void record(const char* name, uint64_t start, uint64_t end);
+
+  class Span {
+   public:
+    explicit Span(const char* _name) : name(_name), start(now()) {}
+    ~Span() { record(name, start, now()); }
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+   private:
+    const char* name;
+    uint64_t start;
+  };
+#endif
+};
+
+#ifdef PNGSHRINK_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Times the rest of the enclosing scope as one span called name
+#define TRACE_SPAN(name) Trace::Span TRACE_CONCAT(traceSpan, __LINE__)(name)
+#else
+#define TRACE_SPAN(name) ((void)0)
+#endif
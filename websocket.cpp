@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "websocket.h"
+
+namespace WebSocket {
+  namespace {
+    const char* handshakeGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    // RFC 6455 caps control frame payloads
+    constexpr uint64_t maxControlBytes = 125;
+
+    uint32_t rotl(uint32_t x, int r) {
+      return (x << r) | (x >> (32 - r));
+    }
+
+    // SHA-1 is only needed for the handshake, a few dozen bytes per
+    // connection, so a plain one is plenty
+    std::array<uint8_t, 20> sha1(std::string_view message) {
+      uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+      std::string padded(message);
+      padded += (char)0x80;
+      while (padded.size() % 64 != 56) {
+        padded += (char)0;
+      }
+      uint64_t bits = (uint64_t)message.size() * 8;
+      for (int i = 7; i >= 0; --i) {
+        padded += (char)(bits >> (i * 8));
+      }
+
+      for (size_t block = 0; block < padded.size(); block += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+          const auto* p = (const uint8_t*)padded.data() + block + i * 4;
+          w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        }
+        for (int i = 16; i < 80; ++i) {
+          w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i) {
+          uint32_t f, k;
+          if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+          } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+          } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+          } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+          }
+          uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+          e = d;
+          d = c;
+          c = rotl(b, 30);
+          b = a;
+          a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+      }
+
+      std::array<uint8_t, 20> digest;
+      for (int i = 0; i < 20; ++i) {
+        digest[i] = (uint8_t)(h[i / 4] >> (24 - (i % 4) * 8));
+      }
+      return digest;
+    }
+
+    std::string base64(std::span<const uint8_t> data) {
+      const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+      std::string encoded;
+      for (size_t i = 0; i < data.size(); i += 3) {
+        uint32_t group = (uint32_t)data[i] << 16;
+        if (i + 1 < data.size()) {
+          group |= (uint32_t)data[i + 1] << 8;
+        }
+        if (i + 2 < data.size()) {
+          group |= data[i + 2];
+        }
+        encoded += alphabet[(group >> 18) & 63];
+        encoded += alphabet[(group >> 12) & 63];
+        encoded += i + 1 < data.size() ? alphabet[(group >> 6) & 63] : '=';
+        encoded += i + 2 < data.size() ? alphabet[group & 63] : '=';
+      }
+      return encoded;
+    }
+  };
+
+  std::string acceptKey(std::string_view key) {
+    std::array<uint8_t, 20> digest = sha1(std::string(key) + handshakeGuid);
+    return base64(digest);
+  }
+
+  size_t FrameDecoder::feed(std::span<char> data, const Handler& handler) {
+    size_t used = 0;
+    while (used < data.size()) {
+      if (!inFrame) {
+        // The whole header has to be there, at most 14 bytes
+        const auto* header = (const uint8_t*)data.data() + used;
+        size_t available = data.size() - used;
+        if (available < 2) {
+          break;
+        }
+        if (header[0] & 0x70) {
+          throw ProtocolError(ProtocolErrorCode, "Reserved bits set without an extension");
+        }
+        if (!(header[1] & 0x80)) {
+          throw ProtocolError(ProtocolErrorCode, "Client frames must be masked");
+        }
+        size_t headerSize = 2;
+        uint64_t length = header[1] & 0x7f;
+        if (length == 126) {
+          headerSize += 2;
+        } else if (length == 127) {
+          headerSize += 8;
+        }
+        if (available < headerSize + 4) {
+          break;
+        }
+        if (length >= 126) {
+          length = 0;
+          for (size_t i = 2; i < headerSize; ++i) {
+            length = (length << 8) | header[i];
+          }
+        }
+
+        frame.fin = header[0] & 0x80;
+        frame.opcode = (Opcode)(header[0] & 0x0f);
+        frame.length = length;
+        switch (frame.opcode) {
+          case Continuation:
+          case Text:
+          case Binary:
+            break;
+          case Close:
+          case Ping:
+          case Pong:
+            if (!frame.fin || length > maxControlBytes) {
+              throw ProtocolError(ProtocolErrorCode, "Control frames can't be fragmented or long");
+            }
+            break;
+          default:
+            throw ProtocolError(ProtocolErrorCode, "Unknown opcode");
+        }
+        memcpy(mask, header + headerSize, 4);
+        used += headerSize + 4;
+        inFrame = true;
+        payloadPos = 0;
+      }
+
+      bool control = frame.opcode >= Close;
+      uint64_t remaining = frame.length - payloadPos;
+      size_t available = data.size() - used;
+      if (control && available < remaining) {
+        break;
+      }
+      size_t length = (size_t)std::min<uint64_t>(remaining, available);
+      if (length == 0 && remaining > 0) {
+        break;
+      }
+      char* payload = data.data() + used;
+      for (size_t i = 0; i < length; ++i) {
+        payload[i] ^= mask[(payloadPos + i) % 4];
+      }
+      uint64_t offset = payloadPos;
+      used += length;
+      payloadPos += length;
+      if (payloadPos == frame.length) {
+        inFrame = false;
+      }
+      if (!handler(frame, {payload, length}, offset)) {
+        break;
+      }
+    }
+    return used;
+  }
+
+  void appendFrameHeader(std::string& out, Opcode opcode, bool fin, uint64_t length) {
+    out += (char)((fin ? 0x80 : 0) | opcode);
+    if (length < 126) {
+      out += (char)length;
+    } else if (length <= 0xffff) {
+      out += (char)126;
+      out += (char)(length >> 8);
+      out += (char)length;
+    } else {
+      out += (char)127;
+      for (int i = 7; i >= 0; --i) {
+        out += (char)(length >> (i * 8));
+      }
+    }
+  }
+
+  void appendFrame(std::string& out, Opcode opcode, std::string_view payload) {
+    appendFrameHeader(out, opcode, true, payload.size());
+    out += payload;
+  }
+
+  void appendClose(std::string& out, CloseCode code, std::string_view reason) {
+    std::string payload;
+    payload += (char)(code >> 8);
+    payload += (char)code;
+    payload += reason.substr(0, maxControlBytes - 2);
+    appendFrame(out, Close, payload);
+  }
+};
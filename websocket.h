@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Just enough of RFC 6455 for the server: the opening handshake's accept
+// key, an incremental parser for client frames and server frame writing.
+// No extensions, no subprotocols
+namespace WebSocket {
+  enum Opcode : uint8_t {
+    Continuation = 0x0,
+    Text = 0x1,
+    Binary = 0x2,
+    Close = 0x8,
+    Ping = 0x9,
+    Pong = 0xa,
+  };
+
+  // Close status codes used here
+  enum CloseCode : uint16_t {
+    NormalClosure = 1000,
+    GoingAway = 1001,
+    ProtocolErrorCode = 1002,
+    UnsupportedData = 1003,
+    InvalidPayload = 1007,
+  };
+
+  // Thrown for input the connection can't go on from, code goes in the
+  // close frame sent back
+  struct ProtocolError : std::runtime_error {
+    ProtocolError(CloseCode _code, const std::string& message)
+        : std::runtime_error(message), code(_code) {}
+    CloseCode code;
+  };
+
+  // Sec-WebSocket-Accept for a client's Sec-WebSocket-Key
+  std::string acceptKey(std::string_view key);
+
+  struct Frame {
+    Opcode opcode = Continuation;
+    bool fin = false;
+    uint64_t length = 0;
+  };
+
+  // Parses masked client frames as they arrive. Data frame payloads are
+  // handed out piece by piece as they come, without waiting for the rest
+  // of the frame, control frames only once they are whole
+  class FrameDecoder {
+   public:
+    // Gets each piece of payload, unmasked, and where in its frame it
+    // starts. Returning false stops parsing
+    using Handler = std::function<bool(const Frame&, std::string_view payload, uint64_t offset)>;
+
+    // Unmasks in place and returns how many bytes were used up. Throws
+    // ProtocolError on malformed frames
+    size_t feed(std::span<char> data, const Handler& handler);
+
+   private:
+    Frame frame;
+    bool inFrame = false;
+    uint8_t mask[4] = {};
+    uint64_t payloadPos = 0;
+  };
+
+  // Server frames are never masked
+  void appendFrameHeader(std::string& out, Opcode opcode, bool fin, uint64_t length);
+  void appendFrame(std::string& out, Opcode opcode, std::string_view payload);
+  void appendClose(std::string& out, CloseCode code, std::string_view reason);
+};